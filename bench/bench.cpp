@@ -0,0 +1,588 @@
+// Microbenchmarks for the code Read, Mix, and Write spend their time in.
+// Only needs libsndfile at runtime. The fixtures are generated every time
+// the benchmark runs. When built with libFLAC, it first checks that FLAC
+// files encoded on several threads have the same frames as libsndfile's,
+// and exits with 1 if they don't.
+//
+// Usage: damb-bench [fixture directory] [seconds of audio]
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <limits>
+
+#include <cstdio>
+#include <sndfile.h>
+
+#include "../src/shared.h"
+#include "../src/index.h"
+#include "../src/mapped.h"
+#include "../src/mixkernels.h"
+#include "../src/pcmfile.h"
+#ifdef HAVE_FLAC
+#include "../src/flacwriter.h"
+#endif
+
+
+static const int samplerate = 48000;
+// Frame rate of 24000/1001, the most common one.
+static const double samples_per_frame = samplerate * 1001 / 24000.0;
+
+static const double pi = 3.14159265358979323846;
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+static inline int64_t frameStart(int n) {
+    return (int64_t)(samples_per_frame * n + 0.5);
+}
+
+
+static void report(const char *name, int frames, int64_t samples, Clock::duration elapsed) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+
+    printf("%-36s %8d frames %10.0f ns/frame %10.2f Msamples/s\n",
+           name,
+           frames,
+           frames ? seconds * 1e9 / frames : 0.0,
+           seconds > 0 ? samples / seconds / 1e6 : 0.0);
+    fflush(stdout);
+}
+
+
+// A few sines with a little noise, so that the lossless encoders have
+// something realistic to compress.
+static void generateSamples(std::vector<float> &samples, int64_t length, int channels) {
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> noise(-0.01f, 0.01f);
+
+    samples.resize(length * channels);
+
+    for (int64_t i = 0; i < length; i++) {
+        double t = (double)i / samplerate;
+        for (int c = 0; c < channels; c++)
+            samples[i * channels + c] = (float)(0.3 * std::sin(2 * pi * (220 + 110 * c) * t) +
+                                                0.2 * std::sin(2 * pi * 3520 * t)) + noise(rng);
+    }
+}
+
+
+static bool writeFixture(const std::string &filename, int format, const std::vector<float> &samples, int64_t length, int channels) {
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+    sfinfo.samplerate = samplerate;
+    sfinfo.channels = channels;
+    sfinfo.format = format;
+
+    if (!sf_format_check(&sfinfo)) {
+        printf("%s: libsndfile can't write this format, skipped.\n", filename.c_str());
+        return false;
+    }
+
+    SNDFILE *sndfile = sf_open(filename.c_str(), SFM_WRITE, &sfinfo);
+    if (!sndfile) {
+        printf("%s: %s\n", filename.c_str(), sf_strerror(NULL));
+        return false;
+    }
+
+    bool ok = sf_writef_float(sndfile, samples.data(), length) == length;
+    sf_close(sndfile);
+
+    return ok;
+}
+
+
+// Reads frames in the given order, seeking only when the next frame doesn't
+// start where the previous one ended, like a single Read handle does.
+static void benchRead(const char *name, const std::string &filename, const std::vector<int> &order, bool use_index) {
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+
+    SNDFILE *sndfile = sf_open(filename.c_str(), SFM_READ, &sfinfo);
+    if (!sndfile)
+        return;
+
+    DambSeekIndex index;
+    DambSeekStream *stream = NULL;
+    std::string error;
+    if (use_index && getSeekIndex(filename, "", true, false, &index, &error) != 1) {
+        sf_close(sndfile);
+        return;
+    }
+
+    int sample_type = getSampleType(sfinfo.format);
+    int frame_bytes = sfinfo.channels * getSampleSize(sample_type);
+    std::vector<uint8_t> buffer((size_t)(samples_per_frame + 2) * frame_bytes);
+
+    int64_t position = 0;
+    int64_t samples = 0;
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < order.size(); i++) {
+        int64_t sample_start = frameStart(order[i]);
+        int64_t sample_count = frameStart(order[i] + 1) - sample_start;
+
+        if (position != sample_start) {
+            if (use_index) {
+                const DambSeekPoint *point = findSeekPoint(index, sample_start);
+                sf_close(sndfile);
+                closeSeekStream(stream);
+                sndfile = openAtSeekPoint(filename, index, *point, &stream);
+                if (!sndfile)
+                    return;
+                for (position = point->sample; position < sample_start; ) {
+                    sf_count_t count = std::min<sf_count_t>(sample_start - position, (sf_count_t)samples_per_frame);
+                    position += sf_readf_float(sndfile, (float *)buffer.data(), count);
+                }
+            } else {
+                sf_seek(sndfile, sample_start, SEEK_SET);
+            }
+        }
+
+        sf_count_t got;
+        if (sample_type == SF_FORMAT_PCM_16)
+            got = sf_readf_short(sndfile, (short *)buffer.data(), sample_count);
+        else
+            got = sf_readf_float(sndfile, (float *)buffer.data(), sample_count);
+
+        position = sample_start + got;
+        samples += got;
+    }
+
+    report(name, (int)order.size(), samples, Clock::now() - start);
+
+    sf_close(sndfile);
+    closeSeekStream(stream);
+}
+
+
+static void benchReadMapped(const char *name, const std::string &filename, const std::vector<int> &order) {
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+
+    SNDFILE *sndfile = sf_open(filename.c_str(), SFM_READ, &sfinfo);
+    if (!sndfile)
+        return;
+    sf_close(sndfile);
+
+    DambMappedFile mapped;
+    if (!mapAudioFile(filename, sfinfo, &mapped))
+        return;
+
+    int frame_bytes = sfinfo.channels * getSampleSize(getSampleType(sfinfo.format));
+    std::vector<uint8_t> buffer((size_t)(samples_per_frame + 2) * frame_bytes);
+    int64_t samples = 0;
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < order.size(); i++) {
+        int64_t sample_start = frameStart(order[i]);
+        int64_t sample_count = std::min<int64_t>(frameStart(order[i] + 1), mapped.length) - sample_start;
+
+        // What propSetData does with the samples.
+        memcpy(buffer.data(), mapped.samples + sample_start * frame_bytes, sample_count * frame_bytes);
+        samples += sample_count;
+    }
+
+    report(name, (int)order.size(), samples, Clock::now() - start);
+
+    unmapAudioFile(&mapped);
+}
+
+
+template<class T>
+static void fillSamples(std::vector<uint8_t> &buffer, const std::vector<float> &source, size_t count) {
+    buffer.resize(count * sizeof(T));
+    T *out = (T *)buffer.data();
+
+    for (size_t i = 0; i < count; i++) {
+        float value = source[i % source.size()];
+        if (std::numeric_limits<T>::is_integer)
+            out[i] = (T)(value * (double)std::numeric_limits<T>::max());
+        else
+            out[i] = (T)value;
+    }
+}
+
+
+static void benchMix(int sample_type, const char *type_name, int channels, const std::vector<float> &source, int frames) {
+    size_t count = (size_t)(samples_per_frame + 0.5) * channels;
+
+    std::vector<uint8_t> a, b;
+    if (sample_type == SF_FORMAT_PCM_16) {
+        fillSamples<int16_t>(a, source, count);
+        fillSamples<int16_t>(b, source, count + 1);
+    } else if (sample_type == SF_FORMAT_PCM_32) {
+        fillSamples<int32_t>(a, source, count);
+        fillSamples<int32_t>(b, source, count + 1);
+    } else if (sample_type == SF_FORMAT_FLOAT) {
+        fillSamples<float>(a, source, count);
+        fillSamples<float>(b, source, count + 1);
+    } else {
+        fillSamples<double>(a, source, count);
+        fillSamples<double>(b, source, count + 1);
+    }
+
+    std::vector<uint8_t> dst(a.size());
+    const void *srcs[2] = { a.data(), b.data() + getSampleSize(sample_type) };
+    const double levels[2] = { 0.7, 0.5 };
+
+    DambMixFunction mix = getMixFunction(sample_type);
+
+    Clock::time_point start = Clock::now();
+
+    for (int i = 0; i < frames; i++)
+        mix(dst.data(), srcs, levels, 2, count);
+
+    char name[64];
+    snprintf(name, sizeof(name), "mix %s %dch (%s)", type_name, channels, getMixInstructionSet());
+    report(name, frames, (int64_t)frames * (count / channels), Clock::now() - start);
+}
+
+
+static void benchWrite(const char *name, const std::string &filename, int format, const std::vector<float> &samples, int64_t length, int channels) {
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+    sfinfo.samplerate = samplerate;
+    sfinfo.channels = channels;
+    sfinfo.format = format;
+
+    if (!sf_format_check(&sfinfo))
+        return;
+
+    Clock::time_point start = Clock::now();
+
+    SNDFILE *sndfile = sf_open(filename.c_str(), SFM_WRITE, &sfinfo);
+    if (!sndfile)
+        return;
+
+    int frames = 0;
+    for (; frameStart(frames + 1) <= length; frames++) {
+        int64_t sample_start = frameStart(frames);
+        sf_writef_float(sndfile, samples.data() + sample_start * channels, frameStart(frames + 1) - sample_start);
+    }
+
+    sf_close(sndfile);
+
+    report(name, frames, frameStart(frames), Clock::now() - start);
+    remove(filename.c_str());
+}
+
+
+static void benchWritePcm(const char *name, const std::string &filename, const std::vector<float> &samples, int64_t length, int channels) {
+    std::string error;
+
+    Clock::time_point start = Clock::now();
+
+    DambPcmFile *file = createPcmFile(filename, SF_FORMAT_W64, channels, samplerate, SF_FORMAT_FLOAT, length, &error);
+    if (!file)
+        return;
+
+    int frames = 0;
+    for (; frameStart(frames + 1) <= length; frames++) {
+        int64_t sample_start = frameStart(frames);
+        writePcmSamples(file, sample_start, samples.data() + sample_start * channels, frameStart(frames + 1) - sample_start);
+    }
+
+    closePcmFile(file, &error);
+
+    report(name, frames, frameStart(frames), Clock::now() - start);
+    remove(filename.c_str());
+}
+
+
+#ifdef HAVE_FLAC
+static void benchWriteFlacThreads(const char *name, const std::string &filename, const std::vector<float> &samples, int64_t length, int channels) {
+    std::string error;
+
+    Clock::time_point start = Clock::now();
+
+    DambFlacWriter *writer = createFlacWriter(filename, channels, samplerate, 16, 5, 4, &error);
+    if (!writer)
+        return;
+
+    int frames = 0;
+    for (; frameStart(frames + 1) <= length; frames++) {
+        int64_t sample_start = frameStart(frames);
+        writeFlacSamples(writer, samples.data() + sample_start * channels, SF_FORMAT_FLOAT, frameStart(frames + 1) - sample_start, &error);
+    }
+
+    closeFlacWriter(writer, &error);
+
+    report(name, frames, frameStart(frames), Clock::now() - start);
+    remove(filename.c_str());
+}
+
+
+// Writes the file the way Write does with flac_threads=1, where float
+// samples are converted before libsndfile gets them.
+static bool writeFlacSndfile(const std::string &filename, const void *samples, int sample_type, int bits, int compression_level, int64_t length, int channels) {
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+    sfinfo.samplerate = samplerate;
+    sfinfo.channels = channels;
+    sfinfo.format = SF_FORMAT_FLAC | (bits == 16 ? SF_FORMAT_PCM_16 : SF_FORMAT_PCM_24);
+
+    SNDFILE *sndfile = sf_open(filename.c_str(), SFM_WRITE, &sfinfo);
+    if (!sndfile)
+        return false;
+
+    double level = compression_level / 8.0;
+    sf_command(sndfile, SFC_SET_COMPRESSION_LEVEL, &level, sizeof(level));
+
+    std::vector<int32_t> converted;
+    if (sample_type == SF_FORMAT_FLOAT) {
+        converted.resize(length * channels);
+        for (size_t i = 0; i < converted.size(); i++)
+            converted[i] = floatToFlacSample(((const float *)samples)[i], bits);
+    }
+
+    bool ok = true;
+    for (int frame = 0; frameStart(frame) < length; frame++) {
+        int64_t start = frameStart(frame);
+        int64_t count = std::min(frameStart(frame + 1), length) - start;
+        int64_t offset = start * channels;
+
+        sf_count_t written;
+        if (sample_type == SF_FORMAT_PCM_16)
+            written = sf_writef_short(sndfile, (const short *)samples + offset, count);
+        else if (sample_type == SF_FORMAT_PCM_32)
+            written = sf_writef_int(sndfile, (const int *)samples + offset, count);
+        else
+            written = sf_writef_int(sndfile, converted.data() + offset, count);
+
+        ok = ok && written == count;
+    }
+
+    sf_close(sndfile);
+    return ok;
+}
+
+
+static bool writeFlacThreads(const std::string &filename, const void *samples, int sample_type, int bits, int compression_level, int64_t length, int channels) {
+    std::string error;
+
+    DambFlacWriter *writer = createFlacWriter(filename, channels, samplerate, bits, compression_level, 4, &error);
+    if (!writer)
+        return false;
+
+    bool ok = true;
+    for (int frame = 0; frameStart(frame) < length; frame++) {
+        int64_t start = frameStart(frame);
+        int64_t count = std::min(frameStart(frame + 1), length) - start;
+
+        ok = ok && writeFlacSamples(writer, (const char *)samples + start * channels * getSampleSize(sample_type), sample_type, count, &error);
+    }
+
+    return closeFlacWriter(writer, &error) && ok;
+}
+
+
+// The decoded samples, the MD5 signature from the STREAMINFO block, and the
+// encoded frames, which are everything after the metadata blocks. The
+// metadata itself is allowed to differ, in the vendor string for example.
+static bool readFlac(const std::string &filename, std::vector<int32_t> &samples, std::vector<uint8_t> &md5, std::vector<uint8_t> &frames) {
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+
+    SNDFILE *sndfile = sf_open(filename.c_str(), SFM_READ, &sfinfo);
+    if (!sndfile)
+        return false;
+
+    samples.resize(sfinfo.frames * sfinfo.channels);
+    bool ok = sf_readf_int(sndfile, samples.data(), sfinfo.frames) == sfinfo.frames;
+    sf_close(sndfile);
+
+    // "fLaC", the block header, and 18 bytes of STREAMINFO come first.
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+
+    md5.resize(16);
+    ok = ok && !fseek(file, 26, SEEK_SET) && fread(md5.data(), 1, md5.size(), file) == md5.size();
+
+    // Skips the metadata blocks, starting from the first one.
+    bool last = false;
+    ok = ok && !fseek(file, 4, SEEK_SET);
+    while (ok && !last) {
+        uint8_t block[4];
+        ok = fread(block, 1, 4, file) == 4;
+        if (!ok)
+            break;
+
+        last = block[0] & 0x80;
+        long length = (block[1] << 16) | (block[2] << 8) | block[3];
+        ok = ok && !fseek(file, length, SEEK_CUR);
+    }
+
+    frames.clear();
+    uint8_t buffer[65536];
+    size_t got;
+    while (ok && (got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        frames.insert(frames.end(), buffer, buffer + got);
+
+    fclose(file);
+
+    return ok;
+}
+
+
+// Both encoders must produce the same frames for every sample type and for
+// the compression levels that use different block sizes and stereo modes.
+// The length isn't a multiple of the block size, so the last block is
+// shorter, and it covers several of the FLAC writer's chunks.
+static bool checkFlacThreads(const std::string &dir) {
+    const int channels = 2;
+    const int64_t length = 1000000 + 777;
+
+    std::vector<float> source;
+    generateSamples(source, length, channels);
+
+    std::vector<uint8_t> s16, s32;
+    fillSamples<int16_t>(s16, source, source.size());
+    fillSamples<int32_t>(s32, source, source.size());
+
+    // Out of range float samples are clipped.
+    std::vector<float> floats = source;
+    floats[0] = 1.5f;
+    floats[1] = -1.5f;
+
+    struct {
+        const char *name;
+        const void *samples;
+        int sample_type;
+        int bits;
+    } inputs[] = {
+        { "s16", s16.data(), SF_FORMAT_PCM_16, 16 },
+        { "s24", s32.data(), SF_FORMAT_PCM_32, 24 },
+        { "float", floats.data(), SF_FORMAT_FLOAT, 16 },
+        { "float", floats.data(), SF_FORMAT_FLOAT, 24 },
+    };
+    const int levels[] = { 0, 1, 4, 8 };
+
+    std::string single = dir + "/damb-bench-check-1.flac";
+    std::string threads = dir + "/damb-bench-check-4.flac";
+
+    bool all_same = true;
+
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        for (int level : levels) {
+            std::vector<int32_t> single_samples, threads_samples;
+            std::vector<uint8_t> single_md5, threads_md5;
+            std::vector<uint8_t> single_frames, threads_frames;
+
+            bool same = writeFlacSndfile(single, inputs[i].samples, inputs[i].sample_type, inputs[i].bits, level, length, channels) &&
+                        writeFlacThreads(threads, inputs[i].samples, inputs[i].sample_type, inputs[i].bits, level, length, channels) &&
+                        readFlac(single, single_samples, single_md5, single_frames) &&
+                        readFlac(threads, threads_samples, threads_md5, threads_frames) &&
+                        single_samples.size() == (size_t)length * channels &&
+                        single_samples == threads_samples &&
+                        single_md5 == threads_md5 &&
+                        single_frames == threads_frames;
+
+            printf("check flac %s to %d bits, level %d, 4 threads: %s\n", inputs[i].name, inputs[i].bits, level, same ? "same" : "DIFFERENT");
+            all_same = all_same && same;
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+
+    remove(single.c_str());
+    remove(threads.c_str());
+
+    return all_same;
+}
+#endif
+
+
+int main(int argc, char **argv) {
+    std::string dir = argc > 1 ? argv[1] : ".";
+    double seconds = argc > 2 ? atof(argv[2]) : 60;
+    if (seconds <= 0)
+        seconds = 60;
+
+    const int channels = 2;
+    int64_t length = (int64_t)(seconds * samplerate);
+    int frames = 0;
+    while (frameStart(frames + 1) <= length)
+        frames++;
+
+    printf("%s, %.0f seconds of %d Hz stereo audio, %d frames\n\n", sf_version_string(), seconds, samplerate, frames);
+
+#ifdef HAVE_FLAC
+    if (!checkFlacThreads(dir))
+        return 1;
+#endif
+
+    std::vector<float> samples;
+    generateSamples(samples, length, channels);
+
+    std::string wav = dir + "/damb-bench.wav";
+    std::string flac = dir + "/damb-bench.flac";
+    std::string ogg = dir + "/damb-bench.ogg";
+
+    bool have_wav = writeFixture(wav, SF_FORMAT_WAV | SF_FORMAT_PCM_16, samples, length, channels);
+    bool have_flac = writeFixture(flac, SF_FORMAT_FLAC | SF_FORMAT_PCM_16, samples, length, channels);
+    bool have_ogg = writeFixture(ogg, SF_FORMAT_OGG | SF_FORMAT_VORBIS, samples, length, channels);
+
+    std::vector<int> sequential(frames);
+    for (int i = 0; i < frames; i++)
+        sequential[i] = i;
+
+    std::vector<int> random = sequential;
+    std::shuffle(random.begin(), random.end(), std::mt19937(2));
+
+    // Random access is much slower for the compressed formats.
+    std::vector<int> random_short(random.begin(), random.begin() + std::min(frames, 500));
+
+    if (have_wav) {
+        benchRead("read wav sequential", wav, sequential, false);
+        benchRead("read wav random", wav, random, false);
+        benchReadMapped("read wav mmap random", wav, random);
+    }
+    if (have_flac) {
+        benchRead("read flac sequential", flac, sequential, false);
+        benchRead("read flac random", flac, random_short, false);
+        benchRead("read flac random, index", flac, random_short, true);
+    }
+    if (have_ogg) {
+        benchRead("read ogg sequential", ogg, sequential, false);
+        benchRead("read ogg random", ogg, random_short, false);
+    }
+    printf("\n");
+
+    const int sample_types[] = { SF_FORMAT_PCM_16, SF_FORMAT_PCM_32, SF_FORMAT_FLOAT, SF_FORMAT_DOUBLE };
+    const char *type_names[] = { "s16", "s32", "float", "double" };
+    const int channel_counts[] = { 1, 2, 6 };
+
+    for (int t = 0; t < 4; t++)
+        for (int c = 0; c < 3; c++)
+            benchMix(sample_types[t], type_names[t], channel_counts[c], samples, frames);
+    printf("\n");
+
+    std::string out = dir + "/damb-bench-out";
+    benchWrite("write wav s16", out + ".wav", SF_FORMAT_WAV | SF_FORMAT_PCM_16, samples, length, channels);
+    benchWrite("write w64 float", out + ".w64", SF_FORMAT_W64 | SF_FORMAT_FLOAT, samples, length, channels);
+    benchWritePcm("write w64 float, pwrite", out + ".w64", samples, length, channels);
+    benchWrite("write flac s16", out + ".flac", SF_FORMAT_FLAC | SF_FORMAT_PCM_16, samples, length, channels);
+#ifdef HAVE_FLAC
+    benchWriteFlacThreads("write flac s16, 4 threads", out + ".flac", samples, length, channels);
+#endif
+    benchWrite("write ogg vorbis", out + ".ogg", SF_FORMAT_OGG | SF_FORMAT_VORBIS, samples, length, channels);
+
+    remove(wav.c_str());
+    remove(flac.c_str());
+    remove(ogg.c_str());
+    remove((flac + ".dambidx").c_str());
+
+    return 0;
+}
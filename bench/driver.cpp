@@ -0,0 +1,1394 @@
+// Runs the filters without VapourSynth, through a small stand-in for the
+// parts of the VSAPI they use, and reports how long each frame took and the
+// total throughput. Frames are requested from a pool of worker threads the
+// same way VapourSynth does it: arInitial, the requested frames, and then
+// arAllFramesReady. The source clip is always a blank clip as long as the
+// input files, unless --source is given, in which case Source is used
+// instead of Read. Several input files are read one after the other by a
+// single Read.
+//
+// Usage: damb-driver [options] input...
+//
+//   -t, --threads N        Number of worker threads. Default: number of CPUs.
+//   -n, --requests N       Number of frames requested at once. Default: threads.
+//   -o, --order ORDER      sequential, reverse, random, or strided[:STEP].
+//   -c, --cache N          Number of frames each filter keeps. Default: 32.
+//   --fps NUM/DEN          Frame rate of the blank clip. Default: 24000/1001.
+//   -s, --source           Read the input with Source, without a blank clip.
+//   --frames N             Only request the first N frames.
+//   -m, --mix FILE         Read FILE as well and Mix it with the clip.
+//   -f, --filter NAME      Apply the filter NAME (Write, Resample, ...).
+//   -a, --arg KEY=VALUE    Argument for the last filter, or Read (or Source)
+//                          before any other filter. Repeat the key to pass an array.
+//
+// The counters of the filters created with stats=1 are printed at the end.
+//
+// Example:
+//
+//   damb-driver -t 8 -o random in.flac -f Convert -a sample_type=float -f Write -a file=out.w64
+
+#include <cstdint>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include <cstdio>
+#include <VapourSynth.h>
+#include <sndfile.h>
+
+#include "../src/shared.h"
+#include "../src/layout.h"
+
+
+VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin);
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+struct DriverFrame;
+
+
+struct DriverValue {
+    int64_t i = 0;
+    double f = 0;
+    std::shared_ptr<const std::string> data;
+    std::shared_ptr<VSNode> node;
+    std::shared_ptr<DriverFrame> frame;
+};
+
+
+struct DriverProp {
+    // 'i', 'f', 's', 'c', or 'v', like propGetType.
+    char type;
+    std::vector<DriverValue> values;
+};
+
+
+struct VSMap {
+    std::map<std::string, DriverProp> props;
+    std::string error;
+    bool failed = false;
+};
+
+
+struct DriverFrame {
+    VSMap props;
+    // Only frames made with newVideoFrame have pixels, one plane of them.
+    std::vector<uint8_t> pixels;
+    int stride = 0;
+};
+
+
+struct VSFrameRef {
+    std::shared_ptr<DriverFrame> frame;
+};
+
+
+struct VSNodeRef {
+    std::shared_ptr<VSNode> node;
+};
+
+
+// Called with the frame, or with NULL and an error message.
+typedef std::function<void(const std::shared_ptr<DriverFrame> &frame, const std::string &error)> DriverCallback;
+
+
+// One frame being produced by one filter.
+struct VSFrameContext {
+    std::shared_ptr<VSNode> node;
+    int n = 0;
+    void *frame_data = nullptr;
+
+    // Filled by requestFrameFilter during arInitial.
+    std::vector<std::pair<std::shared_ptr<VSNode>, int>> requests;
+
+    std::mutex lock;
+    std::map<std::pair<VSNode *, int>, std::shared_ptr<DriverFrame>> frames;
+    std::atomic<int> pending;
+    bool request_failed = false;
+    std::string request_error;
+
+    bool failed = false;
+    std::string error;
+
+    // Guarded by the node's lock.
+    std::vector<DriverCallback> waiters;
+};
+
+
+struct VSNode {
+    std::string name;
+    VSFilterGetFrame get_frame = nullptr;
+    VSFilterFree free = nullptr;
+    int mode = fmParallel;
+    int flags = 0;
+    void *instance_data = nullptr;
+
+    VSVideoInfo vi;
+    bool have_vi = false;
+
+    // Held around the filter's getFrame in the modes that aren't fmParallel.
+    std::mutex serial;
+
+    std::mutex lock;
+    // Most recently used first.
+    std::list<std::pair<int, std::shared_ptr<DriverFrame>>> cache;
+    std::map<int, std::shared_ptr<VSFrameContext>> in_flight;
+
+    ~VSNode();
+};
+
+
+struct VSCore {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+    bool stop = false;
+
+    size_t cache_size = 32;
+};
+
+
+struct DriverFunction {
+    std::string args;
+    VSPublicFunction func;
+    void *data;
+};
+
+
+struct DriverArgument {
+    std::string name;
+    std::string type;
+    bool array;
+    bool optional;
+};
+
+
+static VSAPI api;
+static VSCore core;
+static std::map<std::string, DriverFunction> functions;
+
+
+VSNode::~VSNode() {
+    if (free)
+        free(instance_data, &core, &api);
+}
+
+
+static void workerThread() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(core.lock);
+            core.wake.wait(guard, [] { return core.stop || !core.tasks.empty(); });
+
+            // Whatever is left is finished before stopping.
+            if (core.tasks.empty())
+                return;
+
+            task = std::move(core.tasks.front());
+            core.tasks.pop_front();
+        }
+
+        task();
+    }
+}
+
+
+static void startThreads(int threads) {
+    for (int i = 0; i < threads; i++)
+        core.threads.push_back(std::thread(workerThread));
+}
+
+
+static void stopThreads() {
+    {
+        std::lock_guard<std::mutex> guard(core.lock);
+        core.stop = true;
+    }
+    core.wake.notify_all();
+
+    for (size_t i = 0; i < core.threads.size(); i++)
+        core.threads[i].join();
+    core.threads.clear();
+}
+
+
+static void postTask(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> guard(core.lock);
+        core.tasks.push_back(std::move(task));
+    }
+    core.wake.notify_one();
+}
+
+
+static void runFilter(const std::shared_ptr<VSFrameContext> &ctx, int reason);
+
+
+// Frames that are cached or already being produced are shared, like
+// VapourSynth does it. The callback may be called before this returns.
+static void requestFrame(const std::shared_ptr<VSNode> &node, int n, DriverCallback callback) {
+    std::shared_ptr<DriverFrame> cached;
+    std::shared_ptr<VSFrameContext> ctx;
+
+    {
+        std::lock_guard<std::mutex> guard(node->lock);
+
+        for (auto it = node->cache.begin(); it != node->cache.end(); it++) {
+            if (it->first == n) {
+                cached = it->second;
+                node->cache.splice(node->cache.begin(), node->cache, it);
+                break;
+            }
+        }
+
+        if (!cached) {
+            auto it = node->in_flight.find(n);
+            if (it != node->in_flight.end()) {
+                it->second->waiters.push_back(std::move(callback));
+                return;
+            }
+
+            ctx = std::make_shared<VSFrameContext>();
+            ctx->node = node;
+            ctx->n = n;
+            ctx->waiters.push_back(std::move(callback));
+            node->in_flight[n] = ctx;
+        }
+    }
+
+    if (cached) {
+        callback(cached, std::string());
+        return;
+    }
+
+    postTask([ctx] { runFilter(ctx, arInitial); });
+}
+
+
+static void finishRequest(const std::shared_ptr<VSFrameContext> &ctx, const std::shared_ptr<DriverFrame> &frame, const std::string &error) {
+    VSNode *node = ctx->node.get();
+
+    std::vector<DriverCallback> waiters;
+    {
+        std::lock_guard<std::mutex> guard(node->lock);
+
+        node->in_flight.erase(ctx->n);
+
+        if (frame && !(node->flags & nfNoCache) && core.cache_size) {
+            node->cache.emplace_front(ctx->n, frame);
+            if (node->cache.size() > core.cache_size)
+                node->cache.pop_back();
+        }
+
+        waiters.swap(ctx->waiters);
+    }
+
+    for (size_t i = 0; i < waiters.size(); i++)
+        waiters[i](frame, error);
+}
+
+
+static void releaseRequest(const std::shared_ptr<VSFrameContext> &ctx) {
+    if (--ctx->pending == 0)
+        postTask([ctx] { runFilter(ctx, ctx->request_failed ? arError : arAllFramesReady); });
+}
+
+
+static void runFilter(const std::shared_ptr<VSFrameContext> &ctx, int reason) {
+    VSNode *node = ctx->node.get();
+
+    const VSFrameRef *result;
+    {
+        std::unique_lock<std::mutex> serial(node->serial, std::defer_lock);
+        if (node->mode == fmSerial || node->mode == fmUnordered || (node->mode == fmParallelRequests && reason != arInitial))
+            serial.lock();
+
+        result = node->get_frame(ctx->n, reason, &node->instance_data, &ctx->frame_data, ctx.get(), &core, &api);
+    }
+
+    std::shared_ptr<DriverFrame> frame;
+    if (result) {
+        frame = result->frame;
+        delete result;
+    }
+
+    // The requested frames are released after the last call, like in VapourSynth.
+    if (reason != arInitial)
+        ctx->frames.clear();
+
+    if (reason == arError) {
+        finishRequest(ctx, nullptr, ctx->request_error);
+        return;
+    }
+
+    if (ctx->failed) {
+        finishRequest(ctx, nullptr, ctx->error);
+        return;
+    }
+
+    if (frame) {
+        finishRequest(ctx, frame, std::string());
+        return;
+    }
+
+    if (reason != arInitial || ctx->requests.empty()) {
+        finishRequest(ctx, nullptr, node->name + ": Returned no frame and no error.");
+        return;
+    }
+
+    // One extra, so that frames which are already cached can't finish
+    // the request before all of them have been requested.
+    ctx->pending = (int)ctx->requests.size() + 1;
+
+    std::vector<std::pair<std::shared_ptr<VSNode>, int>> requests;
+    requests.swap(ctx->requests);
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        std::pair<VSNode *, int> key(requests[i].first.get(), requests[i].second);
+
+        requestFrame(requests[i].first, requests[i].second, [ctx, key] (const std::shared_ptr<DriverFrame> &requested, const std::string &error) {
+            {
+                std::lock_guard<std::mutex> guard(ctx->lock);
+                if (requested) {
+                    ctx->frames[key] = requested;
+                } else if (!ctx->request_failed) {
+                    ctx->request_failed = true;
+                    ctx->request_error = error;
+                }
+            }
+
+            releaseRequest(ctx);
+        });
+    }
+
+    releaseRequest(ctx);
+}
+
+
+// VapourSynth clamps too large frame numbers to the last frame.
+static inline int clampFrame(int n, VSNode *node) {
+    if (node->vi.numFrames && n >= node->vi.numFrames)
+        return node->vi.numFrames - 1;
+    return n;
+}
+
+
+static const DriverValue *getValue(const VSMap *map, const char *key, int index, char type, int *error) {
+    const DriverValue *value = nullptr;
+    int err = 0;
+
+    auto it = map->props.find(key);
+    if (it == map->props.end())
+        err = peUnset;
+    else if (it->second.type != type)
+        err = peType;
+    else if (index < 0 || index >= (int)it->second.values.size())
+        err = peIndex;
+    else
+        value = &it->second.values[index];
+
+    if (error) {
+        *error = err;
+    } else if (err) {
+        fprintf(stderr, "Property read unsuccessful but no error output: %s\n", key);
+        abort();
+    }
+
+    return value;
+}
+
+
+static int setValue(VSMap *map, const char *key, char type, int append, DriverValue value) {
+    auto it = map->props.find(key);
+
+    if (append == paReplace || it == map->props.end()) {
+        DriverProp &prop = map->props[key];
+        prop.type = type;
+        prop.values.clear();
+        if (append != paTouch)
+            prop.values.push_back(std::move(value));
+        return 0;
+    }
+
+    if (it->second.type != type)
+        return 1;
+
+    if (append == paAppend)
+        it->second.values.push_back(std::move(value));
+
+    return 0;
+}
+
+
+static const VSFrameRef *VS_CC driverCloneFrameRef(const VSFrameRef *f) {
+    return new VSFrameRef{ f->frame };
+}
+
+
+static VSNodeRef *VS_CC driverCloneNodeRef(VSNodeRef *node) {
+    return new VSNodeRef{ node->node };
+}
+
+
+static void VS_CC driverFreeFrame(const VSFrameRef *f) {
+    delete f;
+}
+
+
+static void VS_CC driverFreeNode(VSNodeRef *node) {
+    delete node;
+}
+
+
+// Data is shared between copies, so copying a frame only copies the
+// references to its properties.
+static VSFrameRef *VS_CC driverCopyFrame(const VSFrameRef *f, VSCore *core_) {
+    return new VSFrameRef{ std::make_shared<DriverFrame>(*f->frame) };
+}
+
+
+static const VSFormat *VS_CC driverGetFormatPreset(int id, VSCore *core_) {
+    static const VSFormat gray8 = { "Gray8", pfGray8, cmGray, stInteger, 8, 1, 0, 0, 1 };
+
+    return id == pfGray8 ? &gray8 : NULL;
+}
+
+
+static VSFrameRef *VS_CC driverNewVideoFrame(const VSFormat *format, int width, int height, const VSFrameRef *propSrc, VSCore *core_) {
+    std::shared_ptr<DriverFrame> frame = std::make_shared<DriverFrame>();
+    if (propSrc)
+        frame->props = propSrc->frame->props;
+
+    frame->stride = width * format->bytesPerSample;
+    frame->pixels.resize((size_t)frame->stride * height);
+
+    return new VSFrameRef{ frame };
+}
+
+
+static uint8_t *VS_CC driverGetWritePtr(VSFrameRef *f, int plane) {
+    return f->frame->pixels.data();
+}
+
+
+static int VS_CC driverGetStride(const VSFrameRef *f, int plane) {
+    return f->frame->stride;
+}
+
+
+static void VS_CC driverCreateFilter(const VSMap *in, VSMap *out, const char *name, VSFilterInit init, VSFilterGetFrame getFrame, VSFilterFree free, int filterMode, int flags, void *instanceData, VSCore *core_) {
+    std::shared_ptr<VSNode> node = std::make_shared<VSNode>();
+    node->name = name;
+    node->get_frame = getFrame;
+    node->free = free;
+    node->mode = filterMode;
+    node->flags = flags;
+    node->instance_data = instanceData;
+
+    VSMap args = *in;
+    init(&args, out, &node->instance_data, node.get(), core_, &api);
+
+    if (out->failed)
+        return;
+
+    if (!node->have_vi) {
+        api.setError(out, std::string(name).append(": Init didn't set the video info.").c_str());
+        return;
+    }
+
+    DriverValue value;
+    value.node = node;
+    setValue(out, "clip", 'c', paAppend, value);
+}
+
+
+static void VS_CC driverSetError(VSMap *map, const char *errorMessage) {
+    map->props.clear();
+    map->error = errorMessage ? errorMessage : "";
+    map->failed = true;
+}
+
+
+static const char *VS_CC driverGetError(const VSMap *map) {
+    return map->failed ? map->error.c_str() : NULL;
+}
+
+
+static void VS_CC driverSetFilterError(const char *errorMessage, VSFrameContext *frameCtx) {
+    frameCtx->failed = true;
+    frameCtx->error = errorMessage ? errorMessage : "";
+}
+
+
+// Only meant to be called from a filter's create function, which runs on
+// the main thread, not from the worker threads.
+static const VSFrameRef *VS_CC driverGetFrame(int n, VSNodeRef *node, char *errorMsg, int bufSize) {
+    std::mutex lock;
+    std::condition_variable done_cond;
+    bool done = false;
+    std::shared_ptr<DriverFrame> result;
+    std::string error;
+
+    requestFrame(node->node, clampFrame(n, node->node.get()), [&] (const std::shared_ptr<DriverFrame> &frame, const std::string &message) {
+        std::lock_guard<std::mutex> guard(lock);
+        result = frame;
+        error = message;
+        done = true;
+        done_cond.notify_one();
+    });
+
+    std::unique_lock<std::mutex> guard(lock);
+    done_cond.wait(guard, [&] { return done; });
+
+    if (!result) {
+        if (errorMsg && bufSize > 0)
+            snprintf(errorMsg, bufSize, "%s", error.c_str());
+        return NULL;
+    }
+
+    return new VSFrameRef{ result };
+}
+
+
+static const VSFrameRef *VS_CC driverGetFrameFilter(int n, VSNodeRef *node, VSFrameContext *frameCtx) {
+    std::lock_guard<std::mutex> guard(frameCtx->lock);
+
+    auto it = frameCtx->frames.find(std::make_pair(node->node.get(), clampFrame(n, node->node.get())));
+    if (it == frameCtx->frames.end())
+        return NULL;
+
+    return new VSFrameRef{ it->second };
+}
+
+
+static void VS_CC driverRequestFrameFilter(int n, VSNodeRef *node, VSFrameContext *frameCtx) {
+    frameCtx->requests.emplace_back(node->node, clampFrame(n, node->node.get()));
+}
+
+
+static VSMap *VS_CC driverCreateMap() {
+    return new VSMap;
+}
+
+
+static void VS_CC driverFreeMap(VSMap *map) {
+    delete map;
+}
+
+
+static void VS_CC driverClearMap(VSMap *map) {
+    map->props.clear();
+    map->error.clear();
+    map->failed = false;
+}
+
+
+static const VSVideoInfo *VS_CC driverGetVideoInfo(VSNodeRef *node) {
+    return &node->node->vi;
+}
+
+
+static void VS_CC driverSetVideoInfo(const VSVideoInfo *vi, int numOutputs, VSNode *node) {
+    node->vi = *vi;
+    node->have_vi = true;
+}
+
+
+static const VSMap *VS_CC driverGetFramePropsRO(const VSFrameRef *f) {
+    return &f->frame->props;
+}
+
+
+static VSMap *VS_CC driverGetFramePropsRW(VSFrameRef *f) {
+    return &f->frame->props;
+}
+
+
+static int VS_CC driverPropNumKeys(const VSMap *map) {
+    return (int)map->props.size();
+}
+
+
+static const char *VS_CC driverPropGetKey(const VSMap *map, int index) {
+    if (index < 0 || index >= (int)map->props.size())
+        return NULL;
+
+    auto it = map->props.begin();
+    std::advance(it, index);
+    return it->first.c_str();
+}
+
+
+static int VS_CC driverPropNumElements(const VSMap *map, const char *key) {
+    auto it = map->props.find(key);
+    if (it == map->props.end())
+        return -1;
+    return (int)it->second.values.size();
+}
+
+
+static char VS_CC driverPropGetType(const VSMap *map, const char *key) {
+    auto it = map->props.find(key);
+    if (it == map->props.end())
+        return 'u';
+    return it->second.type;
+}
+
+
+static int VS_CC driverPropDeleteKey(VSMap *map, const char *key) {
+    return (int)map->props.erase(key);
+}
+
+
+static int64_t VS_CC driverPropGetInt(const VSMap *map, const char *key, int index, int *error) {
+    const DriverValue *value = getValue(map, key, index, 'i', error);
+    return value ? value->i : 0;
+}
+
+
+static double VS_CC driverPropGetFloat(const VSMap *map, const char *key, int index, int *error) {
+    const DriverValue *value = getValue(map, key, index, 'f', error);
+    return value ? value->f : 0;
+}
+
+
+static const char *VS_CC driverPropGetData(const VSMap *map, const char *key, int index, int *error) {
+    const DriverValue *value = getValue(map, key, index, 's', error);
+    return value ? value->data->c_str() : NULL;
+}
+
+
+static int VS_CC driverPropGetDataSize(const VSMap *map, const char *key, int index, int *error) {
+    const DriverValue *value = getValue(map, key, index, 's', error);
+    return value ? (int)value->data->size() : 0;
+}
+
+
+static VSNodeRef *VS_CC driverPropGetNode(const VSMap *map, const char *key, int index, int *error) {
+    const DriverValue *value = getValue(map, key, index, 'c', error);
+    return value ? new VSNodeRef{ value->node } : NULL;
+}
+
+
+static const VSFrameRef *VS_CC driverPropGetFrame(const VSMap *map, const char *key, int index, int *error) {
+    const DriverValue *value = getValue(map, key, index, 'v', error);
+    return value ? new VSFrameRef{ value->frame } : NULL;
+}
+
+
+static int VS_CC driverPropSetInt(VSMap *map, const char *key, int64_t i, int append) {
+    DriverValue value;
+    value.i = i;
+    return setValue(map, key, 'i', append, value);
+}
+
+
+static int VS_CC driverPropSetFloat(VSMap *map, const char *key, double d, int append) {
+    DriverValue value;
+    value.f = d;
+    return setValue(map, key, 'f', append, value);
+}
+
+
+static int VS_CC driverPropSetData(VSMap *map, const char *key, const char *data, int size, int append) {
+    DriverValue value;
+    value.data = std::make_shared<const std::string>(data, size < 0 ? strlen(data) : (size_t)size);
+    return setValue(map, key, 's', append, value);
+}
+
+
+static int VS_CC driverPropSetNode(VSMap *map, const char *key, VSNodeRef *node, int append) {
+    DriverValue value;
+    value.node = node->node;
+    return setValue(map, key, 'c', append, value);
+}
+
+
+static int VS_CC driverPropSetFrame(VSMap *map, const char *key, const VSFrameRef *f, int append) {
+    DriverValue value;
+    value.frame = f->frame;
+    return setValue(map, key, 'v', append, value);
+}
+
+
+static void VS_CC driverLogMessage(int msgType, const char *msg) {
+    const char *types[] = { "Debug", "Warning", "Critical", "Fatal" };
+
+    fprintf(stderr, "%s: %s\n", msgType >= mtDebug && msgType <= mtFatal ? types[msgType] : "Message", msg);
+}
+
+
+static void initAPI() {
+    memset(&api, 0, sizeof(api));
+
+    api.cloneFrameRef = driverCloneFrameRef;
+    api.cloneNodeRef = driverCloneNodeRef;
+    api.freeFrame = driverFreeFrame;
+    api.freeNode = driverFreeNode;
+    api.copyFrame = driverCopyFrame;
+    api.getFormatPreset = driverGetFormatPreset;
+    api.newVideoFrame = driverNewVideoFrame;
+    api.getWritePtr = driverGetWritePtr;
+    api.getStride = driverGetStride;
+    api.createFilter = driverCreateFilter;
+    api.setError = driverSetError;
+    api.getError = driverGetError;
+    api.setFilterError = driverSetFilterError;
+    api.getFrame = driverGetFrame;
+    api.getFrameFilter = driverGetFrameFilter;
+    api.requestFrameFilter = driverRequestFrameFilter;
+    api.createMap = driverCreateMap;
+    api.freeMap = driverFreeMap;
+    api.clearMap = driverClearMap;
+    api.getVideoInfo = driverGetVideoInfo;
+    api.setVideoInfo = driverSetVideoInfo;
+    api.getFramePropsRO = driverGetFramePropsRO;
+    api.getFramePropsRW = driverGetFramePropsRW;
+    api.propNumKeys = driverPropNumKeys;
+    api.propGetKey = driverPropGetKey;
+    api.propNumElements = driverPropNumElements;
+    api.propGetType = driverPropGetType;
+    api.propDeleteKey = driverPropDeleteKey;
+    api.propGetInt = driverPropGetInt;
+    api.propGetFloat = driverPropGetFloat;
+    api.propGetData = driverPropGetData;
+    api.propGetDataSize = driverPropGetDataSize;
+    api.propGetNode = driverPropGetNode;
+    api.propGetFrame = driverPropGetFrame;
+    api.propSetInt = driverPropSetInt;
+    api.propSetFloat = driverPropSetFloat;
+    api.propSetData = driverPropSetData;
+    api.propSetNode = driverPropSetNode;
+    api.propSetFrame = driverPropSetFrame;
+#if VAPOURSYNTH_API_MINOR >= 6
+    api.logMessage = driverLogMessage;
+#endif
+}
+
+
+static void VS_CC driverConfigPlugin(const char *identifier, const char *defaultNamespace, const char *name, int apiVersion, int readonly, VSPlugin *plugin) {
+}
+
+
+static void VS_CC driverRegisterFunction(const char *name, const char *args, VSPublicFunction argsFunc, void *functionData, VSPlugin *plugin) {
+    functions[name] = DriverFunction{ args, argsFunc, functionData };
+}
+
+
+static void VS_CC blankInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core_, const VSAPI *vsapi) {
+    vsapi->setVideoInfo((const VSVideoInfo *)*instanceData, 1, node);
+}
+
+
+static const VSFrameRef *VS_CC blankGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core_, const VSAPI *vsapi) {
+    if (activationReason == arInitial)
+        return new VSFrameRef{ std::make_shared<DriverFrame>() };
+
+    return NULL;
+}
+
+
+static void VS_CC blankFree(void *instanceData, VSCore *core_, const VSAPI *vsapi) {
+    delete (VSVideoInfo *)instanceData;
+}
+
+
+static std::vector<DriverArgument> parseArguments(const std::string &args) {
+    std::vector<DriverArgument> arguments;
+
+    size_t start = 0;
+    while (start < args.size()) {
+        size_t end = args.find(';', start);
+        if (end == std::string::npos)
+            end = args.size();
+
+        std::vector<std::string> fields;
+        size_t field_start = start;
+        while (field_start <= end) {
+            size_t field_end = args.find(':', field_start);
+            if (field_end == std::string::npos || field_end > end)
+                field_end = end;
+            fields.push_back(args.substr(field_start, field_end - field_start));
+            field_start = field_end + 1;
+        }
+
+        if (fields.size() >= 2) {
+            DriverArgument argument;
+            argument.name = fields[0];
+            argument.type = fields[1];
+            argument.array = argument.type.size() > 2 && argument.type.compare(argument.type.size() - 2, 2, "[]") == 0;
+            if (argument.array)
+                argument.type.resize(argument.type.size() - 2);
+            argument.optional = std::find(fields.begin() + 2, fields.end(), "opt") != fields.end();
+            arguments.push_back(argument);
+        }
+
+        start = end + 1;
+    }
+
+    return arguments;
+}
+
+
+// Converts a value from the command line to the type the function expects.
+static bool setArgument(VSMap *map, const std::string &function, const std::vector<DriverArgument> &arguments, const std::string &key, const std::string &value, std::string *error) {
+    auto argument = std::find_if(arguments.begin(), arguments.end(), [&key] (const DriverArgument &a) { return a.name == key; });
+    if (argument == arguments.end()) {
+        *error = function + " has no argument called " + key + ".";
+        return false;
+    }
+
+    if (!argument->array && api.propNumElements(map, key.c_str()) > 0) {
+        *error = function + ": " + key + " can only be given once.";
+        return false;
+    }
+
+    char *end;
+
+    if (argument->type == "int") {
+        long long i = strtoll(value.c_str(), &end, 0);
+        if (value.empty() || *end) {
+            *error = function + ": " + key + " must be an integer.";
+            return false;
+        }
+        api.propSetInt(map, key.c_str(), i, paAppend);
+    } else if (argument->type == "float") {
+        double f = strtod(value.c_str(), &end);
+        if (value.empty() || *end) {
+            *error = function + ": " + key + " must be a number.";
+            return false;
+        }
+        api.propSetFloat(map, key.c_str(), f, paAppend);
+    } else if (argument->type == "data") {
+        api.propSetData(map, key.c_str(), value.c_str(), (int)value.size(), paAppend);
+    } else {
+        *error = function + ": " + key + " can't be given on the command line.";
+        return false;
+    }
+
+    return true;
+}
+
+
+struct DriverStep {
+    std::string name;
+    std::string mix_file;
+    std::vector<std::pair<std::string, std::string>> args;
+};
+
+
+// Calls the function and returns the clip it returned.
+static std::shared_ptr<VSNode> invoke(const std::string &name, const std::vector<std::pair<std::string, std::string>> &args, VSMap *in, std::string *error) {
+    auto function = functions.find(name);
+    if (function == functions.end()) {
+        *error = "There is no function called " + name + ".";
+        return nullptr;
+    }
+
+    std::vector<DriverArgument> arguments = parseArguments(function->second.args);
+
+    for (size_t i = 0; i < args.size(); i++)
+        if (!setArgument(in, name, arguments, args[i].first, args[i].second, error))
+            return nullptr;
+
+    for (size_t i = 0; i < arguments.size(); i++) {
+        if (!arguments[i].optional && api.propNumElements(in, arguments[i].name.c_str()) < 1) {
+            *error = name + ": Argument " + arguments[i].name + " is required.";
+            return nullptr;
+        }
+    }
+
+    VSMap out;
+    function->second.func(in, &out, function->second.data, &core, &api);
+
+    if (out.failed) {
+        *error = out.error;
+        return nullptr;
+    }
+
+    int err;
+    const DriverValue *clip = getValue(&out, "clip", 0, 'c', &err);
+    if (!clip) {
+        *error = name + " didn't return a clip.";
+        return nullptr;
+    }
+
+    return clip->node;
+}
+
+
+static std::shared_ptr<VSNode> createBlankClip(int frames, int64_t fps_num, int64_t fps_den) {
+    VSVideoInfo *vi = new VSVideoInfo;
+    memset(vi, 0, sizeof(VSVideoInfo));
+    vi->fpsNum = fps_num;
+    vi->fpsDen = fps_den;
+    vi->numFrames = frames;
+
+    VSMap in, out;
+    api.createFilter(&in, &out, "BlankClip", blankInit, blankGetFrame, blankFree, fmParallel, 0, vi, &core);
+
+    return getValue(&out, "clip", 0, 'c', NULL)->node;
+}
+
+
+// Every filter created is added to nodes, with its name.
+static std::shared_ptr<VSNode> createChain(const std::shared_ptr<VSNode> &blank, const std::vector<std::string> &inputs, const std::vector<DriverStep> &steps, std::vector<std::shared_ptr<VSNode>> *nodes, std::string *error) {
+    VSNodeRef blank_ref{ blank };
+
+    std::shared_ptr<VSNode> clip;
+
+    for (size_t i = 0; i < steps.size() && error->empty(); i++) {
+        VSMap in;
+
+        if (i == 0) {
+            if (steps[0].name != "Source")
+                api.propSetNode(&in, "clip", &blank_ref, paReplace);
+            for (size_t j = 0; j < inputs.size(); j++)
+                api.propSetData(&in, "file", inputs[j].c_str(), -1, paAppend);
+            clip = invoke(steps[0].name, steps[i].args, &in, error);
+        } else if (!steps[i].mix_file.empty()) {
+            VSMap read_in;
+            if (steps[0].name != "Source")
+                api.propSetNode(&read_in, "clip", &blank_ref, paReplace);
+            api.propSetData(&read_in, "file", steps[i].mix_file.c_str(), -1, paReplace);
+            std::shared_ptr<VSNode> other = invoke(steps[0].name, steps[0].args, &read_in, error);
+            if (!other)
+                return nullptr;
+            nodes->push_back(other);
+
+            VSNodeRef clip_ref{ clip };
+            VSNodeRef other_ref{ other };
+            api.propSetNode(&in, "clips", &clip_ref, paAppend);
+            api.propSetNode(&in, "clips", &other_ref, paAppend);
+            clip = invoke("Mix", steps[i].args, &in, error);
+        } else {
+            VSNodeRef clip_ref{ clip };
+            api.propSetNode(&in, "clip", &clip_ref, paReplace);
+            clip = invoke(steps[i].name, steps[i].args, &in, error);
+        }
+
+        if (clip)
+            nodes->push_back(clip);
+    }
+
+    return clip;
+}
+
+
+// The counters of the filters created with stats=1, from damb.Stats.
+static std::string getStats(const std::vector<std::shared_ptr<VSNode>> &nodes) {
+    auto function = functions.find("Stats");
+    if (function == functions.end())
+        return std::string();
+
+    std::string result;
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        VSNodeRef ref{ nodes[i] };
+        VSMap in, out;
+        api.propSetNode(&in, "clip", &ref, paReplace);
+
+        function->second.func(&in, &out, function->second.data, &core, &api);
+        if (out.failed)
+            continue;
+
+        result += "Stats of " + nodes[i]->name + ":\n";
+        for (auto it = out.props.begin(); it != out.props.end(); ++it)
+            if (it->second.type == 'i' && !it->second.values.empty())
+                result += "  " + it->first + ": " + std::to_string(it->second.values[0].i) + "\n";
+        result += "\n";
+    }
+
+    return result;
+}
+
+
+static std::vector<int> createOrder(const std::string &order, int frames, bool *ok) {
+    std::vector<int> result;
+    *ok = true;
+
+    if (order == "sequential") {
+        for (int i = 0; i < frames; i++)
+            result.push_back(i);
+    } else if (order == "reverse") {
+        for (int i = frames - 1; i >= 0; i--)
+            result.push_back(i);
+    } else if (order == "random") {
+        for (int i = 0; i < frames; i++)
+            result.push_back(i);
+        std::shuffle(result.begin(), result.end(), std::mt19937(1));
+    } else if (order.compare(0, 7, "strided") == 0) {
+        int step = 8;
+        if (order.size() > 7) {
+            char *end;
+            step = (int)strtol(order.c_str() + 8, &end, 10);
+            if (order[7] != ':' || *end || step < 1) {
+                *ok = false;
+                return result;
+            }
+        }
+
+        // 0, step, 2 * step, ..., then 1, 1 + step, ..., so that every
+        // frame is requested once.
+        for (int first = 0; first < step; first++)
+            for (int i = first; i < frames; i += step)
+                result.push_back(i);
+    } else {
+        *ok = false;
+    }
+
+    return result;
+}
+
+
+static int64_t countSamples(const DriverFrame &frame) {
+    int err;
+    const DriverValue *samples = getValue(&frame.props, damb_samples, 0, 's', &err);
+    const DriverValue *channels = getValue(&frame.props, damb_channels, 0, 'i', &err);
+    const DriverValue *format = getValue(&frame.props, damb_format, 0, 'i', &err);
+
+    if (!samples || !channels || !format || channels->i < 1)
+        return 0;
+
+    int64_t sample_size = getSampleSize(getSampleType((int)format->i));
+
+    // Planar frames have one element per channel.
+    const DriverValue *layout = getValue(&frame.props, damb_layout, 0, 'i', &err);
+    if (layout && layout->i == DambLayoutPlanar)
+        return (int64_t)samples->data->size() / sample_size;
+
+    return (int64_t)samples->data->size() / (channels->i * sample_size);
+}
+
+
+static void printLatencies(std::vector<double> latencies) {
+    if (latencies.empty())
+        return;
+
+    std::sort(latencies.begin(), latencies.end());
+
+    double sum = 0;
+    for (size_t i = 0; i < latencies.size(); i++)
+        sum += latencies[i];
+
+    auto percentile = [&latencies] (double p) {
+        return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+    };
+
+    printf("Latency per frame in microseconds:\n");
+    printf("  mean %.0f, median %.0f, 90%% %.0f, 99%% %.0f, max %.0f\n\n",
+           sum / latencies.size(), percentile(0.5), percentile(0.9), percentile(0.99), latencies.back());
+
+    // Buckets of [2^k, 2^(k+1)) microseconds.
+    std::vector<size_t> buckets(64, 0);
+    int lowest = 63;
+    int highest = 0;
+    for (size_t i = 0; i < latencies.size(); i++) {
+        int k = latencies[i] < 1 ? 0 : std::min(63, (int)std::log2(latencies[i]));
+        buckets[k]++;
+        lowest = std::min(lowest, k);
+        highest = std::max(highest, k);
+    }
+
+    size_t biggest = *std::max_element(buckets.begin(), buckets.end());
+
+    for (int k = lowest; k <= highest; k++) {
+        int width = (int)((buckets[k] * 50 + biggest - 1) / biggest);
+        printf("  %10.0f - %-10.0f %8zu  %s\n", std::ldexp(1.0, k), std::ldexp(1.0, k + 1), buckets[k], std::string(width, '#').c_str());
+    }
+    printf("\n");
+}
+
+
+static void printUsage() {
+    fprintf(stderr,
+            "Usage: damb-driver [options] input...\n"
+            "\n"
+            "  -t, --threads N        Number of worker threads. Default: number of CPUs.\n"
+            "  -n, --requests N       Number of frames requested at once. Default: threads.\n"
+            "  -o, --order ORDER      sequential, reverse, random, or strided[:STEP].\n"
+            "  -c, --cache N          Number of frames each filter keeps. Default: 32.\n"
+            "  --fps NUM/DEN          Frame rate of the blank clip. Default: 24000/1001.\n"
+            "  -s, --source           Read the input with Source, without a blank clip.\n"
+            "  --frames N             Only request the first N frames.\n"
+            "  -m, --mix FILE         Read FILE as well and Mix it with the clip.\n"
+            "  -f, --filter NAME      Apply the filter NAME (Write, Resample, ...).\n"
+            "  -a, --arg KEY=VALUE    Argument for the last filter, or Read (or Source)\n"
+            "                         before any other filter. Repeat the key to pass an array.\n");
+}
+
+
+static bool parseInt(const char *value, const char *option, int minimum, int *result) {
+    char *end;
+    long i = strtol(value, &end, 10);
+
+    if (!*value || *end || i < minimum || i > INT32_MAX) {
+        fprintf(stderr, "%s must be an integer of at least %d.\n", option, minimum);
+        return false;
+    }
+
+    *result = (int)i;
+    return true;
+}
+
+
+int main(int argc, char **argv) {
+    int threads = (int)std::thread::hardware_concurrency();
+    if (threads < 1)
+        threads = 1;
+    int requests = 0;
+    int cache = 32;
+    int max_frames = -1;
+    int64_t fps_num = 24000;
+    int64_t fps_den = 1001;
+    std::string order_name = "sequential";
+    std::vector<std::string> inputs;
+
+    std::vector<DriverStep> steps(1);
+    steps[0].name = "Read";
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+
+        if (option == "-h" || option == "--help") {
+            printUsage();
+            return 0;
+        }
+
+        if (option == "-s" || option == "--source") {
+            steps[0].name = "Source";
+            continue;
+        }
+
+        if (option[0] != '-' || option.size() == 1) {
+            inputs.push_back(option);
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s needs a value.\n", option.c_str());
+            return 1;
+        }
+        const char *value = argv[++i];
+
+        if (option == "-t" || option == "--threads") {
+            if (!parseInt(value, "threads", 1, &threads))
+                return 1;
+        } else if (option == "-n" || option == "--requests") {
+            if (!parseInt(value, "requests", 1, &requests))
+                return 1;
+        } else if (option == "-c" || option == "--cache") {
+            if (!parseInt(value, "cache", 0, &cache))
+                return 1;
+        } else if (option == "--frames") {
+            if (!parseInt(value, "frames", 1, &max_frames))
+                return 1;
+        } else if (option == "-o" || option == "--order") {
+            order_name = value;
+        } else if (option == "--fps") {
+            if (sscanf(value, "%" SCNd64 "/%" SCNd64, &fps_num, &fps_den) != 2 || fps_num < 1 || fps_den < 1) {
+                fprintf(stderr, "fps must look like 24000/1001.\n");
+                return 1;
+            }
+        } else if (option == "-m" || option == "--mix") {
+            DriverStep step;
+            step.name = "Mix";
+            step.mix_file = value;
+            steps.push_back(step);
+        } else if (option == "-f" || option == "--filter") {
+            DriverStep step;
+            step.name = value;
+            steps.push_back(step);
+        } else if (option == "-a" || option == "--arg") {
+            const char *equals = strchr(value, '=');
+            if (!equals) {
+                fprintf(stderr, "Arguments must look like key=value.\n");
+                return 1;
+            }
+            steps.back().args.emplace_back(std::string(value, equals), std::string(equals + 1));
+        } else {
+            fprintf(stderr, "Unknown option %s.\n", option.c_str());
+            printUsage();
+            return 1;
+        }
+    }
+
+    if (inputs.empty()) {
+        printUsage();
+        return 1;
+    }
+
+    if (steps[0].name == "Source") {
+        steps[0].args.emplace_back("fpsnum", std::to_string(fps_num));
+        steps[0].args.emplace_back("fpsden", std::to_string(fps_den));
+    }
+
+    if (!requests)
+        requests = threads;
+    core.cache_size = cache;
+
+
+    // The blank clip must be long enough for all the files.
+    SF_INFO sfinfo;
+    sf_count_t length = 0;
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        memset(&sfinfo, 0, sizeof(sfinfo));
+        SNDFILE *sndfile = sf_open(inputs[i].c_str(), SFM_READ, &sfinfo);
+        if (!sndfile) {
+            fprintf(stderr, "Couldn't open %s: %s\n", inputs[i].c_str(), sf_strerror(NULL));
+            return 1;
+        }
+        sf_close(sndfile);
+
+        length += sfinfo.frames;
+    }
+
+    double samples_per_frame = (double)sfinfo.samplerate * fps_den / fps_num;
+    int frames = std::max(1, (int)std::ceil(length / samples_per_frame));
+    if (max_frames > 0)
+        frames = std::min(frames, max_frames);
+
+    bool ok;
+    std::vector<int> order = createOrder(order_name, frames, &ok);
+    if (!ok) {
+        fprintf(stderr, "Unknown order %s.\n", order_name.c_str());
+        printUsage();
+        return 1;
+    }
+
+
+    initAPI();
+    VapourSynthPluginInit(driverConfigPlugin, driverRegisterFunction, NULL);
+
+    startThreads(threads);
+
+    std::string error;
+    std::shared_ptr<VSNode> blank = createBlankClip(frames, fps_num, fps_den);
+    std::vector<std::shared_ptr<VSNode>> nodes;
+    std::shared_ptr<VSNode> output = createChain(blank, inputs, steps, &nodes, &error);
+    blank.reset();
+
+    if (!output) {
+        fprintf(stderr, "%s\n", error.c_str());
+        nodes.clear();
+        stopThreads();
+        return 1;
+    }
+
+    printf("Filters:");
+    for (size_t i = 0; i < steps.size(); i++)
+        printf(" %s", steps[i].name.c_str());
+    printf("\nThreads: %d, requests: %d, order: %s, frames: %d\n\n", threads, requests, order_name.c_str(), frames);
+    fflush(stdout);
+
+
+    struct {
+        std::mutex lock;
+        std::condition_variable wake;
+        size_t submitted = 0;
+        size_t finished = 0;
+        bool failed = false;
+        std::string error;
+        std::vector<double> latencies;
+        int64_t samples = 0;
+    } state;
+
+    Clock::time_point start = Clock::now();
+
+    {
+        std::unique_lock<std::mutex> guard(state.lock);
+
+        while (true) {
+            while (!state.failed && state.submitted < order.size() && state.submitted - state.finished < (size_t)requests) {
+                int n = order[state.submitted++];
+
+                guard.unlock();
+
+                Clock::time_point requested = Clock::now();
+                requestFrame(output, n, [&state, requested, n] (const std::shared_ptr<DriverFrame> &frame, const std::string &message) {
+                    double latency = std::chrono::duration<double, std::micro>(Clock::now() - requested).count();
+                    int64_t samples = frame ? countSamples(*frame) : 0;
+
+                    std::lock_guard<std::mutex> done_guard(state.lock);
+
+                    if (frame) {
+                        state.latencies.push_back(latency);
+                        state.samples += samples;
+                    } else if (!state.failed) {
+                        state.failed = true;
+                        state.error = std::string("Frame ").append(std::to_string(n)).append(": ").append(message);
+                    }
+
+                    state.finished++;
+                    state.wake.notify_one();
+                });
+
+                guard.lock();
+            }
+
+            if (state.finished == state.submitted && (state.failed || state.submitted == order.size()))
+                break;
+
+            state.wake.wait(guard, [&state, &order, requests] {
+                return state.finished == state.submitted ||
+                       (!state.failed && state.submitted < order.size() && state.submitted - state.finished < (size_t)requests);
+            });
+        }
+    }
+
+    Clock::time_point frames_done = Clock::now();
+
+    std::string stats = getStats(nodes);
+
+    // Freeing the filters is timed too, because Write finishes the file then.
+    nodes.clear();
+    output.reset();
+    stopThreads();
+
+    Clock::time_point end = Clock::now();
+
+    if (state.failed) {
+        fprintf(stderr, "%s\n", state.error.c_str());
+        return 1;
+    }
+
+    printLatencies(state.latencies);
+
+    printf("%s", stats.c_str());
+
+    double frames_seconds = std::chrono::duration<double>(frames_done - start).count();
+    double total_seconds = std::chrono::duration<double>(end - start).count();
+
+    printf("Frames: %zu in %.3f s, %.1f frames/s, %.2f Msamples/s\n",
+           state.latencies.size(),
+           frames_seconds,
+           frames_seconds > 0 ? state.latencies.size() / frames_seconds : 0.0,
+           frames_seconds > 0 ? state.samples / frames_seconds / 1e6 : 0.0);
+    printf("Total, including freeing the filters: %.3f s, %.1f frames/s, %.2f Msamples/s\n",
+           total_seconds,
+           total_seconds > 0 ? state.latencies.size() / total_seconds : 0.0,
+           total_seconds > 0 ? state.samples / total_seconds / 1e6 : 0.0);
+
+    return 0;
+}
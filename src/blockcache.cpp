@@ -0,0 +1,125 @@
+#include <cstdint>
+
+#include <string>
+#include <list>
+#include <map>
+#include <tuple>
+#include <mutex>
+
+#include <VapourSynth.h>
+
+#include "blockcache.h"
+#include "index.h"
+
+
+typedef std::tuple<std::string, int64_t, int64_t, int64_t> DambCacheKey;
+
+
+typedef struct {
+    DambCacheKey key;
+    DambCacheBlock samples;
+} DambCacheEntry;
+
+
+// The most recently used blocks are at the front of the list. Everything is
+// protected by cache_lock, which is only held to look up, add, or drop
+// blocks, never while decoding.
+static std::mutex cache_lock;
+static std::list<DambCacheEntry> cache_blocks;
+static std::map<DambCacheKey, std::list<DambCacheEntry>::iterator> cache_index;
+
+static int64_t cache_max_bytes = 128 << 20;
+static int64_t cache_bytes = 0;
+static int64_t cache_hits = 0;
+static int64_t cache_misses = 0;
+static int64_t cache_evictions = 0;
+
+
+bool getCacheFile(const std::string &filename, DambCacheFile *file) {
+    file->filename = filename;
+    return getFileInfo(filename, &file->size, &file->mtime);
+}
+
+
+// Must be called with cache_lock held.
+static void evictBlocks() {
+    while (cache_bytes > cache_max_bytes && !cache_blocks.empty()) {
+        const DambCacheEntry &entry = cache_blocks.back();
+
+        cache_bytes -= entry.samples->size();
+        cache_evictions++;
+
+        cache_index.erase(entry.key);
+        cache_blocks.pop_back();
+    }
+}
+
+
+DambCacheBlock findCachedBlock(const DambCacheFile &file, int64_t block) {
+    std::lock_guard<std::mutex> guard(cache_lock);
+
+    auto it = cache_index.find(DambCacheKey(file.filename, file.size, file.mtime, block));
+    if (it == cache_index.end()) {
+        cache_misses++;
+        return DambCacheBlock();
+    }
+
+    cache_hits++;
+    cache_blocks.splice(cache_blocks.begin(), cache_blocks, it->second);
+
+    return it->second->samples;
+}
+
+
+void addCachedBlock(const DambCacheFile &file, int64_t block, const DambCacheBlock &samples) {
+    std::lock_guard<std::mutex> guard(cache_lock);
+
+    if ((int64_t)samples->size() > cache_max_bytes)
+        return;
+
+    DambCacheKey key(file.filename, file.size, file.mtime, block);
+    if (cache_index.count(key))
+        return;
+
+    DambCacheEntry entry;
+    entry.key = key;
+    entry.samples = samples;
+
+    cache_blocks.push_front(entry);
+    cache_index[key] = cache_blocks.begin();
+    cache_bytes += samples->size();
+
+    evictBlocks();
+}
+
+
+static void VS_CC dambCacheCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    int err;
+
+    double max = vsapi->propGetFloat(in, "max", 0, &err);
+    if (!err && max < 0) {
+        vsapi->setError(out, "Cache: max must not be negative.");
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(cache_lock);
+
+    if (!err) {
+        cache_max_bytes = (int64_t)(max * 1024 * 1024);
+        evictBlocks();
+    }
+
+    vsapi->propSetFloat(out, "max", cache_max_bytes / (1024.0 * 1024.0), paReplace);
+    vsapi->propSetInt(out, "bytes", cache_bytes, paReplace);
+    vsapi->propSetInt(out, "blocks", cache_blocks.size(), paReplace);
+    vsapi->propSetInt(out, "hits", cache_hits, paReplace);
+    vsapi->propSetInt(out, "misses", cache_misses, paReplace);
+    vsapi->propSetInt(out, "evictions", cache_evictions, paReplace);
+}
+
+
+void cacheRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
+    registerFunc("Cache",
+            "max:float:opt;"
+            , dambCacheCreate, 0, plugin);
+}
@@ -0,0 +1,44 @@
+#ifndef DAMB_BLOCKCACHE_H
+#define DAMB_BLOCKCACHE_H
+
+#include <cstdint>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// Decoded samples shared by all the Read filters in the process, so that a
+// file read by several of them, or by a script that is loaded again, is only
+// decoded once. The samples are kept in blocks of block_cache_samples
+// samples per channel, interleaved like in the file. The last block of a
+// file can be shorter.
+//
+// Files are identified by name, size, and modification time, so blocks of a
+// file that has changed are never returned. When the blocks take more memory
+// than the budget, the least recently used ones are dropped.
+static const int64_t block_cache_samples = 1 << 14;
+
+
+typedef struct {
+    std::string filename;
+    int64_t size;
+    int64_t mtime;
+} DambCacheFile;
+
+
+typedef std::shared_ptr<const std::vector<uint8_t>> DambCacheBlock;
+
+
+// Returns false if the file's size and modification time can't be found,
+// in which case its blocks shouldn't be cached.
+bool getCacheFile(const std::string &filename, DambCacheFile *file);
+
+// Returns an empty pointer if the block isn't cached. The block stays valid
+// after it is dropped from the cache, until the pointer is released.
+DambCacheBlock findCachedBlock(const DambCacheFile &file, int64_t block);
+
+// If another thread added the same block first, that one is kept.
+void addCachedBlock(const DambCacheFile &file, int64_t block, const DambCacheBlock &samples);
+
+#endif
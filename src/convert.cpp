@@ -0,0 +1,638 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include <VapourSynth.h>
+#include <VSHelper.h>
+
+#include <cstdio>
+#include <sndfile.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DAMB_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define DAMB_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "shared.h"
+#include "layout.h"
+#include "trace.h"
+
+
+enum DambDither {
+    DitherNone,
+    DitherTPDF,
+    DitherShaped
+};
+
+
+typedef struct {
+    VSNodeRef *node;
+    const VSVideoInfo *vi;
+
+    // SF_FORMAT_PCM_16, SF_FORMAT_PCM_24, SF_FORMAT_PCM_32,
+    // SF_FORMAT_FLOAT, or SF_FORMAT_DOUBLE.
+    int subtype;
+    int sample_type;
+    int sample_size;
+    DambDither dither;
+} DambConvertData;
+
+
+// Integers are scaled so that 1.0 is full scale, like libsndfile does when
+// reading them as floating point. Going to integers, values are rounded to
+// nearest and clipped.
+
+template<class T>
+static inline double toUnit(T value) {
+    return value;
+}
+
+template<>
+inline double toUnit<int16_t>(int16_t value) {
+    return value / 32768.0;
+}
+
+template<>
+inline double toUnit<int32_t>(int32_t value) {
+    return value / 2147483648.0;
+}
+
+
+// bits is the number of bits used in the output. It's 24 for s24, whose
+// samples are stored in the upper 24 bits of s32.
+template<class D>
+static inline D fromUnit(double value, int bits) {
+    if (!std::numeric_limits<D>::is_integer)
+        return static_cast<D>(value);
+
+    double scale = std::ldexp(1.0, bits - 1);
+    double rounded = std::nearbyint(std::min(std::max(value * scale, -scale), scale - 1));
+
+    return static_cast<D>(static_cast<int64_t>(rounded) * (int64_t(1) << (sizeof(D) * 8 - bits)));
+}
+
+
+template<class S, class D>
+static void convertC(const void *src, void *dst, size_t start, size_t count, int bits) {
+    const S *in = (const S *)src;
+    D *out = (D *)dst;
+
+    for (size_t i = start; i < count; i++)
+        out[i] = fromUnit<D>(toUnit<S>(in[i]), bits);
+}
+
+
+// xorshift64*, seeded from the frame number, so that the dither doesn't
+// depend on the order in which frames are requested.
+typedef struct {
+    uint64_t state;
+} DambRandom;
+
+
+static inline void randomSeed(DambRandom *r, uint64_t seed) {
+    // splitmix64, so that close seeds give unrelated sequences.
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    r->state = (z ^ (z >> 31)) | 1;
+}
+
+
+// Uniform in [0, 1).
+static inline double randomUniform(DambRandom *r) {
+    r->state ^= r->state >> 12;
+    r->state ^= r->state << 25;
+    r->state ^= r->state >> 27;
+    return ((r->state * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+// Triangular dither of up to one step either way is added before rounding.
+// With noise shaping, the rounding error of each sample is also subtracted
+// from the next sample of the same channel, which moves the noise towards
+// the high frequencies, where it's less audible.
+template<class S, class D>
+static void convertDithered(const void *src, void *dst, size_t count, int channels, int bits, DambDither dither, int n) {
+    const S *in = (const S *)src;
+    D *out = (D *)dst;
+
+    const double scale = std::ldexp(1.0, bits - 1);
+    const int shift = sizeof(D) * 8 - bits;
+
+    DambRandom random;
+    randomSeed(&random, (uint64_t)n);
+
+    std::vector<double> error(channels, 0.0);
+
+    for (size_t i = 0; i < count; i++) {
+        int c = (int)(i % channels);
+
+        double value = toUnit<S>(in[i]) * scale;
+        if (dither == DitherShaped)
+            value -= error[c];
+
+        double noise = randomUniform(&random) - randomUniform(&random);
+        double rounded = std::nearbyint(std::min(std::max(value + noise, -scale), scale - 1));
+
+        if (dither == DitherShaped)
+            error[c] = rounded - value;
+
+        out[i] = static_cast<D>(static_cast<int64_t>(rounded) * (int64_t(1) << shift));
+    }
+}
+
+
+#ifdef DAMB_X86
+
+__attribute__((target("sse2")))
+static void convertS16ToFloatSSE2(const void *src, void *dst, size_t count) {
+    const int16_t *in = (const int16_t *)src;
+    float *out = (float *)dst;
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128 x0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+        __m128 x1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+        _mm_storeu_ps(out + i, _mm_mul_ps(x0, scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(x1, scale));
+    }
+
+    convertC<int16_t, float>(src, dst, i, count, 32);
+}
+
+
+__attribute__((target("sse2")))
+static void convertFloatToS16SSE2(const void *src, void *dst, size_t count) {
+    const float *in = (const float *)src;
+    int16_t *out = (int16_t *)dst;
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 low = _mm_set1_ps(-32768.0f);
+    const __m128 high = _mm_set1_ps(32767.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128 x0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), low), high);
+        __m128 x1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale), low), high);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(_mm_cvtps_epi32(x0), _mm_cvtps_epi32(x1)));
+    }
+
+    convertC<float, int16_t>(src, dst, i, count, 16);
+}
+
+
+__attribute__((target("sse2")))
+static void convertS32ToFloatSSE2(const void *src, void *dst, size_t count) {
+    const int32_t *in = (const int32_t *)src;
+    float *out = (float *)dst;
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(in + i))), scale));
+
+    convertC<int32_t, float>(src, dst, i, count, 32);
+}
+
+
+__attribute__((target("sse2")))
+static void convertFloatToS32SSE2(const void *src, void *dst, size_t count) {
+    const float *in = (const float *)src;
+    int32_t *out = (int32_t *)dst;
+    const __m128d scale = _mm_set1_pd(2147483648.0);
+    const __m128d low = _mm_set1_pd(-2147483648.0);
+    const __m128d high = _mm_set1_pd(2147483647.0);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(in + i);
+        __m128d x0 = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_cvtps_pd(x), scale), low), high);
+        __m128d x1 = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), scale), low), high);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi64(_mm_cvtpd_epi32(x0), _mm_cvtpd_epi32(x1)));
+    }
+
+    convertC<float, int32_t>(src, dst, i, count, 32);
+}
+
+
+__attribute__((target("avx2")))
+static void convertS16ToFloatAVX2(const void *src, void *dst, size_t count) {
+    const int16_t *in = (const int16_t *)src;
+    float *out = (float *)dst;
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+    }
+
+    convertC<int16_t, float>(src, dst, i, count, 32);
+}
+
+
+__attribute__((target("avx2")))
+static void convertFloatToS16AVX2(const void *src, void *dst, size_t count) {
+    const float *in = (const float *)src;
+    int16_t *out = (int16_t *)dst;
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 low = _mm256_set1_ps(-32768.0f);
+    const __m256 high = _mm256_set1_ps(32767.0f);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i x0 = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale), low), high));
+        __m256i x1 = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale), low), high));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(x0, x1), 0xD8));
+    }
+
+    convertC<float, int16_t>(src, dst, i, count, 16);
+}
+
+
+__attribute__((target("avx2")))
+static void convertS32ToFloatAVX2(const void *src, void *dst, size_t count) {
+    const int32_t *in = (const int32_t *)src;
+    float *out = (float *)dst;
+    const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(in + i))), scale));
+
+    convertC<int32_t, float>(src, dst, i, count, 32);
+}
+
+
+__attribute__((target("avx2")))
+static void convertFloatToS32AVX2(const void *src, void *dst, size_t count) {
+    const float *in = (const float *)src;
+    int32_t *out = (int32_t *)dst;
+    const __m256d scale = _mm256_set1_pd(2147483648.0);
+    const __m256d low = _mm256_set1_pd(-2147483648.0);
+    const __m256d high = _mm256_set1_pd(2147483647.0);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256d x = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(in + i)), scale), low), high);
+        _mm_storeu_si128((__m128i *)(out + i), _mm256_cvtpd_epi32(x));
+    }
+
+    convertC<float, int32_t>(src, dst, i, count, 32);
+}
+
+#endif // DAMB_X86
+
+
+#ifdef DAMB_NEON
+
+static void convertS16ToFloatNEON(const void *src, void *dst, size_t count) {
+    const int16_t *in = (const int16_t *)src;
+    float *out = (float *)dst;
+    const float32x4_t scale = vdupq_n_f32(1.0f / 32768.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(in + i);
+        vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), scale));
+        vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), scale));
+    }
+
+    convertC<int16_t, float>(src, dst, i, count, 32);
+}
+
+
+static void convertFloatToS16NEON(const void *src, void *dst, size_t count) {
+    const float *in = (const float *)src;
+    int16_t *out = (int16_t *)dst;
+    const float32x4_t scale = vdupq_n_f32(32768.0f);
+    const float32x4_t low = vdupq_n_f32(-32768.0f);
+    const float32x4_t high = vdupq_n_f32(32767.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        int32x4_t x0 = vcvtnq_s32_f32(vminq_f32(vmaxq_f32(vmulq_f32(vld1q_f32(in + i), scale), low), high));
+        int32x4_t x1 = vcvtnq_s32_f32(vminq_f32(vmaxq_f32(vmulq_f32(vld1q_f32(in + i + 4), scale), low), high));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(x0), vqmovn_s32(x1)));
+    }
+
+    convertC<float, int16_t>(src, dst, i, count, 16);
+}
+
+
+static void convertS32ToFloatNEON(const void *src, void *dst, size_t count) {
+    const int32_t *in = (const int32_t *)src;
+    float *out = (float *)dst;
+    const float32x4_t scale = vdupq_n_f32(1.0f / 2147483648.0f);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+        vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vld1q_s32(in + i)), scale));
+
+    convertC<int32_t, float>(src, dst, i, count, 32);
+}
+
+
+static void convertFloatToS32NEON(const void *src, void *dst, size_t count) {
+    const float *in = (const float *)src;
+    int32_t *out = (int32_t *)dst;
+    const float64x2_t scale = vdupq_n_f64(2147483648.0);
+    const float64x2_t low = vdupq_n_f64(-2147483648.0);
+    const float64x2_t high = vdupq_n_f64(2147483647.0);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t x = vld1q_f32(in + i);
+        float64x2_t x0 = vminq_f64(vmaxq_f64(vmulq_f64(vcvt_f64_f32(vget_low_f32(x)), scale), low), high);
+        float64x2_t x1 = vminq_f64(vmaxq_f64(vmulq_f64(vcvt_high_f64_f32(x), scale), low), high);
+        vst1q_s32(out + i, vcombine_s32(vmovn_s64(vcvtnq_s64_f64(x0)), vmovn_s64(vcvtnq_s64_f64(x1))));
+    }
+
+    convertC<float, int32_t>(src, dst, i, count, 32);
+}
+
+#endif // DAMB_NEON
+
+
+typedef void (*DambConvertFunction)(const void *src, void *dst, size_t count);
+
+
+template<class S, class D, int bits>
+static void convertAll(const void *src, void *dst, size_t count) {
+    convertC<S, D>(src, dst, 0, count, bits);
+}
+
+
+typedef struct {
+    DambConvertFunction s16_to_float;
+    DambConvertFunction float_to_s16;
+    DambConvertFunction s32_to_float;
+    DambConvertFunction float_to_s32;
+} DambConvertFunctions;
+
+
+static DambConvertFunctions pickConvertFunctions() {
+#ifdef DAMB_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return { convertS16ToFloatAVX2, convertFloatToS16AVX2, convertS32ToFloatAVX2, convertFloatToS32AVX2 };
+
+    if (__builtin_cpu_supports("sse2"))
+        return { convertS16ToFloatSSE2, convertFloatToS16SSE2, convertS32ToFloatSSE2, convertFloatToS32SSE2 };
+#elif defined(DAMB_NEON)
+    return { convertS16ToFloatNEON, convertFloatToS16NEON, convertS32ToFloatNEON, convertFloatToS32NEON };
+#endif
+
+    return { convertAll<int16_t, float, 32>, convertAll<float, int16_t, 16>, convertAll<int32_t, float, 32>, convertAll<float, int32_t, 32> };
+}
+
+
+static const DambConvertFunctions &convertFunctions() {
+    static const DambConvertFunctions functions = pickConvertFunctions();
+    return functions;
+}
+
+
+// Conversions without dither. The most common ones have vector versions.
+static DambConvertFunction getConvertFunction(int from, int to, int bits) {
+    const DambConvertFunctions &functions = convertFunctions();
+
+    if (from == SF_FORMAT_PCM_16) {
+        if (to == SF_FORMAT_PCM_16)
+            return convertAll<int16_t, int16_t, 16>;
+        if (to == SF_FORMAT_PCM_32)
+            return bits == 24 ? convertAll<int16_t, int32_t, 24> : convertAll<int16_t, int32_t, 32>;
+        if (to == SF_FORMAT_FLOAT)
+            return functions.s16_to_float;
+        return convertAll<int16_t, double, 64>;
+    }
+
+    if (from == SF_FORMAT_PCM_32) {
+        if (to == SF_FORMAT_PCM_16)
+            return convertAll<int32_t, int16_t, 16>;
+        if (to == SF_FORMAT_PCM_32)
+            return bits == 24 ? convertAll<int32_t, int32_t, 24> : convertAll<int32_t, int32_t, 32>;
+        if (to == SF_FORMAT_FLOAT)
+            return functions.s32_to_float;
+        return convertAll<int32_t, double, 64>;
+    }
+
+    if (from == SF_FORMAT_FLOAT) {
+        if (to == SF_FORMAT_PCM_16)
+            return functions.float_to_s16;
+        if (to == SF_FORMAT_PCM_32)
+            return bits == 24 ? convertAll<float, int32_t, 24> : functions.float_to_s32;
+        if (to == SF_FORMAT_FLOAT)
+            return convertAll<float, float, 32>;
+        return convertAll<float, double, 64>;
+    }
+
+    if (to == SF_FORMAT_PCM_16)
+        return convertAll<double, int16_t, 16>;
+    if (to == SF_FORMAT_PCM_32)
+        return bits == 24 ? convertAll<double, int32_t, 24> : convertAll<double, int32_t, 32>;
+    if (to == SF_FORMAT_FLOAT)
+        return convertAll<double, float, 32>;
+    return convertAll<double, double, 64>;
+}
+
+
+template<class S>
+static void convertDitheredFrom(const void *src, void *dst, size_t count, int channels, int to, int bits, DambDither dither, int n) {
+    if (to == SF_FORMAT_PCM_16)
+        convertDithered<S, int16_t>(src, dst, count, channels, bits, dither, n);
+    else
+        convertDithered<S, int32_t>(src, dst, count, channels, bits, dither, n);
+}
+
+
+// Number of significant bits in samples of the given type.
+static inline int precision(int sample_type) {
+    if (sample_type == SF_FORMAT_PCM_16)
+        return 16;
+    if (sample_type == SF_FORMAT_PCM_32 || sample_type == SF_FORMAT_FLOAT)
+        return 32;
+    return 64;
+}
+
+
+static void VS_CC dambConvertInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    DambConvertData *d = (DambConvertData *) * instanceData;
+    vsapi->setVideoInfo(d->vi, 1, node);
+}
+
+
+static const VSFrameRef *VS_CC dambConvertGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    const DambConvertData *d = (const DambConvertData *) * instanceData;
+
+    if (activationReason == arInitial) {
+        traceAsyncBegin("Convert", "request", d, n);
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        traceAsyncEnd("Convert", "request", d, n);
+
+        const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+        const VSMap *src_props = vsapi->getFramePropsRO(src);
+        int err[2];
+
+        int channels = int64ToIntS(vsapi->propGetInt(src_props, damb_channels, 0, &err[0]));
+        int format = int64ToIntS(vsapi->propGetInt(src_props, damb_format, 0, &err[1]));
+
+        int from = getSampleType(format);
+        int from_size = getSampleSize(from);
+        int bits = d->subtype == SF_FORMAT_PCM_24 ? 24 : precision(d->sample_type);
+
+        DambFrameSamples input;
+
+        if (err[0] || err[1] || !getFrameSamples(src_props, channels, from_size, -1, NULL, &input, vsapi)) {
+            vsapi->setFilterError(std::string("Convert: Audio data not found in frame ").append(std::to_string(n)).append(".").c_str(), frameCtx);
+            vsapi->freeFrame(src);
+            return NULL;
+        }
+
+        size_t count = input.length * channels;
+
+        VSFrameRef *dst = vsapi->copyFrame(src, core);
+        VSMap *props = vsapi->getFramePropsRW(dst);
+
+        int new_format = (format & ~SF_FORMAT_SUBMASK) | d->subtype;
+
+        if (from == d->sample_type && bits >= precision(from)) {
+            // Only the format changes.
+        } else {
+            std::vector<uint8_t> samples(count * d->sample_size);
+
+            int64_t trace_start = startTrace();
+
+            if (d->dither != DitherNone && d->sample_type != SF_FORMAT_FLOAT && d->sample_type != SF_FORMAT_DOUBLE && bits < precision(from)) {
+                // The dither is generated in interleaved order, so planar
+                // frames are interleaved first, to get the same output as
+                // interleaved frames.
+                const void *buffer = input.data[0];
+
+                std::vector<uint8_t> interleaved;
+                if (input.layout == DambLayoutPlanar) {
+                    interleaved.resize(count * from_size);
+                    interleaveSamples(input.data.data(), interleaved.data(), channels, input.length, from_size);
+                    buffer = interleaved.data();
+                }
+
+                if (from == SF_FORMAT_PCM_16)
+                    convertDitheredFrom<int16_t>(buffer, samples.data(), count, channels, d->sample_type, bits, d->dither, n);
+                else if (from == SF_FORMAT_PCM_32)
+                    convertDitheredFrom<int32_t>(buffer, samples.data(), count, channels, d->sample_type, bits, d->dither, n);
+                else if (from == SF_FORMAT_FLOAT)
+                    convertDitheredFrom<float>(buffer, samples.data(), count, channels, d->sample_type, bits, d->dither, n);
+                else
+                    convertDitheredFrom<double>(buffer, samples.data(), count, channels, d->sample_type, bits, d->dither, n);
+
+                if (input.layout == DambLayoutPlanar) {
+                    std::vector<uint8_t> planar(samples.size());
+
+                    std::vector<void *> planes(channels);
+                    for (int c = 0; c < channels; c++)
+                        planes[c] = planar.data() + c * input.length * d->sample_size;
+
+                    deinterleaveSamples(samples.data(), planes.data(), channels, input.length, d->sample_size);
+                    samples.swap(planar);
+                }
+            } else {
+                // Every sample is converted on its own, so planes are
+                // converted one by one.
+                size_t plane_count = count / input.data.size();
+
+                for (size_t p = 0; p < input.data.size(); p++)
+                    getConvertFunction(from, d->sample_type, bits)(input.data[p], samples.data() + p * plane_count * d->sample_size, plane_count);
+            }
+
+            traceSpan("Convert", "convert", n, trace_start);
+
+            setFrameSamples(props, input.layout, samples.data(), channels, input.length, d->sample_size, vsapi);
+        }
+
+        vsapi->freeFrame(src);
+
+        vsapi->propSetInt(props, damb_format, new_format, paReplace);
+
+        return dst;
+    }
+
+    return NULL;
+}
+
+
+static void VS_CC dambConvertFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    DambConvertData *d = (DambConvertData *)instanceData;
+
+    vsapi->freeNode(d->node);
+    delete d;
+
+    flushTrace();
+}
+
+
+static void VS_CC dambConvertCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    DambConvertData d;
+    DambConvertData *data;
+    int err;
+
+    std::string sample_type = vsapi->propGetData(in, "sample_type", 0, NULL);
+
+    if (sample_type == "s16")
+        d.subtype = SF_FORMAT_PCM_16;
+    else if (sample_type == "s24")
+        d.subtype = SF_FORMAT_PCM_24;
+    else if (sample_type == "s32")
+        d.subtype = SF_FORMAT_PCM_32;
+    else if (sample_type == "float")
+        d.subtype = SF_FORMAT_FLOAT;
+    else if (sample_type == "double")
+        d.subtype = SF_FORMAT_DOUBLE;
+    else {
+        vsapi->setError(out, "Convert: sample_type must be \"s16\", \"s24\", \"s32\", \"float\", or \"double\".");
+        return;
+    }
+
+    d.sample_type = getSampleType(d.subtype);
+    d.sample_size = getSampleSize(d.sample_type);
+
+    const char *dither = vsapi->propGetData(in, "dither", 0, &err);
+    if (err || !strcmp(dither, "tpdf"))
+        d.dither = DitherTPDF;
+    else if (!strcmp(dither, "none"))
+        d.dither = DitherNone;
+    else if (!strcmp(dither, "shaped"))
+        d.dither = DitherShaped;
+    else {
+        vsapi->setError(out, "Convert: dither must be \"none\", \"tpdf\", or \"shaped\".");
+        return;
+    }
+
+    d.node = vsapi->propGetNode(in, "clip", 0, NULL);
+    d.vi = vsapi->getVideoInfo(d.node);
+
+    data = new DambConvertData();
+    *data = d;
+
+    vsapi->createFilter(in, out, "Convert", dambConvertInit, dambConvertGetFrame, dambConvertFree, fmParallel, 0, data, core);
+}
+
+
+void convertRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
+    registerFunc("Convert",
+            "clip:clip;"
+            "sample_type:data;"
+            "dither:data:opt;"
+            , dambConvertCreate, 0, plugin);
+}
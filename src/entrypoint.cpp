@@ -4,6 +4,11 @@
 void readRegister(VSRegisterFunction registerFunc, VSPlugin *plugin);
 void writeRegister(VSRegisterFunction registerFunc, VSPlugin *plugin);
 void mixRegister(VSRegisterFunction registerFunc, VSPlugin *plugin);
+void indexRegister(VSRegisterFunction registerFunc, VSPlugin *plugin);
+void resampleRegister(VSRegisterFunction registerFunc, VSPlugin *plugin);
+void convertRegister(VSRegisterFunction registerFunc, VSPlugin *plugin);
+void statsRegister(VSRegisterFunction registerFunc, VSPlugin *plugin);
+void cacheRegister(VSRegisterFunction registerFunc, VSPlugin *plugin);
 
 
 VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
@@ -12,4 +17,9 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
     readRegister(registerFunc, plugin);
     writeRegister(registerFunc, plugin);
     mixRegister(registerFunc, plugin);
+    indexRegister(registerFunc, plugin);
+    resampleRegister(registerFunc, plugin);
+    convertRegister(registerFunc, plugin);
+    statsRegister(registerFunc, plugin);
+    cacheRegister(registerFunc, plugin);
 }
@@ -0,0 +1,532 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+
+#include <cstdio>
+#include <sndfile.h>
+#include <FLAC/stream_encoder.h>
+
+#include "shared.h"
+#include "flacwriter.h"
+#include "trace.h"
+
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t length;
+    uint8_t buffer[64];
+} DambMD5;
+
+
+static void md5Init(DambMD5 *md5) {
+    md5->state[0] = 0x67452301;
+    md5->state[1] = 0xefcdab89;
+    md5->state[2] = 0x98badcfe;
+    md5->state[3] = 0x10325476;
+    md5->length = 0;
+}
+
+
+static void md5Block(DambMD5 *md5, const uint8_t *block) {
+    static const uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+    };
+    static const int r[64] = {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+        5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+    };
+
+    uint32_t w[16];
+    for (int i = 0; i < 16; i++)
+        w[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16) | ((uint32_t)block[i * 4 + 3] << 24);
+
+    uint32_t a = md5->state[0], b = md5->state[1], c = md5->state[2], d = md5->state[3];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+
+        uint32_t t = d;
+        d = c;
+        c = b;
+        uint32_t x = a + f + k[i] + w[g];
+        b = b + ((x << r[i]) | (x >> (32 - r[i])));
+        a = t;
+    }
+
+    md5->state[0] += a;
+    md5->state[1] += b;
+    md5->state[2] += c;
+    md5->state[3] += d;
+}
+
+
+static void md5Update(DambMD5 *md5, const uint8_t *data, size_t size) {
+    size_t used = md5->length % 64;
+    md5->length += size;
+
+    if (used) {
+        size_t fill = std::min<size_t>(64 - used, size);
+        memcpy(md5->buffer + used, data, fill);
+        data += fill;
+        size -= fill;
+        if (used + fill < 64)
+            return;
+        md5Block(md5, md5->buffer);
+    }
+
+    for (; size >= 64; data += 64, size -= 64)
+        md5Block(md5, data);
+
+    memcpy(md5->buffer, data, size);
+}
+
+
+static void md5Final(DambMD5 *md5, uint8_t digest[16]) {
+    uint64_t bits = md5->length * 8;
+
+    uint8_t padding[72] = { 0x80 };
+    size_t used = md5->length % 64;
+    size_t padding_size = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; i++)
+        padding[padding_size + i] = (uint8_t)(bits >> (i * 8));
+    md5Update(md5, padding, padding_size + 8);
+
+    for (int i = 0; i < 16; i++)
+        digest[i] = (uint8_t)(md5->state[i / 4] >> ((i % 4) * 8));
+}
+
+
+static uint8_t crc8(const uint8_t *data, size_t size) {
+    uint8_t crc = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+
+    return crc;
+}
+
+
+static uint16_t crc16(const uint8_t *data, size_t size) {
+    uint16_t crc = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+    }
+
+    return crc;
+}
+
+
+// Appends the frame number coded the way FLAC frame headers code it.
+static void appendCodedNumber(std::vector<uint8_t> &out, uint64_t number) {
+    if (number < 0x80) {
+        out.push_back((uint8_t)number);
+        return;
+    }
+
+    int extra = 1;
+    while (extra < 6 && number >= (1ull << (5 * extra + 6)))
+        extra++;
+
+    out.push_back((uint8_t)((0xFF00 >> (extra + 1)) | (number >> (6 * extra))));
+    for (int i = extra - 1; i >= 0; i--)
+        out.push_back((uint8_t)(0x80 | ((number >> (6 * i)) & 0x3F)));
+}
+
+
+// Copies a frame produced by an encoder that started counting at 0,
+// giving it its number in the whole stream and fixing the checksums.
+// Returns the size of the rewritten frame.
+static size_t appendRenumberedFrame(std::vector<uint8_t> &out, const uint8_t *frame, size_t size, uint64_t frame_number) {
+    size_t number_length = 1;
+    for (uint8_t lead = frame[4]; (lead & 0xC0) == 0xC0; lead <<= 1)
+        number_length++;
+
+    int blocksize_code = frame[2] >> 4;
+    int samplerate_code = frame[2] & 15;
+    size_t tail_length = (blocksize_code == 6) + 2 * (blocksize_code == 7) +
+                         (samplerate_code == 12) + 2 * (samplerate_code == 13 || samplerate_code == 14);
+
+    size_t old_header_length = 4 + number_length + tail_length + 1;
+    size_t start = out.size();
+
+    out.insert(out.end(), frame, frame + 4);
+    appendCodedNumber(out, frame_number);
+    out.insert(out.end(), frame + 4 + number_length, frame + 4 + number_length + tail_length);
+    out.push_back(crc8(out.data() + start, out.size() - start));
+
+    // Subframes are byte aligned after the header, so they don't change.
+    out.insert(out.end(), frame + old_header_length, frame + size - 2);
+    uint16_t crc = crc16(out.data() + start, out.size() - start);
+    out.push_back((uint8_t)(crc >> 8));
+    out.push_back((uint8_t)crc);
+
+    return out.size() - start;
+}
+
+
+typedef struct {
+    int64_t first_frame;
+    std::vector<FLAC__int32> samples;
+    // Only the first chunk keeps the metadata the encoder writes.
+    std::vector<uint8_t> metadata;
+    std::vector<uint8_t> frames;
+    size_t min_framesize;
+    size_t max_framesize;
+    bool done;
+    bool failed;
+} DambFlacChunk;
+
+
+struct DambFlacWriter {
+    FILE *file;
+    int channels;
+    int samplerate;
+    int bits;
+    int compression_level;
+    unsigned blocksize;
+    int64_t chunk_samples;
+    size_t max_pending;
+
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable work;
+    std::condition_variable finished;
+    // Chunks waiting for a worker, and all the chunks not written yet, in order.
+    std::deque<std::shared_ptr<DambFlacChunk>> todo;
+    std::deque<std::shared_ptr<DambFlacChunk>> pending;
+    bool stop;
+
+    // Only used by the thread calling writeFlacSamples.
+    std::shared_ptr<DambFlacChunk> current;
+    int64_t next_frame;
+    int64_t total_samples;
+    DambMD5 md5;
+    std::vector<uint8_t> streaminfo_block;
+    size_t min_framesize;
+    size_t max_framesize;
+    bool failed;
+};
+
+
+static FLAC__StreamEncoderWriteStatus chunkWriteCallback(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[], size_t bytes, uint32_t samples, uint32_t current_frame, void *client_data) {
+    DambFlacChunk *chunk = (DambFlacChunk *)client_data;
+
+    if (samples == 0) {
+        if (chunk->first_frame == 0)
+            chunk->metadata.insert(chunk->metadata.end(), buffer, buffer + bytes);
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+    }
+
+    size_t size = appendRenumberedFrame(chunk->frames, buffer, bytes, chunk->first_frame + current_frame);
+    chunk->min_framesize = std::min(chunk->min_framesize, size);
+    chunk->max_framesize = std::max(chunk->max_framesize, size);
+
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+
+static bool encodeChunk(DambFlacWriter *w, DambFlacChunk *chunk) {
+    FLAC__StreamEncoder *encoder = FLAC__stream_encoder_new();
+    if (!encoder)
+        return false;
+
+    bool ok = FLAC__stream_encoder_set_channels(encoder, w->channels) &&
+              FLAC__stream_encoder_set_bits_per_sample(encoder, w->bits) &&
+              FLAC__stream_encoder_set_sample_rate(encoder, w->samplerate) &&
+              FLAC__stream_encoder_set_compression_level(encoder, w->compression_level) &&
+              FLAC__stream_encoder_set_blocksize(encoder, w->blocksize) &&
+              FLAC__stream_encoder_init_stream(encoder, chunkWriteCallback, NULL, NULL, NULL, chunk) == FLAC__STREAM_ENCODER_INIT_STATUS_OK;
+
+    if (ok && !chunk->samples.empty())
+        ok = FLAC__stream_encoder_process_interleaved(encoder, chunk->samples.data(), chunk->samples.size() / w->channels);
+
+    if (!FLAC__stream_encoder_finish(encoder))
+        ok = false;
+
+    FLAC__stream_encoder_delete(encoder);
+
+    chunk->samples.clear();
+    chunk->samples.shrink_to_fit();
+
+    return ok;
+}
+
+
+static void workerThread(DambFlacWriter *w) {
+    setTraceThreadName("Write FLAC encoder");
+
+    std::unique_lock<std::mutex> guard(w->lock);
+
+    while (true) {
+        while (w->todo.empty() && !w->stop)
+            w->work.wait(guard);
+
+        if (w->todo.empty())
+            return;
+
+        std::shared_ptr<DambFlacChunk> chunk = w->todo.front();
+        w->todo.pop_front();
+
+        guard.unlock();
+        int64_t start = startTrace();
+        bool ok = encodeChunk(w, chunk.get());
+        traceSpan("Write", "encode FLAC chunk", -1, start);
+        guard.lock();
+
+        chunk->failed = !ok;
+        chunk->done = true;
+        w->finished.notify_all();
+    }
+}
+
+
+// Writes the encoded chunks at the front of the queue. If wait_for is
+// larger than 0, waits until at most that many chunks are pending.
+static bool writeFinishedChunks(DambFlacWriter *w, size_t wait_for) {
+    std::unique_lock<std::mutex> guard(w->lock);
+
+    while (!w->pending.empty()) {
+        std::shared_ptr<DambFlacChunk> chunk = w->pending.front();
+
+        if (!chunk->done) {
+            if (w->pending.size() <= wait_for)
+                break;
+            w->finished.wait(guard);
+            continue;
+        }
+
+        w->pending.pop_front();
+        guard.unlock();
+
+        if (chunk->failed)
+            w->failed = true;
+
+        if (!w->failed) {
+            if (chunk->first_frame == 0) {
+                // The first metadata block is always STREAMINFO. It gets
+                // the final numbers when the file is closed.
+                w->streaminfo_block.assign(chunk->metadata.begin(), chunk->metadata.begin() + std::min<size_t>(chunk->metadata.size(), 42));
+                if (fwrite(chunk->metadata.data(), 1, chunk->metadata.size(), w->file) != chunk->metadata.size())
+                    w->failed = true;
+            }
+
+            if (fwrite(chunk->frames.data(), 1, chunk->frames.size(), w->file) != chunk->frames.size())
+                w->failed = true;
+
+            if (!chunk->frames.empty()) {
+                w->min_framesize = std::min(w->min_framesize, chunk->min_framesize);
+                w->max_framesize = std::max(w->max_framesize, chunk->max_framesize);
+            }
+        }
+
+        guard.lock();
+    }
+
+    return !w->failed;
+}
+
+
+static void submitCurrentChunk(DambFlacWriter *w) {
+    std::shared_ptr<DambFlacChunk> chunk = w->current;
+    w->current.reset();
+
+    w->next_frame += (chunk->samples.size() / w->channels + w->blocksize - 1) / w->blocksize;
+
+    std::lock_guard<std::mutex> guard(w->lock);
+    w->todo.push_back(chunk);
+    w->pending.push_back(chunk);
+    w->work.notify_one();
+}
+
+
+static void newChunk(DambFlacWriter *w) {
+    w->current = std::make_shared<DambFlacChunk>();
+    w->current->first_frame = w->next_frame;
+    w->current->samples.reserve(w->chunk_samples * w->channels);
+    w->current->min_framesize = SIZE_MAX;
+    w->current->max_framesize = 0;
+    w->current->done = false;
+    w->current->failed = false;
+}
+
+
+DambFlacWriter *createFlacWriter(const std::string &filename, int channels, int samplerate, int bits, int compression_level, int threads, std::string *error) {
+    DambFlacWriter *w = new DambFlacWriter();
+
+    w->file = fopen(filename.c_str(), "wb");
+    if (!w->file) {
+        *error = "couldn't create the file";
+        delete w;
+        return NULL;
+    }
+
+    w->channels = channels;
+    w->samplerate = samplerate;
+    w->bits = bits;
+    w->compression_level = compression_level;
+
+    // The block size libFLAC uses for each compression level.
+    w->blocksize = compression_level <= 2 ? 1152 : 4096;
+
+    // With "loose" mid/side stereo (levels 1 and 4), libFLAC decides how to
+    // code a frame based on the previous frames, except every few frames,
+    // where it tries every mode again. Chunks start on those frames, so that
+    // every encoder makes the same decisions a single encoder would.
+    unsigned loose_frames = (unsigned)(samplerate * 0.4 / w->blocksize + 0.5);
+    if (loose_frames == 0)
+        loose_frames = 1;
+    unsigned chunk_frames = loose_frames * ((64 + loose_frames - 1) / loose_frames);
+    w->chunk_samples = (int64_t)chunk_frames * w->blocksize;
+
+    w->max_pending = threads * 2;
+    w->stop = false;
+    w->next_frame = 0;
+    w->total_samples = 0;
+    w->min_framesize = SIZE_MAX;
+    w->max_framesize = 0;
+    w->failed = false;
+    md5Init(&w->md5);
+    newChunk(w);
+
+    for (int i = 0; i < threads; i++)
+        w->workers.push_back(std::thread(workerThread, w));
+
+    return w;
+}
+
+
+static inline FLAC__int32 convertSample(const void *samples, int sample_type, int64_t i, int bits) {
+    if (sample_type == SF_FORMAT_PCM_16) {
+        int value = ((const int16_t *)samples)[i];
+        return bits >= 16 ? value * (1 << (bits - 16)) : value >> (16 - bits);
+    } else if (sample_type == SF_FORMAT_PCM_32) {
+        return ((const int32_t *)samples)[i] >> (32 - bits);
+    }
+
+    if (sample_type == SF_FORMAT_FLOAT)
+        return floatToFlacSample(((const float *)samples)[i], bits) >> (32 - bits);
+    else
+        return floatToFlacSample(((const double *)samples)[i], bits) >> (32 - bits);
+}
+
+
+bool writeFlacSamples(DambFlacWriter *w, const void *samples, int sample_type, int64_t sample_count, std::string *error) {
+    int bytes_per_sample = (w->bits + 7) / 8;
+    uint8_t md5_buffer[4096];
+    size_t md5_used = 0;
+
+    int64_t values = sample_count * w->channels;
+
+    for (int64_t i = 0; i < values; i++) {
+        FLAC__int32 value = convertSample(samples, sample_type, i, w->bits);
+        w->current->samples.push_back(value);
+
+        // The MD5 sum is computed on the little endian samples.
+        for (int b = 0; b < bytes_per_sample; b++)
+            md5_buffer[md5_used++] = (uint8_t)(value >> (8 * b));
+        if (md5_used + 4 > sizeof(md5_buffer)) {
+            md5Update(&w->md5, md5_buffer, md5_used);
+            md5_used = 0;
+        }
+
+        if ((int64_t)w->current->samples.size() == w->chunk_samples * w->channels) {
+            submitCurrentChunk(w);
+            newChunk(w);
+
+            if (!writeFinishedChunks(w, w->max_pending)) {
+                *error = "failed to encode or write a chunk";
+                return false;
+            }
+        }
+    }
+
+    md5Update(&w->md5, md5_buffer, md5_used);
+    w->total_samples += sample_count;
+
+    return !w->failed;
+}
+
+
+bool closeFlacWriter(DambFlacWriter *w, std::string *error) {
+    // The first chunk is always encoded, even if empty, for the metadata.
+    if (!w->current->samples.empty() || w->next_frame == 0)
+        submitCurrentChunk(w);
+
+    bool ok = writeFinishedChunks(w, 0);
+
+    {
+        std::lock_guard<std::mutex> guard(w->lock);
+        w->stop = true;
+        w->work.notify_all();
+    }
+    for (size_t i = 0; i < w->workers.size(); i++)
+        w->workers[i].join();
+
+    // Same fields libFLAC updates when it finishes a seekable stream.
+    if (ok && w->streaminfo_block.size() == 42) {
+        uint8_t *streaminfo = w->streaminfo_block.data() + 8;
+
+        size_t min_framesize = w->max_framesize ? w->min_framesize : 0;
+        for (int i = 0; i < 3; i++) {
+            streaminfo[4 + i] = (uint8_t)(min_framesize >> (8 * (2 - i)));
+            streaminfo[7 + i] = (uint8_t)(w->max_framesize >> (8 * (2 - i)));
+        }
+
+        streaminfo[13] = (uint8_t)((streaminfo[13] & 0xF0) | ((w->total_samples >> 32) & 0x0F));
+        for (int i = 0; i < 4; i++)
+            streaminfo[14 + i] = (uint8_t)(w->total_samples >> (8 * (3 - i)));
+
+        md5Final(&w->md5, streaminfo + 18);
+
+        ok = fseek(w->file, 0, SEEK_SET) == 0 &&
+             fwrite(w->streaminfo_block.data(), 1, 42, w->file) == 42;
+    }
+
+    if (fclose(w->file))
+        ok = false;
+
+    if (!ok)
+        *error = "failed to encode or write the file";
+
+    delete w;
+    return ok;
+}
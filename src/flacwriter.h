@@ -0,0 +1,28 @@
+#ifndef DAMB_FLACWRITER_H
+#define DAMB_FLACWRITER_H
+
+#include <cstdint>
+
+#include <string>
+
+
+// Encodes FLAC with libFLAC on several threads. The input is cut into
+// chunks of whole FLAC frames, each chunk is encoded by its own encoder,
+// and the frames are renumbered and written in order, so the file is the
+// same as what a single encoder with the same settings would produce.
+typedef struct DambFlacWriter DambFlacWriter;
+
+
+// bits is 8, 16, or 24. threads is the number of encoding threads.
+DambFlacWriter *createFlacWriter(const std::string &filename, int channels, int samplerate, int bits, int compression_level, int threads, std::string *error);
+
+// Not thread safe. The samples must be given in order. sample_type is the
+// type of the samples, as returned by getSampleType. Float samples are
+// converted with floatToFlacSample. Returns false if any chunk failed to
+// encode or couldn't be written.
+bool writeFlacSamples(DambFlacWriter *writer, const void *samples, int sample_type, int64_t sample_count, std::string *error);
+
+// Encodes what's left, writes the final STREAMINFO, and closes the file.
+bool closeFlacWriter(DambFlacWriter *writer, std::string *error);
+
+#endif
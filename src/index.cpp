@@ -0,0 +1,683 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <VapourSynth.h>
+#include <VSHelper.h>
+
+#include <cstdio>
+#include <sndfile.h>
+
+#include "index.h"
+
+
+#ifdef _WIN32
+#define damb_fseek _fseeki64
+#define damb_ftell _ftelli64
+#else
+#define damb_fseek fseeko
+#define damb_ftell ftello
+#endif
+
+
+static const char index_magic[8] = { 'D', 'A', 'M', 'B', 'I', 'D', 'X', 2 };
+static const char *index_extension = ".dambidx";
+
+// Magic, file size, modification time, header size, and number of points.
+static const int64_t index_header_bytes = 40;
+static const int64_t index_point_bytes = 16;
+
+
+struct DambSeekStream {
+    FILE *file;
+    int64_t header_size;
+    int64_t data_offset;
+    int64_t file_size;
+    int64_t position;
+};
+
+
+bool getFileInfo(const std::string &filename, int64_t *size, int64_t *mtime) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(filename.c_str(), &st))
+        return false;
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st))
+        return false;
+#endif
+
+    // Files can be modified several times within a second, so the
+    // nanoseconds are included where the system has them.
+    int64_t nanoseconds = 0;
+#if defined(__APPLE__)
+    nanoseconds = st.st_mtimespec.tv_nsec;
+#elif !defined(_WIN32)
+    nanoseconds = st.st_mtim.tv_nsec;
+#endif
+
+    *size = st.st_size;
+    *mtime = (int64_t)st.st_mtime * 1000000000 + nanoseconds;
+    return true;
+}
+
+
+// Like FNV-1a.
+static uint64_t hashString(const std::string &s) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < s.size(); i++) {
+        hash ^= (uint8_t)s[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+
+static std::string getIndexFilename(const std::string &filename, const std::string &index_dir) {
+    if (index_dir.empty())
+        return filename + index_extension;
+
+    // Files with the same name in different directories mustn't share an
+    // index, so the name is followed by a hash of the full path.
+    std::string path = filename;
+#ifdef _WIN32
+    char *full = _fullpath(NULL, filename.c_str(), 0);
+#else
+    char *full = realpath(filename.c_str(), NULL);
+#endif
+    if (full) {
+        path = full;
+        free(full);
+    }
+
+    size_t slash = filename.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? filename : filename.substr(slash + 1);
+
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)hashString(path));
+
+    return index_dir + "/" + name + "-" + hash + index_extension;
+}
+
+
+static void writeInt64(FILE *f, int64_t value) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = (uint8_t)((uint64_t)value >> (i * 8));
+    fwrite(bytes, 1, 8, f);
+}
+
+
+static bool readInt64(FILE *f, int64_t *value) {
+    uint8_t bytes[8];
+    if (fread(bytes, 1, 8, f) != 8)
+        return false;
+
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v |= (uint64_t)bytes[i] << (i * 8);
+    *value = (int64_t)v;
+    return true;
+}
+
+
+// The index file isn't trusted: it must describe frames that fit in the
+// audio file, in order, starting at the first sample. Otherwise it's built
+// again.
+static bool checkSeekIndex(const DambSeekIndex &index) {
+    if (index.header_size < 4 || index.header_size >= index.file_size || index.points[0].sample != 0)
+        return false;
+
+    for (size_t i = 0; i < index.points.size(); i++) {
+        const DambSeekPoint &point = index.points[i];
+
+        if (point.offset < index.header_size || point.offset >= index.file_size)
+            return false;
+
+        if (i > 0 && (point.sample <= index.points[i - 1].sample || point.offset <= index.points[i - 1].offset))
+            return false;
+    }
+
+    return true;
+}
+
+
+static bool loadSeekIndex(const std::string &index_filename, DambSeekIndex *index) {
+    FILE *f = fopen(index_filename.c_str(), "rb");
+    if (!f)
+        return false;
+
+    // Bounds the number of points, so that a damaged count can't make it
+    // allocate more than the file holds.
+    int64_t index_size = -1;
+    if (!damb_fseek(f, 0, SEEK_END))
+        index_size = damb_ftell(f);
+
+    char magic[8];
+    int64_t file_size, mtime, header_size, count;
+
+    bool ok = index_size >= index_header_bytes && !damb_fseek(f, 0, SEEK_SET) &&
+              fread(magic, 1, 8, f) == 8 && !memcmp(magic, index_magic, 8) &&
+              readInt64(f, &file_size) && file_size == index->file_size &&
+              readInt64(f, &mtime) && mtime == index->mtime &&
+              readInt64(f, &header_size) &&
+              readInt64(f, &count) && count > 0 && count <= (index_size - index_header_bytes) / index_point_bytes;
+
+    if (ok) {
+        index->header_size = header_size;
+        index->points.resize(count);
+
+        for (int64_t i = 0; i < count && ok; i++)
+            ok = readInt64(f, &index->points[i].sample) && readInt64(f, &index->points[i].offset);
+
+        ok = ok && checkSeekIndex(*index);
+    }
+
+    fclose(f);
+
+    if (!ok)
+        index->points.clear();
+
+    return ok;
+}
+
+
+static void saveSeekIndex(const std::string &index_filename, const DambSeekIndex &index) {
+    // Failing to save the index is not an error, it just has to be built again next time.
+    FILE *f = fopen(index_filename.c_str(), "wb");
+    if (!f)
+        return;
+
+    fwrite(index_magic, 1, 8, f);
+    writeInt64(f, index.file_size);
+    writeInt64(f, index.mtime);
+    writeInt64(f, index.header_size);
+    writeInt64(f, (int64_t)index.points.size());
+
+    for (size_t i = 0; i < index.points.size(); i++) {
+        writeInt64(f, index.points[i].sample);
+        writeInt64(f, index.points[i].offset);
+    }
+
+    bool failed = ferror(f) != 0;
+    if (fclose(f) || failed)
+        remove(index_filename.c_str());
+}
+
+
+// Reads the file sequentially, keeping enough bytes around to parse a frame header.
+typedef struct {
+    FILE *file;
+    std::vector<uint8_t> data;
+    // File offset of data[0].
+    int64_t data_offset;
+    bool eof;
+} DambScanBuffer;
+
+
+// Makes sure the bytes from offset to offset + count are in memory, if the file is long enough.
+static void scanFill(DambScanBuffer *buf, int64_t offset, size_t count) {
+    if (buf->eof || offset + (int64_t)count <= buf->data_offset + (int64_t)buf->data.size())
+        return;
+
+    int64_t consumed = std::min<int64_t>(offset - buf->data_offset, buf->data.size());
+    buf->data.erase(buf->data.begin(), buf->data.begin() + consumed);
+    buf->data_offset += consumed;
+    count += offset - buf->data_offset;
+
+    while (!buf->eof && buf->data.size() < count) {
+        size_t old_size = buf->data.size();
+        size_t chunk = 1 << 20;
+        buf->data.resize(old_size + chunk);
+        size_t got = fread(buf->data.data() + old_size, 1, chunk, buf->file);
+        buf->data.resize(old_size + got);
+        if (got < chunk)
+            buf->eof = true;
+    }
+}
+
+
+static uint8_t crc8(const uint8_t *data, size_t size) {
+    uint8_t crc = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+
+    return crc;
+}
+
+
+// Parses the frame header at the start of data. Returns the size of the header,
+// or 0 if it's not a valid frame header.
+static size_t parseFrameHeader(const uint8_t *data, size_t size, uint64_t *number, int *blocksize, bool *variable) {
+    if (size < 16 || data[0] != 0xFF || (data[1] & 0xFE) != 0xF8)
+        return 0;
+
+    *variable = data[1] & 1;
+
+    int blocksize_code = data[2] >> 4;
+    int samplerate_code = data[2] & 15;
+    int channels_code = data[3] >> 4;
+    int samplesize_code = (data[3] >> 1) & 7;
+
+    if (blocksize_code == 0 || samplerate_code == 15 || channels_code > 10 || samplesize_code == 3 || (data[3] & 1))
+        return 0;
+
+    size_t pos = 4;
+
+    // UTF-8 style coded frame or sample number.
+    int extra;
+    uint64_t value;
+    if (!(data[pos] & 0x80)) {
+        extra = 0;
+        value = data[pos];
+    } else if ((data[pos] & 0xE0) == 0xC0) {
+        extra = 1;
+        value = data[pos] & 0x1F;
+    } else if ((data[pos] & 0xF0) == 0xE0) {
+        extra = 2;
+        value = data[pos] & 0x0F;
+    } else if ((data[pos] & 0xF8) == 0xF0) {
+        extra = 3;
+        value = data[pos] & 0x07;
+    } else if ((data[pos] & 0xFC) == 0xF8) {
+        extra = 4;
+        value = data[pos] & 0x03;
+    } else if ((data[pos] & 0xFE) == 0xFC) {
+        extra = 5;
+        value = data[pos] & 0x01;
+    } else if (data[pos] == 0xFE && *variable) {
+        extra = 6;
+        value = 0;
+    } else {
+        return 0;
+    }
+    pos++;
+
+    for (int i = 0; i < extra; i++, pos++) {
+        if ((data[pos] & 0xC0) != 0x80)
+            return 0;
+        value = (value << 6) | (data[pos] & 0x3F);
+    }
+
+    *number = value;
+
+    if (blocksize_code == 1)
+        *blocksize = 192;
+    else if (blocksize_code <= 5)
+        *blocksize = 576 << (blocksize_code - 2);
+    else if (blocksize_code == 6)
+        *blocksize = data[pos++] + 1;
+    else if (blocksize_code == 7) {
+        *blocksize = ((data[pos] << 8) | data[pos + 1]) + 1;
+        pos += 2;
+    } else
+        *blocksize = 256 << (blocksize_code - 8);
+
+    if (samplerate_code == 12)
+        pos += 1;
+    else if (samplerate_code == 13 || samplerate_code == 14)
+        pos += 2;
+
+    if (crc8(data, pos) != data[pos])
+        return 0;
+
+    return pos + 1;
+}
+
+
+static bool skipId3(FILE *f, int64_t *offset) {
+    uint8_t id3[10];
+    if (fread(id3, 1, 10, f) != 10)
+        return false;
+
+    *offset = 0;
+    if (!memcmp(id3, "ID3", 3)) {
+        *offset = 10 + (((int64_t)id3[6] & 0x7F) << 21 | (id3[7] & 0x7F) << 14 | (id3[8] & 0x7F) << 7 | (id3[9] & 0x7F));
+        if (id3[5] & 0x10)
+            *offset += 10;
+    }
+
+    return damb_fseek(f, *offset, SEEK_SET) == 0;
+}
+
+
+static bool buildFlacIndex(const std::string &filename, DambSeekIndex *index, std::string *error) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        *error = "couldn't open the file";
+        return false;
+    }
+
+    int64_t offset;
+    uint8_t signature[4];
+
+    if (!skipId3(f, &offset) || fread(signature, 1, 4, f) != 4 || memcmp(signature, "fLaC", 4)) {
+        fclose(f);
+        *error = "not a FLAC file";
+        return false;
+    }
+    offset += 4;
+
+    uint64_t total_samples = 0;
+
+    // Metadata blocks.
+    bool last = false;
+    while (!last) {
+        uint8_t block[4];
+        if (fread(block, 1, 4, f) != 4) {
+            fclose(f);
+            *error = "truncated metadata";
+            return false;
+        }
+
+        last = block[0] & 0x80;
+        int type = block[0] & 0x7F;
+        int64_t length = (block[1] << 16) | (block[2] << 8) | block[3];
+
+        if (type == 0) {
+            uint8_t streaminfo[18];
+            if (length < 18 || fread(streaminfo, 1, 18, f) != 18) {
+                fclose(f);
+                *error = "invalid STREAMINFO";
+                return false;
+            }
+
+            total_samples = ((uint64_t)(streaminfo[13] & 0x0F) << 32) |
+                            ((uint64_t)streaminfo[14] << 24) | (streaminfo[15] << 16) | (streaminfo[16] << 8) | streaminfo[17];
+            length -= 18;
+        }
+
+        if (damb_fseek(f, length, SEEK_CUR)) {
+            fclose(f);
+            *error = "truncated metadata";
+            return false;
+        }
+        offset = damb_ftell(f);
+    }
+
+    index->header_size = offset;
+    index->points.clear();
+
+    DambScanBuffer buf;
+    buf.file = f;
+    buf.data_offset = offset;
+    buf.eof = false;
+
+    // A sync code is only accepted if its header is valid and it has exactly
+    // the number we expect after the previous frame, so that sync-like bytes
+    // in the compressed data are skipped.
+    uint64_t expected_sample = 0;
+    int fixed_blocksize = 0;
+
+    while (true) {
+        scanFill(&buf, offset, 16);
+
+        int64_t skip = offset - buf.data_offset;
+        int64_t available = (int64_t)buf.data.size() - skip;
+        if (available < 2)
+            break;
+
+        const uint8_t *data = buf.data.data() + skip;
+        const uint8_t *sync = NULL;
+        const uint8_t *p = data;
+        while ((p = (const uint8_t *)memchr(p, 0xFF, data + available - 1 - p))) {
+            if ((p[1] & 0xFE) == 0xF8) {
+                sync = p;
+                break;
+            }
+            p++;
+        }
+
+        if (!sync) {
+            offset += available - 1;
+            if (buf.eof)
+                break;
+            continue;
+        }
+
+        offset += sync - data;
+        scanFill(&buf, offset, 16);
+
+        // Pad the end of the file with zeroes, because the last frame can be
+        // shorter than the longest possible frame header.
+        uint8_t header[16] = { 0 };
+        int64_t header_available = std::min<int64_t>((int64_t)buf.data.size() - (offset - buf.data_offset), 16);
+        memcpy(header, buf.data.data() + (offset - buf.data_offset), header_available);
+
+        uint64_t number;
+        int blocksize;
+        bool variable;
+        size_t header_length = parseFrameHeader(header, 16, &number, &blocksize, &variable);
+
+        uint64_t sample = number;
+        if (header_length && !variable) {
+            if (!fixed_blocksize && number == 0)
+                fixed_blocksize = blocksize;
+            sample = number * fixed_blocksize;
+        }
+
+        if (header_length && (variable || fixed_blocksize) && sample == expected_sample) {
+            DambSeekPoint point;
+            point.sample = (sf_count_t)sample;
+            point.offset = offset;
+            index->points.push_back(point);
+
+            expected_sample += blocksize;
+            offset += header_length;
+        } else {
+            offset++;
+        }
+    }
+
+    fclose(f);
+
+    if (index->points.empty() || (total_samples && expected_sample < total_samples)) {
+        index->points.clear();
+        *error = "couldn't find every frame";
+        return false;
+    }
+
+    return true;
+}
+
+
+int getSeekIndex(const std::string &filename, const std::string &index_dir, bool build, bool save, DambSeekIndex *index, std::string *error) {
+    SF_INFO sfinfo;
+    sfinfo.format = 0;
+    SNDFILE *sndfile = sf_open(filename.c_str(), SFM_READ, &sfinfo);
+    if (!sndfile) {
+        *error = sf_strerror(NULL);
+        return -1;
+    }
+    sf_close(sndfile);
+
+    // Seeking in uncompressed files is already cheap. Ogg pages can't be
+    // decoded without the packets before them, so they can't be indexed
+    // this way.
+    if ((sfinfo.format & SF_FORMAT_TYPEMASK) != SF_FORMAT_FLAC)
+        return 0;
+
+    if (!getFileInfo(filename, &index->file_size, &index->mtime)) {
+        *error = "couldn't get the size and modification time of the file";
+        return -1;
+    }
+
+    std::string index_filename = getIndexFilename(filename, index_dir);
+
+    if (loadSeekIndex(index_filename, index))
+        return 1;
+
+    if (!build)
+        return 0;
+
+    if (!buildFlacIndex(filename, index, error))
+        return -1;
+
+    if (save)
+        saveSeekIndex(index_filename, *index);
+
+    return 1;
+}
+
+
+const DambSeekPoint *findSeekPoint(const DambSeekIndex &index, sf_count_t sample) {
+    auto it = std::upper_bound(index.points.begin(), index.points.end(), sample,
+                               [] (sf_count_t s, const DambSeekPoint &p) { return s < p.sample; });
+
+    if (it == index.points.begin())
+        return &index.points[0];
+
+    return &*(it - 1);
+}
+
+
+static sf_count_t seekStreamGetLength(void *user_data) {
+    DambSeekStream *s = (DambSeekStream *)user_data;
+    return s->header_size + (s->file_size - s->data_offset);
+}
+
+
+static sf_count_t seekStreamSeek(sf_count_t offset, int whence, void *user_data) {
+    DambSeekStream *s = (DambSeekStream *)user_data;
+
+    if (whence == SEEK_CUR)
+        offset += s->position;
+    else if (whence == SEEK_END)
+        offset += seekStreamGetLength(user_data);
+
+    if (offset < 0)
+        return -1;
+
+    s->position = offset;
+    return s->position;
+}
+
+
+static sf_count_t seekStreamRead(void *ptr, sf_count_t count, void *user_data) {
+    DambSeekStream *s = (DambSeekStream *)user_data;
+    uint8_t *dst = (uint8_t *)ptr;
+    sf_count_t total = 0;
+
+    while (count > 0) {
+        int64_t file_offset;
+        sf_count_t chunk;
+
+        if (s->position < s->header_size) {
+            file_offset = s->position;
+            chunk = std::min<sf_count_t>(count, s->header_size - s->position);
+        } else {
+            file_offset = s->data_offset + (s->position - s->header_size);
+            chunk = std::min<sf_count_t>(count, s->file_size - file_offset);
+        }
+
+        if (chunk <= 0 || damb_fseek(s->file, file_offset, SEEK_SET))
+            break;
+
+        size_t got = fread(dst, 1, (size_t)chunk, s->file);
+
+        dst += got;
+        total += got;
+        count -= got;
+        s->position += got;
+
+        if ((sf_count_t)got < chunk)
+            break;
+    }
+
+    return total;
+}
+
+
+static sf_count_t seekStreamWrite(const void *ptr, sf_count_t count, void *user_data) {
+    return 0;
+}
+
+
+static sf_count_t seekStreamTell(void *user_data) {
+    DambSeekStream *s = (DambSeekStream *)user_data;
+    return s->position;
+}
+
+
+SNDFILE *openAtSeekPoint(const std::string &filename, const DambSeekIndex &index, const DambSeekPoint &point, DambSeekStream **stream) {
+    DambSeekStream *s = new DambSeekStream();
+    s->file = fopen(filename.c_str(), "rb");
+    s->header_size = index.header_size;
+    s->data_offset = point.offset;
+    s->file_size = index.file_size;
+    s->position = 0;
+
+    if (!s->file) {
+        delete s;
+        return NULL;
+    }
+
+    SF_VIRTUAL_IO vio;
+    vio.get_filelen = seekStreamGetLength;
+    vio.seek = seekStreamSeek;
+    vio.read = seekStreamRead;
+    vio.write = seekStreamWrite;
+    vio.tell = seekStreamTell;
+
+    SF_INFO sfinfo;
+    sfinfo.format = 0;
+    SNDFILE *sndfile = sf_open_virtual(&vio, SFM_READ, &sfinfo, s);
+
+    if (!sndfile) {
+        closeSeekStream(s);
+        return NULL;
+    }
+
+    *stream = s;
+    return sndfile;
+}
+
+
+void closeSeekStream(DambSeekStream *stream) {
+    if (!stream)
+        return;
+
+    fclose(stream->file);
+    delete stream;
+}
+
+
+static void VS_CC dambIndexCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::string filename = vsapi->propGetData(in, "file", 0, NULL);
+
+    int err;
+    const char *index_dir = vsapi->propGetData(in, "index_dir", 0, &err);
+
+    DambSeekIndex index;
+    std::string error;
+
+    int ret = getSeekIndex(filename, index_dir ? index_dir : "", true, true, &index, &error);
+    if (ret < 0) {
+        vsapi->setError(out, std::string("Index: Couldn't index ").append(filename).append(": ").append(error).append(".").c_str());
+        return;
+    }
+
+    vsapi->propSetInt(out, "seekpoints", index.points.size(), paReplace);
+}
+
+
+void indexRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
+    registerFunc("Index",
+            "file:data;"
+            "index_dir:data:opt;"
+            , dambIndexCreate, 0, plugin);
+}
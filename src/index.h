@@ -0,0 +1,55 @@
+#ifndef DAMB_INDEX_H
+#define DAMB_INDEX_H
+
+#include <cstdint>
+#include <cstdio>
+
+#include <string>
+#include <vector>
+
+#include <sndfile.h>
+
+
+// Sample number of the first sample in a FLAC frame, and the frame's
+// position in the file.
+typedef struct {
+    sf_count_t sample;
+    int64_t offset;
+} DambSeekPoint;
+
+
+// The file's size and modification time are stored so that the index can
+// be thrown away if the audio file changes.
+typedef struct {
+    int64_t file_size;
+    // In nanoseconds.
+    int64_t mtime;
+    // Number of bytes before the first frame (signature and metadata blocks).
+    int64_t header_size;
+    std::vector<DambSeekPoint> points;
+} DambSeekIndex;
+
+
+// Presents the file's header followed by everything from a seek point
+// onwards to libsndfile, so that decoding starts right at the seek point.
+typedef struct DambSeekStream DambSeekStream;
+
+
+// Finds the file's size and modification time, in nanoseconds, but only as
+// precise as the system keeps it. Returns false if the file can't be found.
+bool getFileInfo(const std::string &filename, int64_t *size, int64_t *mtime);
+
+// The index is loaded from index_dir, or from next to the file if index_dir
+// is empty. If there isn't a valid one and build is true, it is built, and
+// saved there if save is true. Returns 1 if an index was loaded or built, 0
+// if the file doesn't need one or build is false and none was saved, and -1
+// on error.
+int getSeekIndex(const std::string &filename, const std::string &index_dir, bool build, bool save, DambSeekIndex *index, std::string *error);
+
+const DambSeekPoint *findSeekPoint(const DambSeekIndex &index, sf_count_t sample);
+
+SNDFILE *openAtSeekPoint(const std::string &filename, const DambSeekIndex &index, const DambSeekPoint &point, DambSeekStream **stream);
+
+void closeSeekStream(DambSeekStream *stream);
+
+#endif
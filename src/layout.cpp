@@ -0,0 +1,218 @@
+#include <cstdint>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include <VapourSynth.h>
+#include <VSHelper.h>
+
+#include <cstdio>
+#include <sndfile.h>
+
+#include "shared.h"
+#include "layout.h"
+
+
+int getLayoutFromString(const char *layout) {
+    std::string l(layout);
+
+    if (l == "interleaved")
+        return DambLayoutInterleaved;
+    if (l == "planar")
+        return DambLayoutPlanar;
+    return -1;
+}
+
+
+// Only the size of the samples matters, so doubles are copied as int64_t.
+template<class T>
+static void interleave(const void *const *planes, void *dst, int channels, int64_t length) {
+    T *out = (T *)dst;
+
+    if (channels == 2) {
+        const T *left = (const T *)planes[0];
+        const T *right = (const T *)planes[1];
+
+        for (int64_t i = 0; i < length; i++) {
+            out[i * 2] = left[i];
+            out[i * 2 + 1] = right[i];
+        }
+
+        return;
+    }
+
+    for (int c = 0; c < channels; c++) {
+        const T *plane = (const T *)planes[c];
+
+        for (int64_t i = 0; i < length; i++)
+            out[i * channels + c] = plane[i];
+    }
+}
+
+
+template<class T>
+static void deinterleave(const void *src, void *const *planes, int channels, int64_t length) {
+    const T *in = (const T *)src;
+
+    if (channels == 2) {
+        T *left = (T *)planes[0];
+        T *right = (T *)planes[1];
+
+        for (int64_t i = 0; i < length; i++) {
+            left[i] = in[i * 2];
+            right[i] = in[i * 2 + 1];
+        }
+
+        return;
+    }
+
+    for (int c = 0; c < channels; c++) {
+        T *plane = (T *)planes[c];
+
+        for (int64_t i = 0; i < length; i++)
+            plane[i] = in[i * channels + c];
+    }
+}
+
+
+void interleaveSamples(const void *const *planes, void *dst, int channels, int64_t length, int sample_size) {
+    if (channels == 1)
+        memcpy(dst, planes[0], length * sample_size);
+    else if (sample_size == 2)
+        interleave<int16_t>(planes, dst, channels, length);
+    else if (sample_size == 4)
+        interleave<int32_t>(planes, dst, channels, length);
+    else
+        interleave<int64_t>(planes, dst, channels, length);
+}
+
+
+void deinterleaveSamples(const void *src, void *const *planes, int channels, int64_t length, int sample_size) {
+    if (channels == 1)
+        memcpy(planes[0], src, length * sample_size);
+    else if (sample_size == 2)
+        deinterleave<int16_t>(src, planes, channels, length);
+    else if (sample_size == 4)
+        deinterleave<int32_t>(src, planes, channels, length);
+    else
+        deinterleave<int64_t>(src, planes, channels, length);
+}
+
+
+template<class T>
+static void select(const void *src, int src_channels, const int *selected, int channels, int layout, int64_t length, void *dst) {
+    const T *in = (const T *)src;
+    T *out = (T *)dst;
+
+    if (layout == DambLayoutPlanar) {
+        for (int c = 0; c < channels; c++) {
+            T *plane = out + c * length;
+
+            for (int64_t i = 0; i < length; i++)
+                plane[i] = in[i * src_channels + selected[c]];
+        }
+    } else {
+        for (int64_t i = 0; i < length; i++)
+            for (int c = 0; c < channels; c++)
+                out[i * channels + c] = in[i * src_channels + selected[c]];
+    }
+}
+
+
+void selectChannels(const void *src, int src_channels, const int *selected, int channels, int layout, int64_t length, int sample_size, void *dst) {
+    if (sample_size == 2)
+        select<int16_t>(src, src_channels, selected, channels, layout, length, dst);
+    else if (sample_size == 4)
+        select<int32_t>(src, src_channels, selected, channels, layout, length, dst);
+    else
+        select<int64_t>(src, src_channels, selected, channels, layout, length, dst);
+}
+
+
+bool getFrameSamples(const VSMap *props, int channels, int sample_size, int layout, std::vector<uint8_t> *scratch, DambFrameSamples *samples, const VSAPI *vsapi) {
+    if (channels < 1)
+        return false;
+
+    int err;
+
+    int frame_layout = int64ToIntS(vsapi->propGetInt(props, damb_layout, 0, &err));
+    if (err)
+        frame_layout = DambLayoutInterleaved;
+
+    std::vector<const void *> data;
+    int64_t length;
+
+    if (frame_layout == DambLayoutInterleaved) {
+        const char *buffer = vsapi->propGetData(props, damb_samples, 0, &err);
+        if (err)
+            return false;
+
+        int64_t size = vsapi->propGetDataSize(props, damb_samples, 0, &err);
+        if (size % (channels * sample_size))
+            return false;
+
+        length = size / (channels * sample_size);
+        data.push_back(buffer);
+    } else if (frame_layout == DambLayoutPlanar) {
+        if (vsapi->propNumElements(props, damb_samples) != channels)
+            return false;
+
+        int64_t size = vsapi->propGetDataSize(props, damb_samples, 0, &err);
+        if (size % sample_size)
+            return false;
+
+        for (int c = 0; c < channels; c++) {
+            if (vsapi->propGetDataSize(props, damb_samples, c, &err) != size)
+                return false;
+            data.push_back(vsapi->propGetData(props, damb_samples, c, &err));
+        }
+
+        length = size / sample_size;
+    } else {
+        return false;
+    }
+
+    samples->length = length;
+
+    if (layout < 0 || layout == frame_layout) {
+        samples->layout = frame_layout;
+        samples->data = data;
+        return true;
+    }
+
+    scratch->resize(length * channels * sample_size);
+
+    samples->layout = layout;
+    samples->data.clear();
+
+    if (layout == DambLayoutInterleaved) {
+        interleaveSamples(data.data(), scratch->data(), channels, length, sample_size);
+        samples->data.push_back(scratch->data());
+    } else {
+        std::vector<void *> planes(channels);
+        for (int c = 0; c < channels; c++)
+            planes[c] = scratch->data() + c * length * sample_size;
+
+        deinterleaveSamples(data[0], planes.data(), channels, length, sample_size);
+
+        for (int c = 0; c < channels; c++)
+            samples->data.push_back(planes[c]);
+    }
+
+    return true;
+}
+
+
+void setFrameSamples(VSMap *props, int layout, const void *buffer, int channels, int64_t length, int sample_size, const VSAPI *vsapi) {
+    if (layout == DambLayoutPlanar) {
+        int64_t plane_size = length * sample_size;
+
+        for (int c = 0; c < channels; c++)
+            vsapi->propSetData(props, damb_samples, (const char *)buffer + c * plane_size, plane_size, c ? paAppend : paReplace);
+    } else {
+        vsapi->propSetData(props, damb_samples, (const char *)buffer, length * channels * sample_size, paReplace);
+    }
+
+    vsapi->propSetInt(props, damb_layout, layout, paReplace);
+}
@@ -0,0 +1,67 @@
+#ifndef DAMB_LAYOUT_H
+#define DAMB_LAYOUT_H
+
+#include <cstdint>
+
+#include <vector>
+
+#include <VapourSynth.h>
+
+
+// Values of the DambLayout frame property. Frames without it are
+// interleaved, like all frames were before it existed.
+//
+// Interleaved: DambSamples is a single blob, with the samples of all the
+// channels for one instant next to each other.
+//
+// Planar: DambSamples has one element per channel, each holding the
+// samples of that channel only.
+//
+// Data properties are copied into strings by VapourSynth, so the samples
+// are only as aligned as the allocator leaves them, which is enough for
+// one sample but not always for a vector register, in either layout. The
+// mix and convert kernels use unaligned loads and stores, so the samples
+// are used where they are, without copying them into aligned memory.
+enum {
+    DambLayoutInterleaved = 0,
+    DambLayoutPlanar = 1
+};
+
+
+// Returns -1 if the string is neither "interleaved" nor "planar".
+int getLayoutFromString(const char *layout);
+
+
+// planes[c] has length samples of channel c.
+void interleaveSamples(const void *const *planes, void *dst, int channels, int64_t length, int sample_size);
+
+void deinterleaveSamples(const void *src, void *const *planes, int channels, int64_t length, int sample_size);
+
+// Copies the channels listed in selected, in that order, from interleaved
+// samples with src_channels channels. dst gets them in the given layout,
+// with the planes one after the other for planar samples.
+void selectChannels(const void *src, int src_channels, const int *selected, int channels, int layout, int64_t length, int sample_size, void *dst);
+
+
+typedef struct {
+    int layout;
+    // Number of samples per channel.
+    int64_t length;
+    // One pointer for interleaved samples, one per channel for planar.
+    std::vector<const void *> data;
+} DambFrameSamples;
+
+
+// Finds the samples in a frame's properties. If layout is -1, they are
+// returned as they are. Otherwise they are converted to layout if the frame
+// has the other one, into scratch, which must outlive samples.
+//
+// Returns false if the samples are missing, or don't match channels and
+// sample_size.
+bool getFrameSamples(const VSMap *props, int channels, int sample_size, int layout, std::vector<uint8_t> *scratch, DambFrameSamples *samples, const VSAPI *vsapi);
+
+// Sets DambSamples and DambLayout. For planar samples, buffer holds the
+// planes one after the other.
+void setFrameSamples(VSMap *props, int layout, const void *buffer, int channels, int64_t length, int sample_size, const VSAPI *vsapi);
+
+#endif
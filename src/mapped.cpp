@@ -0,0 +1,228 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <sndfile.h>
+
+#include "shared.h"
+#include "mapped.h"
+#include "riff.h"
+
+
+// Checks that the fmt chunk describes the same samples the frames contain.
+static bool checkFmtChunk(const uint8_t *fmt, uint64_t size, const SF_INFO &sfinfo) {
+    if (size < 16)
+        return false;
+
+    int tag = readLE16(fmt);
+    int channels = readLE16(fmt + 2);
+    uint32_t samplerate = readLE32(fmt + 4);
+    int block_align = readLE16(fmt + 12);
+    int bits = readLE16(fmt + 14);
+
+    if (tag == 0xFFFE) {
+        if (size < 40 || memcmp(fmt + 26, wavex_subformat_tail, sizeof(wavex_subformat_tail)))
+            return false;
+        tag = readLE16(fmt + 24);
+    }
+
+    int sample_type = getSampleType(sfinfo.format);
+    int sample_size = getSampleSize(sample_type);
+
+    if (tag == 1) {
+        if (!((bits == 16 && sample_type == SF_FORMAT_PCM_16) || (bits == 32 && sample_type == SF_FORMAT_PCM_32)))
+            return false;
+    } else if (tag == 3) {
+        if (!((bits == 32 && sample_type == SF_FORMAT_FLOAT) || (bits == 64 && sample_type == SF_FORMAT_DOUBLE)))
+            return false;
+    } else {
+        return false;
+    }
+
+    return channels == sfinfo.channels &&
+           (int)samplerate == sfinfo.samplerate &&
+           block_align == channels * sample_size;
+}
+
+
+// Finds the data chunk of a WAV or WAVEX file. Returns false if the samples
+// can't be used as they are.
+static bool parseWav(const uint8_t *file, uint64_t file_size, const SF_INFO &sfinfo, uint64_t *data_offset, uint64_t *data_size) {
+    if (file_size < 12 || memcmp(file, "RIFF", 4) || memcmp(file + 8, "WAVE", 4))
+        return false;
+
+    bool fmt_ok = false;
+    uint64_t pos = 12;
+
+    while (pos + 8 <= file_size) {
+        const uint8_t *chunk = file + pos;
+        uint64_t size = readLE32(chunk + 4);
+        pos += 8;
+
+        if (!memcmp(chunk, "fmt ", 4)) {
+            if (pos + size > file_size)
+                return false;
+            fmt_ok = checkFmtChunk(file + pos, size, sfinfo);
+        } else if (!memcmp(chunk, "data", 4)) {
+            // The size in the header is wrong if the writer didn't finish.
+            *data_offset = pos;
+            *data_size = std::min<uint64_t>(size, file_size - pos);
+            if (size == 0 || size == 0xFFFFFFFF)
+                *data_size = file_size - pos;
+            return fmt_ok;
+        }
+
+        pos += size + (size & 1);
+    }
+
+    return false;
+}
+
+
+static bool parseW64(const uint8_t *file, uint64_t file_size, const SF_INFO &sfinfo, uint64_t *data_offset, uint64_t *data_size) {
+    if (file_size < 40 || memcmp(file, w64_riff, 16) || memcmp(file + 24, w64_wave, 16))
+        return false;
+
+    bool fmt_ok = false;
+    uint64_t pos = 40;
+
+    // Chunk sizes include the 24 byte header, and chunks are aligned to 8 bytes.
+    while (pos + 24 <= file_size) {
+        const uint8_t *chunk = file + pos;
+        uint64_t size = readLE64(chunk + 16);
+        if (size < 24)
+            return false;
+
+        if (!memcmp(chunk, w64_fmt, 16)) {
+            if (pos + size > file_size)
+                return false;
+            fmt_ok = checkFmtChunk(chunk + 24, size - 24, sfinfo);
+        } else if (!memcmp(chunk, w64_data, 16)) {
+            *data_offset = pos + 24;
+            *data_size = std::min<uint64_t>(size - 24, file_size - pos - 24);
+            return fmt_ok;
+        }
+
+        pos += (size + 7) & ~(uint64_t)7;
+    }
+
+    return false;
+}
+
+
+static bool mapView(const std::string &filename, DambMappedFile *mapped) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0 || (uint64_t)size.QuadPart > SIZE_MAX) {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+        return false;
+
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (view == NULL)
+        return false;
+
+    mapped->view = view;
+    mapped->view_size = (size_t)size.QuadPart;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0 || (uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return false;
+    }
+
+    void *view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+        return false;
+
+    mapped->view = view;
+    mapped->view_size = (size_t)st.st_size;
+#endif
+
+    return true;
+}
+
+
+bool mapAudioFile(const std::string &filename, const SF_INFO &sfinfo, DambMappedFile *mapped) {
+    mapped->samples = NULL;
+    mapped->length = 0;
+    mapped->view = NULL;
+    mapped->view_size = 0;
+
+    int type = sfinfo.format & SF_FORMAT_TYPEMASK;
+    if (type != SF_FORMAT_WAV && type != SF_FORMAT_WAVEX && type != SF_FORMAT_W64)
+        return false;
+
+    // Big endian samples need to be byte swapped.
+    if (!isLittleEndian() || (sfinfo.format & SF_FORMAT_ENDMASK) == SF_ENDIAN_BIG)
+        return false;
+
+    if (!mapView(filename, mapped))
+        return false;
+
+    const uint8_t *file = (const uint8_t *)mapped->view;
+    uint64_t data_offset = 0;
+    uint64_t data_size = 0;
+
+    bool ok;
+    if (type == SF_FORMAT_W64)
+        ok = parseW64(file, mapped->view_size, sfinfo, &data_offset, &data_size);
+    else
+        ok = parseWav(file, mapped->view_size, sfinfo, &data_offset, &data_size);
+
+    if (!ok) {
+        unmapAudioFile(mapped);
+        return false;
+    }
+
+    int frame_bytes = sfinfo.channels * getSampleSize(getSampleType(sfinfo.format));
+
+    mapped->samples = file + data_offset;
+    mapped->length = std::min<sf_count_t>(data_size / frame_bytes, sfinfo.frames);
+
+    return true;
+}
+
+
+void unmapAudioFile(DambMappedFile *mapped) {
+    if (!mapped->view)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(mapped->view);
+#else
+    munmap(mapped->view, mapped->view_size);
+#endif
+
+    mapped->view = NULL;
+    mapped->samples = NULL;
+    mapped->length = 0;
+}
@@ -0,0 +1,31 @@
+#ifndef DAMB_MAPPED_H
+#define DAMB_MAPPED_H
+
+#include <cstdint>
+#include <cstdio>
+
+#include <string>
+
+#include <sndfile.h>
+
+
+// An uncompressed audio file mapped into memory, whose samples are stored
+// exactly like the frames store them, so no conversion is needed.
+typedef struct {
+    // First byte of the data chunk.
+    const uint8_t *samples;
+    // Number of complete samples in the data chunk.
+    sf_count_t length;
+
+    void *view;
+    size_t view_size;
+} DambMappedFile;
+
+
+// Returns false if the file can't be mapped, or if its samples need any
+// conversion, in which case libsndfile must be used.
+bool mapAudioFile(const std::string &filename, const SF_INFO &sfinfo, DambMappedFile *mapped);
+
+void unmapAudioFile(DambMappedFile *mapped);
+
+#endif
@@ -5,6 +5,7 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <algorithm>
 
 #include <VapourSynth.h>
 #include <VSHelper.h>
@@ -13,6 +14,10 @@
 #include <sndfile.h>
 
 #include "shared.h"
+#include "layout.h"
+#include "mixkernels.h"
+#include "stats.h"
+#include "trace.h"
 
 
 template<class T>
@@ -56,48 +61,106 @@ using VSUniquePtr = std::unique_ptr<T, VSDeleter<T>>;
 
 
 typedef struct {
-	VSUniquePtr<VSNodeRef> clipa;
-    VSUniquePtr<VSNodeRef> clipb;
-	double clipa_level = 1;
-	double clipb_level = 1;
+    // Mixed in this order. The first one decides the length, the number
+    // of samples in each frame, and the other properties of the output.
+    std::vector<VSUniquePtr<VSNodeRef>> clips;
+    std::vector<double> levels;
     const VSVideoInfo *vi = nullptr;
-
-    std::vector<uint8_t> buffer;
+    // nullptr unless stats were requested.
+    DambStats *stats = nullptr;
 } DambMixData;
 
 
+typedef struct {
+    const void *samples;
+    // Number of samples per channel.
+    int64_t length;
+    double level;
+} DambMixInput;
+
+
 static void VS_CC dambMixInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     DambMixData *d = (DambMixData *) * instanceData;
     vsapi->setVideoInfo(d->vi, 1, node);
 }
 
 
+// Used when some inputs don't have as many samples as the output. They are
+// stretched to the output's length with linear interpolation. Inputs with no
+// samples are silent.
 template<class T>
-void mix(uint8_t *u8_dst_begin, uint8_t *u8_dst_end, const char *clipa_buffer, double clipa_level, const char *clipb_buffer_begin, const char *clipb_buffer_end, double clipb_level, int input_channels)
+static void mixInterpolated(T *dst, int64_t samples, int channels, const std::vector<DambMixInput> &inputs)
 {
-    auto dst_begin = reinterpret_cast<T *>(u8_dst_begin);
-    auto dst_end = reinterpret_cast<T *>(u8_dst_end);
-    auto srca = reinterpret_cast<const T *>(clipa_buffer);
-    auto srcb_begin = reinterpret_cast<const T *>(clipb_buffer_begin);
-    auto srcb_end = reinterpret_cast<const T *>(clipb_buffer_end);
-    int samples = (dst_end-dst_begin)/input_channels;
-    int clipb_samples = (srcb_end-srcb_begin)/input_channels;
-    auto max_sample = samples-1;
-    auto max_clipb_sample = clipb_samples-1;
-
-    for (int i = 0; i<samples; ++i) {
-        for (int k = 0; k<input_channels; ++k) {
-            auto j = i*max_clipb_sample/max_sample;
-            auto lambda = ((i*max_clipb_sample)%max_sample)/double(max_sample);
-
-            if (j==max_clipb_sample) {
-                --j;
-                lambda=1;
+    typedef typename DambMixAccumulator<T>::type W;
+
+    struct Position {
+        // Where the input is for output sample i: i * max_input_sample / max_sample,
+        // which is j + remainder / max_sample.
+        int64_t j, remainder, step, step_remainder, max_input_sample;
+        // Samples to interpolate between.
+        int64_t s0, s1;
+        W lambda;
+    };
+
+    const int64_t max_sample = samples - 1;
+
+    std::vector<const DambMixInput *> active;
+    std::vector<Position> positions;
+
+    for (size_t k = 0; k < inputs.size(); k++) {
+        if (!inputs[k].length)
+            continue;
+
+        Position p;
+        p.j = 0;
+        p.remainder = 0;
+        p.max_input_sample = inputs[k].length - 1;
+        p.step = max_sample ? p.max_input_sample / max_sample : 0;
+        p.step_remainder = max_sample ? p.max_input_sample % max_sample : 0;
+
+        active.push_back(&inputs[k]);
+        positions.push_back(p);
+    }
+
+    for (int64_t i = 0; i < samples; i++) {
+        for (size_t k = 0; k < positions.size(); k++) {
+            Position &p = positions[k];
+
+            if (p.j >= p.max_input_sample || !max_sample) {
+                p.s0 = p.s1 = std::min(p.j, p.max_input_sample);
+                p.lambda = 0;
+            } else {
+                p.s0 = p.j;
+                p.s1 = p.j + 1;
+                p.lambda = static_cast<W>(p.remainder) / static_cast<W>(max_sample);
+            }
+        }
+
+        for (int c = 0; c < channels; c++) {
+            W acc = 0;
+
+            for (size_t k = 0; k < positions.size(); k++) {
+                const Position &p = positions[k];
+                const T *src = (const T *)active[k]->samples;
+
+                W value0 = static_cast<W>(src[p.s0 * channels + c]);
+                W value1 = static_cast<W>(src[p.s1 * channels + c]);
+
+                acc += (value0 + (value1 - value0) * p.lambda) * static_cast<W>(active[k]->level);
             }
 
-            auto srcb_value = srcb_begin[j*input_channels+k]+(srcb_begin[(j+1)*input_channels+k]-srcb_begin[j*input_channels+k])*lambda;
+            dst[i * channels + c] = saturateSample<T, W>(acc);
+        }
+
+        for (size_t k = 0; k < positions.size(); k++) {
+            Position &p = positions[k];
 
-            dst_begin[i*input_channels+k] = static_cast<T>(srca[i*input_channels+k]*clipa_level+srcb_value*clipb_level);
+            p.j += p.step;
+            p.remainder += p.step_remainder;
+            if (p.remainder >= max_sample && max_sample) {
+                p.remainder -= max_sample;
+                p.j++;
+            }
         }
     }
 }
@@ -108,51 +171,137 @@ static const VSFrameRef *VS_CC dambMixGetFrame(int n, int activationReason, void
     DambMixData *d = (DambMixData *) * instanceData;
 
     if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->clipa.get(), frameCtx);
-        vsapi->requestFrameFilter(n, d->clipb.get(), frameCtx);
+        traceAsyncBegin("Mix", "request", d, n);
+        for (size_t i = 0; i < d->clips.size(); i++)
+            vsapi->requestFrameFilter(n, d->clips[i].get(), frameCtx);
     } else if (activationReason == arAllFramesReady) {
-        VSUniquePtr<const VSFrameRef> clipa_frame = { vsapi->getFrameFilter(n, d->clipa.get(), frameCtx), vsapi };
-        VSUniquePtr<const VSFrameRef> clipb_frame = { vsapi->getFrameFilter(n, d->clipb.get(), frameCtx), vsapi };
-        VSFrameRef *dst = vsapi->copyFrame(clipa_frame.get(), core);
-
-        const VSMap *clipa_props = vsapi->getFramePropsRO(clipa_frame.get());
-        const VSMap *clipb_props = vsapi->getFramePropsRO(clipb_frame.get());
-        int err;
-        int input_channels = vsapi->propGetInt(clipa_props, damb_channels, 0, &err);
-        int input_samplerate = vsapi->propGetInt(clipa_props, damb_samplerate, 0, &err);
-        int input_format = vsapi->propGetInt(clipa_props, damb_format, 0, &err);
-
-        // TODO: error checking
-
-        const char *clipa_buffer = vsapi->propGetData(clipa_props, damb_samples, 0, &err);
-        sf_count_t clipa_buffer_size = vsapi->propGetDataSize(clipa_props, damb_samples, 0, &err);
-        const char *clipb_buffer = vsapi->propGetData(clipb_props, damb_samples, 0, &err);
-        sf_count_t clipb_buffer_size = vsapi->propGetDataSize(clipb_props, damb_samples, 0, &err);
-
-        d->buffer.resize(clipa_buffer_size);
-
-        auto sample_type = getSampleType(input_format);
-
-        auto mix_helper=[&] (std::uint8_t *dst_begin, std::uint8_t *dst_end, const char *clipa_buffer, const char *clipb_buffer_begin, const char *clipb_buffer_end)
-        {
-            if (sample_type == SF_FORMAT_PCM_16)
-                mix<short>(dst_begin, dst_end, clipa_buffer, d->clipa_level, clipb_buffer_begin, clipb_buffer_end, d->clipb_level, input_channels);
-            else if (sample_type == SF_FORMAT_PCM_32)
-                mix<int>(dst_begin, dst_end, clipa_buffer, d->clipa_level, clipb_buffer_begin, clipb_buffer_end, d->clipb_level, input_channels);
-            else if (sample_type == SF_FORMAT_FLOAT)
-                mix<float>(dst_begin, dst_end, clipa_buffer, d->clipa_level, clipb_buffer_begin, clipb_buffer_end, d->clipb_level, input_channels);
-            else
-                mix<double>(dst_begin, dst_end, clipa_buffer, d->clipa_level, clipb_buffer_begin, clipb_buffer_end, d->clipb_level, input_channels);        
-        };
-
-        mix_helper(d->buffer.data(), d->buffer.data()+d->buffer.size(), clipa_buffer, clipb_buffer, clipb_buffer+clipb_buffer_size);
+        traceAsyncEnd("Mix", "request", d, n);
+        int64_t trace_start = startTrace();
+
+        std::vector<VSUniquePtr<const VSFrameRef>> frames;
+        for (size_t i = 0; i < d->clips.size(); i++)
+            frames.push_back({ vsapi->getFrameFilter(n, d->clips[i].get(), frameCtx), vsapi });
+
+        int input_channels = 0;
+        int input_samplerate = 0;
+        int input_format = 0;
+        int sample_type = 0;
+        int sample_size = 0;
+
+        // The output has the first clip's layout. Inputs with the other
+        // layout are converted to it.
+        std::vector<DambFrameSamples> frame_samples(frames.size());
+        std::vector<std::vector<uint8_t>> scratch(frames.size());
+
+        std::vector<DambMixInput> inputs(frames.size());
+        bool same_length = true;
+
+        for (size_t i = 0; i < frames.size(); i++) {
+            const VSMap *props = vsapi->getFramePropsRO(frames[i].get());
+            int err[3];
+
+            int channels = int64ToIntS(vsapi->propGetInt(props, damb_channels, 0, &err[0]));
+            int samplerate = int64ToIntS(vsapi->propGetInt(props, damb_samplerate, 0, &err[1]));
+            int format = int64ToIntS(vsapi->propGetInt(props, damb_format, 0, &err[2]));
+
+            if (err[0] || err[1] || err[2] || vsapi->propNumElements(props, damb_samples) < 1) {
+                vsapi->setFilterError(std::string("Mix: Audio data not found in frame ").append(std::to_string(n)).append(" of clip ").append(std::to_string(i)).append(".").c_str(), frameCtx);
+                return nullptr;
+            }
+
+            if (i == 0) {
+                input_channels = channels;
+                input_samplerate = samplerate;
+                input_format = format;
+                sample_type = getSampleType(format);
+                sample_size = getSampleSize(sample_type);
+
+                if (input_channels < 1) {
+                    vsapi->setFilterError(std::string("Mix: Invalid number of channels in frame ").append(std::to_string(n)).append(" of clip 0.").c_str(), frameCtx);
+                    return nullptr;
+                }
+            } else if (channels != input_channels || getSampleType(format) != sample_type) {
+                vsapi->setFilterError(std::string("Mix: Clip ").append(std::to_string(i)).append(" doesn't have the same number of channels and sample type as the first clip.").c_str(), frameCtx);
+                return nullptr;
+            }
+
+            int layout = i ? frame_samples[0].layout : -1;
+
+            if (!getFrameSamples(props, input_channels, sample_size, layout, &scratch[i], &frame_samples[i], vsapi)) {
+                vsapi->setFilterError(std::string("Mix: The audio data in frame ").append(std::to_string(n)).append(" of clip ").append(std::to_string(i)).append(" doesn't contain a whole number of samples.").c_str(), frameCtx);
+                return nullptr;
+            }
+
+            inputs[i].length = frame_samples[i].length;
+            inputs[i].level = d->levels[i];
+
+            if (inputs[i].length != inputs[0].length && inputs[i].length != 0)
+                same_length = false;
+        }
+
+        int64_t samples = inputs[0].length;
+        int layout = frame_samples[0].layout;
+
+        // propSetData makes a copy, so the buffer only lives during this call.
+        std::vector<uint8_t> buffer(samples * input_channels * sample_size);
+
+        // Planar audio is mixed one channel at a time, as if it were mono.
+        int planes = layout == DambLayoutPlanar ? input_channels : 1;
+        int plane_channels = layout == DambLayoutPlanar ? 1 : input_channels;
+
+        int64_t start = startStatTimer(d->stats);
+        int64_t mix_start = startTrace();
+
+        for (int p = 0; p < planes; p++) {
+            for (size_t i = 0; i < inputs.size(); i++)
+                inputs[i].samples = frame_samples[i].data[p];
+
+            uint8_t *dst = buffer.data() + p * samples * plane_channels * sample_size;
+
+            if (same_length) {
+                // Empty inputs are silence.
+                std::vector<const void *> srcs;
+                std::vector<double> levels;
+                for (size_t i = 0; i < inputs.size(); i++) {
+                    if (inputs[i].length) {
+                        srcs.push_back(inputs[i].samples);
+                        levels.push_back(inputs[i].level);
+                    }
+                }
+
+                getMixFunction(sample_type)(dst, srcs.data(), levels.data(), (int)srcs.size(), samples * plane_channels);
+            } else if (sample_type == SF_FORMAT_PCM_16) {
+                mixInterpolated<int16_t>((int16_t *)dst, samples, plane_channels, inputs);
+            } else if (sample_type == SF_FORMAT_PCM_32) {
+                mixInterpolated<int32_t>((int32_t *)dst, samples, plane_channels, inputs);
+            } else if (sample_type == SF_FORMAT_FLOAT) {
+                mixInterpolated<float>((float *)dst, samples, plane_channels, inputs);
+            } else {
+                mixInterpolated<double>((double *)dst, samples, plane_channels, inputs);
+            }
+        }
+
+        stopStatTimer(d->stats, DambStatMixTime, start);
+        traceSpan("Mix", "mix", n, mix_start);
+
+        VSFrameRef *dst = vsapi->copyFrame(frames[0].get(), core);
 
         VSMap *props = vsapi->getFramePropsRW(dst);
-        vsapi->propSetData(props, damb_samples, (char *)d->buffer.data(), d->buffer.size(), paReplace);
+        int64_t copy_start = startTrace();
+        setFrameSamples(props, layout, buffer.data(), input_channels, samples, sample_size, vsapi);
+        traceSpan("Mix", "copy to props", n, copy_start);
         vsapi->propSetInt(props, damb_channels, input_channels, paReplace);
         vsapi->propSetInt(props, damb_samplerate, input_samplerate, paReplace);
         vsapi->propSetInt(props, damb_format, input_format, paReplace);
 
+        if (d->stats) {
+            addStat(d->stats, DambStatFrames, 1);
+            addStat(d->stats, DambStatSamplesServed, samples);
+            setStatsProps(d->stats, props, vsapi);
+        }
+
+        traceSpan("Mix", "frame", n, trace_start);
+
         return dst;
     }
 
@@ -163,7 +312,14 @@ static const VSFrameRef *VS_CC dambMixGetFrame(int n, int activationReason, void
 static void VS_CC dambMixFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     DambMixData *d = (DambMixData *)instanceData;
 
+    if (d->stats) {
+        unregisterStats(d->stats);
+        delete d->stats;
+    }
+
     delete d;
+
+    flushTrace();
 }
 
 
@@ -172,43 +328,78 @@ static void VS_CC dambMixCreate(const VSMap *in, VSMap *out, void *userData, VSC
     DambMixData *data;
     int err;
 
-    d.clipa = { vsapi->propGetNode(in, "clipa", 0, NULL), vsapi };
-    d.clipb = { vsapi->propGetNode(in, "clipb", 0, NULL), vsapi };
+    // clipa and clipb come before the clips in the array.
+    const char *single_clips[2] = { "clipa", "clipb" };
+    const char *single_levels[2] = { "levela", "levelb" };
 
-    auto levela = vsapi->propGetFloat(in, "levela", 0, &err);
+    for (int i = 0; i < 2; i++) {
+        VSNodeRef *clip = vsapi->propGetNode(in, single_clips[i], 0, &err);
+        if (err)
+            continue;
 
-    if (!err)
-        d.clipa_level = levela;
+        d.clips.push_back({ clip, vsapi });
 
-    auto levelb = vsapi->propGetFloat(in, "levelb", 0, &err);
+        auto level = vsapi->propGetFloat(in, single_levels[i], 0, &err);
+        d.levels.push_back(err ? 1.0 : level);
+    }
 
-    if (!err)
-        d.clipb_level = levelb;
+    size_t first_in_array = d.clips.size();
 
-    d.vi = vsapi->getVideoInfo(d.clipa.get());
+    int num_clips = vsapi->propNumElements(in, "clips");
+    for (int i = 0; i < num_clips; i++) {
+        d.clips.push_back({ vsapi->propGetNode(in, "clips", i, NULL), vsapi });
+        d.levels.push_back(1.0);
+    }
+
+    int num_levels = vsapi->propNumElements(in, "levels");
+    if (num_levels > num_clips) {
+        vsapi->setError(out, "Mix: levels can't have more elements than clips.");
+        return;
+    }
+
+    for (int i = 0; i < num_levels; i++)
+        d.levels[first_in_array + i] = vsapi->propGetFloat(in, "levels", i, NULL);
+
+    if (d.clips.empty()) {
+        vsapi->setError(out, "Mix: At least one clip is required.");
+        return;
+    }
+
+    d.vi = vsapi->getVideoInfo(d.clips[0].get());
 
     if (!d.vi->numFrames) {
-        vsapi->setError(out, "Read: Can't accept clips with unknown length.");
+        vsapi->setError(out, "Mix: Can't accept clips with unknown length.");
         return;
     }
 
     if (!d.vi->fpsNum || !d.vi->fpsDen) {
-        vsapi->setError(out, "Read: Can't accept clips with variable frame rate.");
+        vsapi->setError(out, "Mix: Can't accept clips with variable frame rate.");
         return;
     }
 
+    if (vsapi->propGetInt(in, "stats", 0, &err))
+        d.stats = createStats((1u << DambStatFrames) |
+                              (1u << DambStatSamplesServed) |
+                              (1u << DambStatMixTime));
+
     data = new DambMixData();
     *data = std::move(d);
 
-	vsapi->createFilter(in, out, "Mix", dambMixInit, dambMixGetFrame, dambMixFree, fmSerial, 0, data, core);
+    vsapi->createFilter(in, out, "Mix", dambMixInit, dambMixGetFrame, dambMixFree, fmParallel, 0, data, core);
+
+    if (data->stats)
+        registerStats(data->stats, out, vsapi);
 }
 
 
 void mixRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
     registerFunc("Mix",
-            "clipa:clip;"
-            "clipb:clip;"
+            "clipa:clip:opt;"
+            "clipb:clip:opt;"
             "levela:float:opt;"
             "levelb:float:opt;"
+            "clips:clip[]:opt;"
+            "levels:float[]:opt;"
+            "stats:int:opt;"
             , dambMixCreate, 0, plugin);
 }
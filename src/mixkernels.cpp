@@ -0,0 +1,433 @@
+#include <cstddef>
+#include <cstdint>
+
+#include <cstdio>
+#include <sndfile.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DAMB_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define DAMB_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "mixkernels.h"
+
+
+// Fused multiply-add would make the results depend on the CPU.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+
+template<class T>
+static void mixScalar(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t start, size_t count) {
+    typedef typename DambMixAccumulator<T>::type W;
+
+    T *out = (T *)dst;
+
+    for (size_t i = start; i < count; i++) {
+        W acc = 0;
+        for (int k = 0; k < num_srcs; k++)
+            acc += static_cast<W>(((const T *)srcs[k])[i]) * static_cast<W>(levels[k]);
+        out[i] = saturateSample<T, W>(acc);
+    }
+}
+
+
+template<class T>
+static void mixC(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    mixScalar<T>(dst, srcs, levels, num_srcs, 0, count);
+}
+
+
+#ifdef DAMB_X86
+
+// The vector versions do the same operations in the same order as mixScalar,
+// and convert with the default rounding mode, so the results are identical.
+
+__attribute__((target("sse2")))
+static void mixS16SSE2(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    const __m128 low = _mm_set1_ps(-32768.0f);
+    const __m128 high = _mm_set1_ps(32767.0f);
+    int16_t *out = (int16_t *)dst;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        for (int k = 0; k < num_srcs; k++) {
+            __m128i x = _mm_loadu_si128((const __m128i *)((const int16_t *)srcs[k] + i));
+            __m128 level = _mm_set1_ps((float)levels[k]);
+            __m128 x0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+            __m128 x1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(x0, level));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(x1, level));
+        }
+        acc0 = _mm_min_ps(_mm_max_ps(acc0, low), high);
+        acc1 = _mm_min_ps(_mm_max_ps(acc1, low), high);
+        __m128i result = _mm_packs_epi32(_mm_cvtps_epi32(acc0), _mm_cvtps_epi32(acc1));
+        _mm_storeu_si128((__m128i *)(out + i), result);
+    }
+
+    mixScalar<int16_t>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("sse2")))
+static void mixS32SSE2(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    const __m128d low = _mm_set1_pd(-2147483648.0);
+    const __m128d high = _mm_set1_pd(2147483647.0);
+    int32_t *out = (int32_t *)dst;
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128d acc0 = _mm_setzero_pd();
+        __m128d acc1 = _mm_setzero_pd();
+        for (int k = 0; k < num_srcs; k++) {
+            __m128i x = _mm_loadu_si128((const __m128i *)((const int32_t *)srcs[k] + i));
+            __m128d level = _mm_set1_pd(levels[k]);
+            acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_cvtepi32_pd(x), level));
+            acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(x, 0xEE)), level));
+        }
+        acc0 = _mm_min_pd(_mm_max_pd(acc0, low), high);
+        acc1 = _mm_min_pd(_mm_max_pd(acc1, low), high);
+        __m128i result = _mm_unpacklo_epi64(_mm_cvtpd_epi32(acc0), _mm_cvtpd_epi32(acc1));
+        _mm_storeu_si128((__m128i *)(out + i), result);
+    }
+
+    mixScalar<int32_t>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("sse2")))
+static void mixFloatSSE2(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    float *out = (float *)dst;
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128 acc = _mm_setzero_ps();
+        for (int k = 0; k < num_srcs; k++)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps((const float *)srcs[k] + i), _mm_set1_ps((float)levels[k])));
+        _mm_storeu_ps(out + i, acc);
+    }
+
+    mixScalar<float>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("sse2")))
+static void mixDoubleSSE2(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    double *out = (double *)dst;
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d acc = _mm_setzero_pd();
+        for (int k = 0; k < num_srcs; k++)
+            acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd((const double *)srcs[k] + i), _mm_set1_pd(levels[k])));
+        _mm_storeu_pd(out + i, acc);
+    }
+
+    mixScalar<double>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("avx2")))
+static void mixS16AVX2(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    const __m256 low = _mm256_set1_ps(-32768.0f);
+    const __m256 high = _mm256_set1_ps(32767.0f);
+    int16_t *out = (int16_t *)dst;
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        for (int k = 0; k < num_srcs; k++) {
+            const int16_t *src = (const int16_t *)srcs[k] + i;
+            __m256 level = _mm256_set1_ps((float)levels[k]);
+            __m256 x0 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)src)));
+            __m256 x1 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + 8))));
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(x0, level));
+            acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(x1, level));
+        }
+        __m256i r0 = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(acc0, low), high));
+        __m256i r1 = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(acc1, low), high));
+        // packs works within 128 bit lanes, so the middle quarters need swapping.
+        __m256i result = _mm256_permute4x64_epi64(_mm256_packs_epi32(r0, r1), 0xD8);
+        _mm256_storeu_si256((__m256i *)(out + i), result);
+    }
+
+    mixScalar<int16_t>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("avx2")))
+static void mixS32AVX2(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    const __m256d low = _mm256_set1_pd(-2147483648.0);
+    const __m256d high = _mm256_set1_pd(2147483647.0);
+    int32_t *out = (int32_t *)dst;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256d acc0 = _mm256_setzero_pd();
+        __m256d acc1 = _mm256_setzero_pd();
+        for (int k = 0; k < num_srcs; k++) {
+            const int32_t *src = (const int32_t *)srcs[k] + i;
+            __m256d level = _mm256_set1_pd(levels[k]);
+            acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)src)), level));
+            acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(src + 4))), level));
+        }
+        __m128i r0 = _mm256_cvtpd_epi32(_mm256_min_pd(_mm256_max_pd(acc0, low), high));
+        __m128i r1 = _mm256_cvtpd_epi32(_mm256_min_pd(_mm256_max_pd(acc1, low), high));
+        _mm_storeu_si128((__m128i *)(out + i), r0);
+        _mm_storeu_si128((__m128i *)(out + i + 4), r1);
+    }
+
+    mixScalar<int32_t>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("avx2")))
+static void mixFloatAVX2(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    float *out = (float *)dst;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 acc = _mm256_setzero_ps();
+        for (int k = 0; k < num_srcs; k++)
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps((const float *)srcs[k] + i), _mm256_set1_ps((float)levels[k])));
+        _mm256_storeu_ps(out + i, acc);
+    }
+
+    mixScalar<float>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("avx2")))
+static void mixDoubleAVX2(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    double *out = (double *)dst;
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256d acc = _mm256_setzero_pd();
+        for (int k = 0; k < num_srcs; k++)
+            acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_loadu_pd((const double *)srcs[k] + i), _mm256_set1_pd(levels[k])));
+        _mm256_storeu_pd(out + i, acc);
+    }
+
+    mixScalar<double>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("avx512f")))
+static void mixS16AVX512(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    const __m512 low = _mm512_set1_ps(-32768.0f);
+    const __m512 high = _mm512_set1_ps(32767.0f);
+    int16_t *out = (int16_t *)dst;
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m512 acc = _mm512_setzero_ps();
+        for (int k = 0; k < num_srcs; k++) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)((const int16_t *)srcs[k] + i));
+            acc = _mm512_add_ps(acc, _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(x)), _mm512_set1_ps((float)levels[k])));
+        }
+        __m512i result = _mm512_cvtps_epi32(_mm512_min_ps(_mm512_max_ps(acc, low), high));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm512_cvtsepi32_epi16(result));
+    }
+
+    mixScalar<int16_t>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("avx512f")))
+static void mixS32AVX512(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    const __m512d low = _mm512_set1_pd(-2147483648.0);
+    const __m512d high = _mm512_set1_pd(2147483647.0);
+    int32_t *out = (int32_t *)dst;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m512d acc = _mm512_setzero_pd();
+        for (int k = 0; k < num_srcs; k++) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)((const int32_t *)srcs[k] + i));
+            acc = _mm512_add_pd(acc, _mm512_mul_pd(_mm512_cvtepi32_pd(x), _mm512_set1_pd(levels[k])));
+        }
+        __m256i result = _mm512_cvtpd_epi32(_mm512_min_pd(_mm512_max_pd(acc, low), high));
+        _mm256_storeu_si256((__m256i *)(out + i), result);
+    }
+
+    mixScalar<int32_t>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("avx512f")))
+static void mixFloatAVX512(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    float *out = (float *)dst;
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m512 acc = _mm512_setzero_ps();
+        for (int k = 0; k < num_srcs; k++)
+            acc = _mm512_add_ps(acc, _mm512_mul_ps(_mm512_loadu_ps((const float *)srcs[k] + i), _mm512_set1_ps((float)levels[k])));
+        _mm512_storeu_ps(out + i, acc);
+    }
+
+    mixScalar<float>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+__attribute__((target("avx512f")))
+static void mixDoubleAVX512(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    double *out = (double *)dst;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m512d acc = _mm512_setzero_pd();
+        for (int k = 0; k < num_srcs; k++)
+            acc = _mm512_add_pd(acc, _mm512_mul_pd(_mm512_loadu_pd((const double *)srcs[k] + i), _mm512_set1_pd(levels[k])));
+        _mm512_storeu_pd(out + i, acc);
+    }
+
+    mixScalar<double>(dst, srcs, levels, num_srcs, i, count);
+}
+
+#endif // DAMB_X86
+
+
+#ifdef DAMB_NEON
+
+static void mixS16NEON(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    const float32x4_t low = vdupq_n_f32(-32768.0f);
+    const float32x4_t high = vdupq_n_f32(32767.0f);
+    int16_t *out = (int16_t *)dst;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        float32x4_t acc0 = vdupq_n_f32(0.0f);
+        float32x4_t acc1 = vdupq_n_f32(0.0f);
+        for (int k = 0; k < num_srcs; k++) {
+            int16x8_t x = vld1q_s16((const int16_t *)srcs[k] + i);
+            float32x4_t level = vdupq_n_f32((float)levels[k]);
+            acc0 = vaddq_f32(acc0, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), level));
+            acc1 = vaddq_f32(acc1, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), level));
+        }
+        int32x4_t r0 = vcvtnq_s32_f32(vminq_f32(vmaxq_f32(acc0, low), high));
+        int32x4_t r1 = vcvtnq_s32_f32(vminq_f32(vmaxq_f32(acc1, low), high));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(r0), vqmovn_s32(r1)));
+    }
+
+    mixScalar<int16_t>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+static void mixS32NEON(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    const float64x2_t low = vdupq_n_f64(-2147483648.0);
+    const float64x2_t high = vdupq_n_f64(2147483647.0);
+    int32_t *out = (int32_t *)dst;
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        float64x2_t acc0 = vdupq_n_f64(0.0);
+        float64x2_t acc1 = vdupq_n_f64(0.0);
+        for (int k = 0; k < num_srcs; k++) {
+            int32x4_t x = vld1q_s32((const int32_t *)srcs[k] + i);
+            float64x2_t level = vdupq_n_f64(levels[k]);
+            acc0 = vaddq_f64(acc0, vmulq_f64(vcvtq_f64_s64(vmovl_s32(vget_low_s32(x))), level));
+            acc1 = vaddq_f64(acc1, vmulq_f64(vcvtq_f64_s64(vmovl_s32(vget_high_s32(x))), level));
+        }
+        int64x2_t r0 = vcvtnq_s64_f64(vminq_f64(vmaxq_f64(acc0, low), high));
+        int64x2_t r1 = vcvtnq_s64_f64(vminq_f64(vmaxq_f64(acc1, low), high));
+        vst1q_s32(out + i, vcombine_s32(vmovn_s64(r0), vmovn_s64(r1)));
+    }
+
+    mixScalar<int32_t>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+static void mixFloatNEON(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    float *out = (float *)dst;
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t acc = vdupq_n_f32(0.0f);
+        for (int k = 0; k < num_srcs; k++)
+            acc = vaddq_f32(acc, vmulq_f32(vld1q_f32((const float *)srcs[k] + i), vdupq_n_f32((float)levels[k])));
+        vst1q_f32(out + i, acc);
+    }
+
+    mixScalar<float>(dst, srcs, levels, num_srcs, i, count);
+}
+
+
+static void mixDoubleNEON(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count) {
+    double *out = (double *)dst;
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        float64x2_t acc = vdupq_n_f64(0.0);
+        for (int k = 0; k < num_srcs; k++)
+            acc = vaddq_f64(acc, vmulq_f64(vld1q_f64((const double *)srcs[k] + i), vdupq_n_f64(levels[k])));
+        vst1q_f64(out + i, acc);
+    }
+
+    mixScalar<double>(dst, srcs, levels, num_srcs, i, count);
+}
+
+#endif // DAMB_NEON
+
+
+typedef struct {
+    const char *name;
+    DambMixFunction s16;
+    DambMixFunction s32;
+    DambMixFunction flt;
+    DambMixFunction dbl;
+} DambMixFunctions;
+
+
+static DambMixFunctions pickMixFunctions() {
+#ifdef DAMB_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+        return { "AVX-512", mixS16AVX512, mixS32AVX512, mixFloatAVX512, mixDoubleAVX512 };
+
+    if (__builtin_cpu_supports("avx2"))
+        return { "AVX2", mixS16AVX2, mixS32AVX2, mixFloatAVX2, mixDoubleAVX2 };
+
+    if (__builtin_cpu_supports("sse2"))
+        return { "SSE2", mixS16SSE2, mixS32SSE2, mixFloatSSE2, mixDoubleSSE2 };
+#elif defined(DAMB_NEON)
+    return { "NEON", mixS16NEON, mixS32NEON, mixFloatNEON, mixDoubleNEON };
+#endif
+
+    return { "C", mixC<int16_t>, mixC<int32_t>, mixC<float>, mixC<double> };
+}
+
+
+static const DambMixFunctions &mixFunctions() {
+    static const DambMixFunctions functions = pickMixFunctions();
+    return functions;
+}
+
+
+DambMixFunction getMixFunction(int sample_type) {
+    const DambMixFunctions &functions = mixFunctions();
+
+    if (sample_type == SF_FORMAT_PCM_16)
+        return functions.s16;
+    if (sample_type == SF_FORMAT_PCM_32)
+        return functions.s32;
+    if (sample_type == SF_FORMAT_FLOAT)
+        return functions.flt;
+    return functions.dbl;
+}
+
+
+const char *getMixInstructionSet() {
+    return mixFunctions().name;
+}
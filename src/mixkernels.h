@@ -0,0 +1,60 @@
+#ifndef DAMB_MIXKERNELS_H
+#define DAMB_MIXKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+
+#include <limits>
+
+
+// Mixes inputs that have the same number of samples:
+//
+//   dst[i] = srcs[0][i] * levels[0] + srcs[1][i] * levels[1] + ...
+//
+// count is the number of values, so channels don't matter. The sums are
+// done in float for s16 and float, and in double for s32 and double.
+// Integer results are rounded to nearest and saturated. The pointers only
+// need to be aligned to the size of a sample.
+typedef void (*DambMixFunction)(void *dst, const void *const *srcs, const double *levels, int num_srcs, size_t count);
+
+
+// sample_type is one of the types returned by getSampleType. The best
+// version the CPU supports is picked the first time this is called.
+DambMixFunction getMixFunction(int sample_type);
+
+// Name of the instruction set used by the functions getMixFunction returns.
+const char *getMixInstructionSet();
+
+
+// The type the sums for samples of type T are done in.
+template<class T>
+struct DambMixAccumulator {
+    typedef double type;
+};
+
+template<>
+struct DambMixAccumulator<int16_t> {
+    typedef float type;
+};
+
+template<>
+struct DambMixAccumulator<float> {
+    typedef float type;
+};
+
+
+template<class T, class W>
+static inline T saturateSample(W value) {
+    if (!std::numeric_limits<T>::is_integer)
+        return static_cast<T>(value);
+
+    const W low = static_cast<W>(std::numeric_limits<T>::min());
+    const W high = static_cast<W>(std::numeric_limits<T>::max());
+
+    value = value < low ? low : (value > high ? high : value);
+
+    return static_cast<T>(std::nearbyint(value));
+}
+
+#endif
@@ -0,0 +1,246 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <sndfile.h>
+
+#include "shared.h"
+#include "riff.h"
+#include "pcmfile.h"
+
+
+struct DambPcmFile {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    int fd;
+#endif
+    int format;
+    int channels;
+    int samplerate;
+    int sample_type;
+    int frame_bytes;
+    int64_t header_size;
+    // One past the last sample written so far.
+    std::atomic<int64_t> end;
+};
+
+
+static uint32_t defaultChannelMask(int channels) {
+    switch (channels) {
+    case 1: return 0x4;
+    case 2: return 0x3;
+    case 4: return 0x33;
+    case 6: return 0x3F;
+    case 8: return 0x63F;
+    default: return 0;
+    }
+}
+
+
+static std::vector<uint8_t> makeHeader(const DambPcmFile *f, uint64_t data_bytes) {
+    int sample_size = getSampleSize(f->sample_type);
+    bool is_float = f->sample_type == SF_FORMAT_FLOAT || f->sample_type == SF_FORMAT_DOUBLE;
+    int tag = is_float ? 3 : 1;
+
+    std::vector<uint8_t> fmt(f->format == SF_FORMAT_WAVEX ? 40 : 16);
+    writeLE16(&fmt[0], f->format == SF_FORMAT_WAVEX ? 0xFFFE : tag);
+    writeLE16(&fmt[2], f->channels);
+    writeLE32(&fmt[4], f->samplerate);
+    writeLE32(&fmt[8], f->samplerate * f->frame_bytes);
+    writeLE16(&fmt[12], f->frame_bytes);
+    writeLE16(&fmt[14], sample_size * 8);
+
+    if (f->format == SF_FORMAT_WAVEX) {
+        writeLE16(&fmt[16], 22);
+        writeLE16(&fmt[18], sample_size * 8);
+        writeLE32(&fmt[20], defaultChannelMask(f->channels));
+        writeLE16(&fmt[24], tag);
+        memcpy(&fmt[26], wavex_subformat_tail, sizeof(wavex_subformat_tail));
+    }
+
+    std::vector<uint8_t> header;
+
+    if (f->format == SF_FORMAT_W64) {
+        // Sizes include the 24 byte chunk headers. fmt is 16 or 40 bytes,
+        // so the data chunk is already aligned to 8 bytes.
+        header.resize(40 + 24 + fmt.size() + 24);
+        uint8_t *p = header.data();
+
+        memcpy(p, w64_riff, 16);
+        writeLE64(p + 16, header.size() + data_bytes);
+        memcpy(p + 24, w64_wave, 16);
+        p += 40;
+
+        memcpy(p, w64_fmt, 16);
+        writeLE64(p + 16, 24 + fmt.size());
+        memcpy(p + 24, fmt.data(), fmt.size());
+        p += 24 + fmt.size();
+
+        memcpy(p, w64_data, 16);
+        writeLE64(p + 16, 24 + data_bytes);
+    } else {
+        header.resize(12 + 8 + fmt.size() + 8);
+        uint8_t *p = header.data();
+
+        memcpy(p, "RIFF", 4);
+        writeLE32(p + 4, (uint32_t)(header.size() - 8 + data_bytes));
+        memcpy(p + 8, "WAVE", 4);
+        p += 12;
+
+        memcpy(p, "fmt ", 4);
+        writeLE32(p + 4, (uint32_t)fmt.size());
+        memcpy(p + 8, fmt.data(), fmt.size());
+        p += 8 + fmt.size();
+
+        memcpy(p, "data", 4);
+        writeLE32(p + 4, (uint32_t)data_bytes);
+    }
+
+    return header;
+}
+
+
+static bool writeAt(DambPcmFile *f, int64_t offset, const void *data, int64_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    while (size > 0) {
+#ifdef _WIN32
+        DWORD chunk = (DWORD)std::min<int64_t>(size, 1 << 30);
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+        DWORD written = 0;
+        if (!WriteFile(f->handle, bytes, chunk, &written, &overlapped) || written == 0)
+            return false;
+#else
+        ssize_t written = pwrite(f->fd, bytes, (size_t)size, (off_t)offset);
+        if (written <= 0)
+            return false;
+#endif
+
+        bytes += written;
+        offset += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+
+static bool resizeFile(DambPcmFile *f, int64_t size, bool preallocate) {
+#ifdef _WIN32
+    LARGE_INTEGER position;
+    position.QuadPart = size;
+    return SetFilePointerEx(f->handle, position, NULL, FILE_BEGIN) && SetEndOfFile(f->handle);
+#else
+#ifdef __linux__
+    // Reserves the blocks, so the file isn't fragmented by the writes
+    // arriving in random order.
+    if (preallocate && !posix_fallocate(f->fd, 0, (off_t)size))
+        return true;
+#endif
+    return ftruncate(f->fd, (off_t)size) == 0;
+#endif
+}
+
+
+DambPcmFile *createPcmFile(const std::string &filename, int format, int channels, int samplerate, int sample_type, int64_t expected_samples, std::string *error) {
+    if (!isLittleEndian()) {
+        *error = "only supported on little endian machines";
+        return NULL;
+    }
+
+    DambPcmFile *f = new DambPcmFile();
+    f->format = format;
+    f->channels = channels;
+    f->samplerate = samplerate;
+    f->sample_type = sample_type;
+    f->frame_bytes = channels * getSampleSize(sample_type);
+    f->end.store(0);
+
+    int64_t data_bytes = expected_samples * f->frame_bytes;
+    std::vector<uint8_t> header = makeHeader(f, data_bytes);
+    f->header_size = header.size();
+
+    if (format != SF_FORMAT_W64 && f->header_size - 8 + data_bytes > 0xFFFFFFFF) {
+        *error = "the audio is too long for WAV, use W64 instead";
+        delete f;
+        return NULL;
+    }
+
+#ifdef _WIN32
+    f->handle = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    bool opened = f->handle != INVALID_HANDLE_VALUE;
+#else
+    f->fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool opened = f->fd >= 0;
+#endif
+
+    if (!opened) {
+        *error = "couldn't create the file";
+        delete f;
+        return NULL;
+    }
+
+    if (!resizeFile(f, f->header_size + data_bytes, true) || !writeAt(f, 0, header.data(), header.size())) {
+        *error = "couldn't allocate the file";
+        std::string ignored;
+        closePcmFile(f, &ignored);
+        return NULL;
+    }
+
+    return f;
+}
+
+
+bool writePcmSamples(DambPcmFile *f, int64_t sample_start, const void *samples, int64_t sample_count) {
+    if (!writeAt(f, f->header_size + sample_start * f->frame_bytes, samples, sample_count * f->frame_bytes))
+        return false;
+
+    int64_t sample_end = sample_start + sample_count;
+    int64_t end = f->end.load();
+    while (end < sample_end && !f->end.compare_exchange_weak(end, sample_end))
+        ;
+
+    return true;
+}
+
+
+bool closePcmFile(DambPcmFile *f, std::string *error) {
+    int64_t data_bytes = f->end.load() * f->frame_bytes;
+    std::vector<uint8_t> header = makeHeader(f, data_bytes);
+
+    bool ok = writeAt(f, 0, header.data(), header.size()) &&
+              resizeFile(f, f->header_size + data_bytes, false);
+    if (!ok)
+        *error = "couldn't update the header";
+
+#ifdef _WIN32
+    if (!CloseHandle(f->handle) && ok) {
+#else
+    if (close(f->fd) && ok) {
+#endif
+        *error = "couldn't close the file";
+        ok = false;
+    }
+
+    delete f;
+    return ok;
+}
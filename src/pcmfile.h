@@ -0,0 +1,27 @@
+#ifndef DAMB_PCMFILE_H
+#define DAMB_PCMFILE_H
+
+#include <cstdint>
+
+#include <string>
+
+
+// An uncompressed WAV, WAVEX, or W64 file written without libsndfile. The
+// header is written when the file is created, so samples can be written at
+// any position, from any thread, in any order.
+typedef struct DambPcmFile DambPcmFile;
+
+
+// format is one of SF_FORMAT_WAV, SF_FORMAT_WAVEX, SF_FORMAT_W64, and
+// sample_type one of the types returned by getSampleType. The file is
+// preallocated to hold expected_samples.
+DambPcmFile *createPcmFile(const std::string &filename, int format, int channels, int samplerate, int sample_type, int64_t expected_samples, std::string *error);
+
+// Thread safe.
+bool writePcmSamples(DambPcmFile *file, int64_t sample_start, const void *samples, int64_t sample_count);
+
+// Writes the final sizes into the header and closes the file. The file ends
+// after the last sample written.
+bool closePcmFile(DambPcmFile *file, std::string *error);
+
+#endif
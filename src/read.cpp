@@ -1,8 +1,17 @@
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
+#include <cmath>
 
 #include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 #include <VapourSynth.h>
 #include <VSHelper.h>
@@ -11,22 +20,134 @@
 #include <sndfile.h>
 
 #include "shared.h"
+#include "blockcache.h"
+#include "index.h"
+#include "layout.h"
+#include "mapped.h"
+#include "stats.h"
+#include "trace.h"
 
 
+// One of the audio files. They are played one after the other, without
+// gaps, so each one starts where the previous one ends.
 typedef struct {
+    std::string filename;
+    // Position of the file's first sample in the whole audio.
+    sf_count_t start;
+    sf_count_t length;
+    // view is NULL if the file isn't mapped.
+    DambMappedFile mapped;
+    // Empty if the file doesn't have an index.
+    DambSeekIndex index;
+    // True if the file is FLAC and no saved index was found. The index is
+    // then built the first time the file needs to seek.
+    bool index_pending;
+    // True if the decoded samples go through the block cache.
+    bool cached;
+    DambCacheFile cache_file;
+} DambReadSegment;
+
+
+typedef struct {
+    // NULL if no file is open.
+    SNDFILE *sndfile;
+    // Only used when the handle was opened at a seek point from the index.
+    DambSeekStream *stream;
+    // Index of the open file in segments.
+    int segment;
+    // Position in the whole audio of the next sample sf_readf_* will
+    // return, or -1 if unknown.
+    sf_count_t position;
+} DambReadHandle;
+
+
+// Handles are opened on demand, up to max_handles, and reused. Each one has
+// its own decoder state, so several frames can be decoded at the same time.
+// A handle only has one file open at a time, and switches to another file
+// when it needs to, so max_handles also limits the number of open files.
+// Idle handles are kept in the order they were released.
+typedef struct {
+    std::mutex lock;
+    std::condition_variable released;
+    std::vector<DambReadHandle> idle;
+    int open_handles;
+    int max_handles;
+} DambReadPool;
+
+
+// When frames are requested in order, a background thread decodes ahead of
+// them in large chunks into a ring buffer, using its own handle. The buffer
+// holds the samples from start to end. The thread only seeks when a request
+// lands outside of it.
+typedef struct {
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable decoded;
+
+    DambReadHandle handle;
+    std::vector<uint8_t> ring;
+    sf_count_t capacity;
+    sf_count_t start;
+    sf_count_t end;
+    // End of the previous request, used to detect linear access.
+    sf_count_t last_end;
+    // Incremented when the buffer is moved, so that samples decoded for
+    // the old position are thrown away.
+    unsigned generation;
+    bool active;
+    bool eof;
+    bool failed;
+    bool stop;
+} DambReadAhead;
+
+
+// The whole file decoded once by a background thread, in the same sample
+// type as the frames. Requests wait until their samples are decoded.
+typedef struct {
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable progress;
+
+    uint8_t *samples;
+    sf_count_t length;
+    sf_count_t decoded;
+    bool done;
+    bool stop;
+} DambReadPreload;
+
+
+typedef struct {
+    // Source has no clip. node is NULL, vi points to source_vi, and every
+    // frame is a copy of blank.
     VSNodeRef *node;
     const VSVideoInfo *vi;
+    VSVideoInfo source_vi;
+    VSFrameRef *blank;
 
-    std::string filename;
+    std::vector<DambReadSegment> segments;
 
-    SNDFILE *sndfile;
+    std::unique_ptr<DambReadPool> pool;
+    std::unique_ptr<DambReadAhead> readahead;
+    std::unique_ptr<DambReadPreload> preload;
+    // Protects the indexes while they are built.
+    std::unique_ptr<std::mutex> index_lock;
+    std::string index_dir;
+    bool save_index;
+    // True if all the files are mapped.
+    bool mapped;
+    // Taken from the first file, except frames, which is the length of
+    // all the files together.
     SF_INFO sfinfo;
-    uint8_t *buffer;
     int sample_size;
     int sample_type;
     double samples_per_frame;
     double delay_seconds;
     sf_count_t delay_samples;
+    // DambLayoutInterleaved or DambLayoutPlanar.
+    int layout;
+    // NULL unless stats were requested.
+    DambStats *stats;
 } DambReadData;
 
 
@@ -36,69 +157,712 @@ static void VS_CC dambReadInit(VSMap *in, VSMap *out, void **instanceData, VSNod
 }
 
 
-static void read_samples(SNDFILE *sndfile, SF_INFO *sfinfo, sf_count_t sample_start, sf_count_t sample_count, int sample_type, int sample_size, uint8_t *buffer) {
-    sf_count_t seek_ret = sf_seek(sndfile, sample_start, SEEK_SET);
+// Returns the file containing the sample at position, or the last one if
+// position is after the end.
+static int findSegment(const DambReadData *d, sf_count_t position) {
+    auto it = std::upper_bound(d->segments.begin(), d->segments.end(), position,
+                               [] (sf_count_t p, const DambReadSegment &segment) {
+        return p < segment.start;
+    });
+
+    if (it == d->segments.begin())
+        return 0;
+    return (int)(it - d->segments.begin()) - 1;
+}
+
+
+static bool openHandle(DambReadData *d, int segment, DambReadHandle *handle) {
+    SF_INFO sfinfo;
+    sfinfo.format = 0;
+    handle->sndfile = sf_open(d->segments[segment].filename.c_str(), SFM_READ, &sfinfo);
+    handle->stream = NULL;
+    handle->segment = segment;
+    handle->position = d->segments[segment].start;
+
+    if (handle->sndfile == NULL)
+        handle->position = -1;
+
+    return handle->sndfile != NULL;
+}
+
+
+static void closeHandle(DambReadHandle *handle) {
+    if (handle->sndfile)
+        sf_close(handle->sndfile);
+    closeSeekStream(handle->stream);
+
+    handle->sndfile = NULL;
+    handle->stream = NULL;
+    handle->position = -1;
+}
+
+
+static bool acquireHandle(DambReadData *d, sf_count_t sample_start, DambReadHandle *handle) {
+    DambReadPool *pool = d->pool.get();
+
+    std::unique_lock<std::mutex> guard(pool->lock);
+
+    if (pool->idle.empty() && pool->open_handles >= pool->max_handles) {
+        int64_t start = startTrace();
+        while (pool->idle.empty() && pool->open_handles >= pool->max_handles)
+            pool->released.wait(guard);
+        traceSpan("Read", "wait for handle", -1, start);
+    }
+
+    int segment = findSegment(d, sample_start);
+
+    if (!pool->idle.empty()) {
+        // Prefer a handle that is already where we want to read,
+        // so that linear access doesn't seek at all, then the most
+        // recently used one with the right file open. Otherwise the
+        // least recently used handle switches to that file.
+        size_t chosen = 0;
+        for (size_t i = 0; i < pool->idle.size(); i++)
+            if (pool->idle[i].segment == segment && pool->idle[i].sndfile)
+                chosen = i;
+
+        for (size_t i = 0; i < pool->idle.size(); i++) {
+            if (pool->idle[i].position == sample_start) {
+                chosen = i;
+                break;
+            }
+        }
+
+        *handle = pool->idle[chosen];
+        pool->idle.erase(pool->idle.begin() + chosen);
+        return true;
+    }
+
+    pool->open_handles++;
+    guard.unlock();
+
+    if (!openHandle(d, segment, handle)) {
+        guard.lock();
+        pool->open_handles--;
+        pool->released.notify_one();
+        return false;
+    }
+
+    return true;
+}
+
+
+static void releaseHandle(DambReadData *d, const DambReadHandle &handle) {
+    DambReadPool *pool = d->pool.get();
+
+    std::lock_guard<std::mutex> guard(pool->lock);
+    pool->idle.push_back(handle);
+    pool->released.notify_one();
+}
+
+
+static sf_count_t readf(DambReadData *d, SNDFILE *sndfile, uint8_t *buffer, sf_count_t sample_count) {
+    int64_t start = startStatTimer(d->stats);
+    int64_t trace_start = startTrace();
+
+    sf_count_t readf_ret;
+    if (d->sample_type == SF_FORMAT_PCM_16)
+        readf_ret = sf_readf_short(sndfile, (short *)buffer, sample_count);
+    else if (d->sample_type == SF_FORMAT_PCM_32)
+        readf_ret = sf_readf_int(sndfile, (int *)buffer, sample_count);
+    else if (d->sample_type == SF_FORMAT_FLOAT)
+        readf_ret = sf_readf_float(sndfile, (float *)buffer, sample_count);
+    else
+        readf_ret = sf_readf_double(sndfile, (double *)buffer, sample_count);
+
+    traceSpan("Read", "decode", -1, trace_start);
+
+    if (d->stats && readf_ret > 0) {
+        stopStatTimer(d->stats, DambStatReadTime, start);
+        addStat(d->stats, DambStatSamplesDecoded, readf_ret);
+        addStat(d->stats, DambStatBytesRead, readf_ret * d->sfinfo.channels * d->sample_size);
+    }
+
+    return readf_ret;
+}
+
+
+// Reopens the handle at the closest seek point before sample_start, unless
+// it is already between that seek point and sample_start, then decodes up to
+// sample_start. buffer is used as scratch space. The handle must have the
+// right file open, and sample_start is relative to the file's start.
+static bool seekWithIndex(DambReadData *d, DambReadHandle *handle, sf_count_t sample_start, uint8_t *buffer, sf_count_t buffer_samples) {
+    const DambReadSegment &segment = d->segments[handle->segment];
+    const DambSeekPoint *point = findSeekPoint(segment.index, sample_start);
+
+    sf_count_t position = handle->position - segment.start;
+
+    if (handle->position < 0 || position < point->sample || position > sample_start) {
+        int64_t start = startStatTimer(d->stats);
+        int64_t trace_start = startTrace();
+        addStat(d->stats, DambStatSeeks, 1);
+
+        DambSeekStream *stream = NULL;
+        SNDFILE *sndfile = openAtSeekPoint(segment.filename, segment.index, *point, &stream);
+        stopStatTimer(d->stats, DambStatSeekTime, start);
+        traceSpan("Read", "seek", -1, trace_start);
+        if (sndfile == NULL) {
+            handle->position = -1;
+            return false;
+        }
+
+        int current = handle->segment;
+        closeHandle(handle);
+
+        handle->sndfile = sndfile;
+        handle->stream = stream;
+        handle->segment = current;
+        position = point->sample;
+    }
+
+    while (position < sample_start) {
+        sf_count_t count = std::min(sample_start - position, buffer_samples);
+        sf_count_t readf_ret = readf(d, handle->sndfile, buffer, count);
+        if (readf_ret <= 0) {
+            handle->position = -1;
+            return false;
+        }
+
+        position += readf_ret;
+    }
+
+    handle->position = segment.start + position;
+
+    return true;
+}
+
+
+// Builds the file's index if it wasn't built yet. Returns true if the file
+// has an index. The index doesn't change after that, so it can be used
+// without the lock.
+static bool hasSeekIndex(DambReadData *d, int segment) {
+    std::lock_guard<std::mutex> guard(*d->index_lock);
+
+    DambReadSegment &s = d->segments[segment];
+
+    if (s.index_pending) {
+        s.index_pending = false;
+
+        // If the index can't be built, sf_seek is used as before.
+        int64_t trace_start = startTrace();
+        std::string error;
+        if (getSeekIndex(s.filename, d->index_dir, true, d->save_index, &s.index, &error) < 0)
+            s.index.points.clear();
+        traceSpan("Read", "index", -1, trace_start);
+    }
+
+    return !s.index.points.empty();
+}
+
+
+// Decodes from a single file, which the handle is switched to if needed.
+static sf_count_t decodeSegment(DambReadData *d, DambReadHandle *handle, int segment, sf_count_t sample_start, sf_count_t sample_count, uint8_t *buffer) {
+    if (handle->sndfile == NULL || handle->segment != segment) {
+        closeHandle(handle);
+        if (!openHandle(d, segment, handle))
+            return 0;
+    }
+
+    const DambReadSegment &s = d->segments[segment];
+    sf_count_t local_start = sample_start - s.start;
+
+    bool seek_ok = true;
+    if (handle->position != sample_start) {
+        if (hasSeekIndex(d, segment)) {
+            seek_ok = seekWithIndex(d, handle, local_start, buffer, sample_count);
+        } else {
+            int64_t start = startStatTimer(d->stats);
+            int64_t trace_start = startTrace();
+            seek_ok = sf_seek(handle->sndfile, local_start, SEEK_SET) == local_start;
+            stopStatTimer(d->stats, DambStatSeekTime, start);
+            traceSpan("Read", "seek", -1, trace_start);
+            addStat(d->stats, DambStatSeeks, 1);
+        }
+    }
 
     sf_count_t readf_ret = 0;
-    if (seek_ret == sample_start) {
-        if (sample_type == SF_FORMAT_PCM_16)
-            readf_ret = sf_readf_short(sndfile, (short *)buffer, sample_count);
-        else if (sample_type == SF_FORMAT_PCM_32)
-            readf_ret = sf_readf_int(sndfile, (int *)buffer, sample_count);
-        else if (sample_type == SF_FORMAT_FLOAT)
-            readf_ret = sf_readf_float(sndfile, (float *)buffer, sample_count);
+    if (seek_ok) {
+        readf_ret = readf(d, handle->sndfile, buffer, sample_count);
+
+        handle->position = sample_start + readf_ret;
+    } else {
+        handle->position = -1;
+    }
+
+    return readf_ret;
+}
+
+
+// Like decodeSegment, but serves the samples from the block cache. Missing
+// blocks are decoded whole, and only added to the cache if the file had all
+// of their samples.
+static sf_count_t decodeCached(DambReadData *d, DambReadHandle *handle, int segment, sf_count_t sample_start, sf_count_t sample_count, uint8_t *buffer) {
+    const DambReadSegment &s = d->segments[segment];
+    int64_t frame_bytes = d->sfinfo.channels * d->sample_size;
+    sf_count_t copied = 0;
+
+    while (copied < sample_count) {
+        sf_count_t position = sample_start - s.start + copied;
+
+        int64_t block = position / block_cache_samples;
+        sf_count_t block_start = block * block_cache_samples;
+        sf_count_t block_length = std::min(block_cache_samples, s.length - block_start);
+        sf_count_t offset = position - block_start;
+
+        DambCacheBlock samples = findCachedBlock(s.cache_file, block);
+
+        if (samples) {
+            addStat(d->stats, DambStatBlockHits, 1);
+        } else {
+            addStat(d->stats, DambStatBlockMisses, 1);
+
+            std::shared_ptr<std::vector<uint8_t>> decoded = std::make_shared<std::vector<uint8_t>>(block_length * frame_bytes);
+            sf_count_t readf_ret = decodeSegment(d, handle, segment, s.start + block_start, block_length, decoded->data());
+
+            if (readf_ret < block_length) {
+                sf_count_t available = std::max<sf_count_t>(std::min(readf_ret - offset, sample_count - copied), 0);
+                memcpy(buffer + copied * frame_bytes, decoded->data() + offset * frame_bytes, available * frame_bytes);
+                return copied + available;
+            }
+
+            addCachedBlock(s.cache_file, block, decoded);
+            samples = decoded;
+        }
+
+        sf_count_t count = std::min(sample_count - copied, block_length - offset);
+        memcpy(buffer + copied * frame_bytes, samples->data() + offset * frame_bytes, count * frame_bytes);
+        copied += count;
+    }
+
+    return copied;
+}
+
+
+// Decodes the samples from sample_start, going from one file to the next
+// if needed. Returns fewer samples than requested at the end of the audio,
+// or if a file can't be read.
+static sf_count_t decode_samples(DambReadData *d, DambReadHandle *handle, sf_count_t sample_start, sf_count_t sample_count, uint8_t *buffer) {
+    int64_t frame_bytes = d->sfinfo.channels * d->sample_size;
+    sf_count_t decoded = 0;
+
+    while (decoded < sample_count) {
+        sf_count_t position = sample_start + decoded;
+
+        int segment = findSegment(d, position);
+        sf_count_t segment_end = d->segments[segment].start + d->segments[segment].length;
+        if (position >= segment_end)
+            break;
+
+        sf_count_t count = std::min(sample_count - decoded, segment_end - position);
+        sf_count_t readf_ret;
+        if (d->segments[segment].cached)
+            readf_ret = decodeCached(d, handle, segment, position, count, buffer + decoded * frame_bytes);
         else
-            readf_ret = sf_readf_double(sndfile, (double *)buffer, sample_count);
+            readf_ret = decodeSegment(d, handle, segment, position, count, buffer + decoded * frame_bytes);
+
+        decoded += std::max<sf_count_t>(readf_ret, 0);
+        if (readf_ret < count)
+            break;
     }
 
+    return decoded;
+}
+
+
+static void read_samples(DambReadData *d, DambReadHandle *handle, sf_count_t sample_start, sf_count_t sample_count, uint8_t *buffer) {
+    sf_count_t readf_ret = decode_samples(d, handle, sample_start, sample_count, buffer);
+
     if (readf_ret < sample_count) {
-        int64_t silence_start_bytes = readf_ret * sfinfo->channels * sample_size;
-        int64_t silence_count_bytes = (sample_count - readf_ret) * sfinfo->channels * sample_size;
+        int64_t silence_start_bytes = readf_ret * d->sfinfo.channels * d->sample_size;
+        int64_t silence_count_bytes = (sample_count - readf_ret) * d->sfinfo.channels * d->sample_size;
         memset(buffer + silence_start_bytes, 0, silence_count_bytes);
     }
 }
 
 
+// Copies between the ring buffer and a linear buffer, starting at sample
+// position, taking care of the wrap around.
+static void ringCopy(DambReadAhead *ra, int64_t frame_bytes, sf_count_t position, sf_count_t sample_count, uint8_t *linear, bool to_ring) {
+    while (sample_count > 0) {
+        sf_count_t offset = position % ra->capacity;
+        sf_count_t count = std::min(sample_count, ra->capacity - offset);
+
+        uint8_t *ring = ra->ring.data() + offset * frame_bytes;
+        if (to_ring)
+            memcpy(ring, linear, count * frame_bytes);
+        else
+            memcpy(linear, ring, count * frame_bytes);
+
+        linear += count * frame_bytes;
+        position += count;
+        sample_count -= count;
+    }
+}
+
+
+static void readAheadThread(DambReadData *d) {
+    setTraceThreadName("Read readahead");
+
+    DambReadAhead *ra = d->readahead.get();
+    int64_t frame_bytes = d->sfinfo.channels * d->sample_size;
+    sf_count_t chunk_samples = std::max<sf_count_t>(ra->capacity / 4, 1);
+    std::vector<uint8_t> chunk(chunk_samples * frame_bytes);
+
+    std::unique_lock<std::mutex> guard(ra->lock);
+
+    while (!ra->stop) {
+        sf_count_t space = ra->capacity - (ra->end - ra->start);
+
+        if (!ra->active || ra->eof || ra->failed || space < chunk_samples) {
+            ra->wake.wait(guard);
+            continue;
+        }
+
+        sf_count_t position = ra->end;
+        unsigned generation = ra->generation;
+
+        guard.unlock();
+
+        sf_count_t readf_ret = decode_samples(d, &ra->handle, position, chunk_samples, chunk.data());
+
+        guard.lock();
+
+        // Getting fewer samples than asked for before the end of the audio
+        // means a file couldn't be opened or read. The handle can't tell,
+        // because it isn't even opened when the cache has all the blocks.
+        sf_count_t expected = std::min(chunk_samples, std::max<sf_count_t>(d->sfinfo.frames - position, 0));
+        if (readf_ret < expected) {
+            ra->failed = true;
+            ra->decoded.notify_all();
+            continue;
+        }
+
+        if (generation != ra->generation)
+            continue;
+
+        ringCopy(ra, frame_bytes, position, readf_ret, chunk.data(), true);
+        ra->end += readf_ret;
+
+        if (readf_ret < chunk_samples)
+            ra->eof = true;
+
+        ra->decoded.notify_all();
+    }
+}
+
+
+// Returns false if the request should be served by a handle from the pool
+// instead, because it doesn't look like part of a linear read.
+static bool readAheadServe(DambReadData *d, sf_count_t sample_start, sf_count_t sample_count, uint8_t *buffer) {
+    DambReadAhead *ra = d->readahead.get();
+    int64_t frame_bytes = d->sfinfo.channels * d->sample_size;
+    sf_count_t sample_end = sample_start + sample_count;
+
+    std::unique_lock<std::mutex> guard(ra->lock);
+
+    if (ra->failed)
+        return false;
+
+    bool linear = sample_start >= ra->last_end - sample_count &&
+                  sample_start <= ra->last_end + sample_count;
+    ra->last_end = sample_end;
+
+    bool covered = ra->active &&
+                   sample_start >= ra->start &&
+                   sample_start < ra->end + ra->capacity / 2;
+
+    if (!covered) {
+        if (!linear)
+            return false;
+
+        ra->active = true;
+        ra->start = sample_start;
+        ra->end = sample_start;
+        ra->eof = false;
+        ra->generation++;
+        ra->wake.notify_one();
+    }
+
+    while (true) {
+        if (ra->failed || sample_start < ra->start)
+            return false;
+
+        // Let the decoder reuse the space taken by samples that are
+        // well behind this request.
+        sf_count_t keep = sample_start - ra->capacity / 4;
+        if (keep > ra->start) {
+            ra->start = std::min(keep, ra->end);
+            ra->wake.notify_one();
+        }
+
+        if (ra->end >= sample_end || ra->eof)
+            break;
+
+        int64_t start = startTrace();
+        ra->decoded.wait(guard);
+        traceSpan("Read", "wait for readahead", -1, start);
+    }
+
+    sf_count_t available = std::max<sf_count_t>(std::min(ra->end, sample_end) - sample_start, 0);
+    ringCopy(ra, frame_bytes, sample_start, available, buffer, false);
+
+    if (available < sample_count)
+        memset(buffer + available * frame_bytes, 0, (sample_count - available) * frame_bytes);
+
+    return true;
+}
+
+
+static void preloadThread(DambReadData *d) {
+    setTraceThreadName("Read preload");
+
+    DambReadPreload *pl = d->preload.get();
+    int64_t frame_bytes = d->sfinfo.channels * d->sample_size;
+    const sf_count_t chunk_samples = 1 << 16;
+
+    DambReadHandle handle;
+    handle.sndfile = NULL;
+    handle.stream = NULL;
+    handle.segment = 0;
+    handle.position = -1;
+
+    while (true) {
+        sf_count_t position;
+        {
+            std::lock_guard<std::mutex> guard(pl->lock);
+            position = pl->decoded;
+            if (pl->stop || position >= pl->length)
+                break;
+        }
+
+        sf_count_t count = std::min(chunk_samples, pl->length - position);
+        sf_count_t readf_ret = decode_samples(d, &handle, position, count, pl->samples + position * frame_bytes);
+
+        std::lock_guard<std::mutex> guard(pl->lock);
+        pl->decoded += readf_ret;
+        pl->progress.notify_all();
+
+        if (readf_ret < count)
+            break;
+    }
+
+    closeHandle(&handle);
+
+    std::lock_guard<std::mutex> guard(pl->lock);
+    pl->done = true;
+    pl->progress.notify_all();
+}
+
+
+static void preloadServe(DambReadData *d, sf_count_t sample_start, sf_count_t sample_count, uint8_t *buffer) {
+    DambReadPreload *pl = d->preload.get();
+    int64_t frame_bytes = d->sfinfo.channels * d->sample_size;
+    sf_count_t sample_end = std::min(sample_start + sample_count, pl->length);
+
+    sf_count_t decoded;
+    {
+        std::unique_lock<std::mutex> guard(pl->lock);
+        if (pl->decoded < sample_end && !pl->done) {
+            int64_t start = startTrace();
+            while (pl->decoded < sample_end && !pl->done)
+                pl->progress.wait(guard);
+            traceSpan("Read", "wait for preload", -1, start);
+        }
+        decoded = pl->decoded;
+    }
+
+    // Samples below decoded are never written again, so they can be
+    // copied without holding the lock.
+    sf_count_t available = std::max<sf_count_t>(std::min(decoded, sample_end) - sample_start, 0);
+    memcpy(buffer, pl->samples + sample_start * frame_bytes, available * frame_bytes);
+
+    if (available < sample_count)
+        memset(buffer + available * frame_bytes, 0, (sample_count - available) * frame_bytes);
+}
+
+
+// Copies the samples from the mapped files, with silence where the files
+// have fewer samples than expected, and after the end.
+static void copyMapped(DambReadData *d, sf_count_t sample_start, sf_count_t sample_count, uint8_t *buffer) {
+    int64_t frame_bytes = d->sfinfo.channels * d->sample_size;
+    sf_count_t copied = 0;
+
+    while (copied < sample_count) {
+        sf_count_t position = sample_start + copied;
+
+        const DambReadSegment &segment = d->segments[findSegment(d, position)];
+        sf_count_t segment_end = segment.start + segment.length;
+        sf_count_t local = position - segment.start;
+
+        sf_count_t count = sample_count - copied;
+        if (position < segment_end)
+            count = std::min(count, segment_end - position);
+
+        sf_count_t available = position < segment_end ? std::min(count, segment.mapped.length - local) : 0;
+        available = std::max<sf_count_t>(available, 0);
+
+        memcpy(buffer + copied * frame_bytes, segment.mapped.samples + local * frame_bytes, available * frame_bytes);
+        memset(buffer + (copied + available) * frame_bytes, 0, (count - available) * frame_bytes);
+
+        addStat(d->stats, DambStatBytesRead, available * frame_bytes);
+
+        copied += count;
+    }
+}
+
+
+static bool fetchSamples(DambReadData *d, sf_count_t sample_start, sf_count_t sample_count, uint8_t *buffer) {
+    if (d->mapped) {
+        copyMapped(d, sample_start, sample_count, buffer);
+        addStat(d->stats, DambStatCacheHits, 1);
+
+        return true;
+    }
+
+    // Requests served from memory count as cache hits, and the ones
+    // that have to decode with a handle from the pool as misses.
+    if (d->preload) {
+        preloadServe(d, sample_start, sample_count, buffer);
+        addStat(d->stats, DambStatCacheHits, 1);
+        return true;
+    }
+
+    if (d->readahead && readAheadServe(d, sample_start, sample_count, buffer)) {
+        addStat(d->stats, DambStatCacheHits, 1);
+        return true;
+    }
+
+    addStat(d->stats, DambStatCacheMisses, 1);
+
+    DambReadHandle handle;
+    if (!acquireHandle(d, sample_start, &handle))
+        return false;
+
+    read_samples(d, &handle, sample_start, sample_count, buffer);
+
+    releaseHandle(d, handle);
+
+    return true;
+}
+
+
+// Finds the samples of frame n, interleaved like in the files. They are
+// either in a mapped file, or fetched into buffer. Returns NULL if a file
+// couldn't be reopened.
+static const uint8_t *readFrame(DambReadData *d, int n, std::vector<uint8_t> *buffer, sf_count_t *sample_count) {
+    // sf_count_t is int64_t
+    sf_count_t sample_start = (sf_count_t)(d->samples_per_frame * n + 0.5);
+    sf_count_t sample_end = (sf_count_t)(d->samples_per_frame * (n + 1) + 0.5);
+    *sample_count = sample_end - sample_start;
+
+    sf_count_t delayed_start = sample_start - d->delay_samples;
+    sf_count_t delayed_end = sample_end - d->delay_samples;
+
+    int64_t frame_bytes = d->sfinfo.channels * d->sample_size;
+
+    if (d->mapped && delayed_start >= 0) {
+        const DambReadSegment &segment = d->segments[findSegment(d, delayed_start)];
+
+        // The frame is inside one file and there is no silence to add,
+        // so the samples can go straight from the file to the frame.
+        if (delayed_end <= segment.start + std::min(segment.length, segment.mapped.length)) {
+            addStat(d->stats, DambStatBytesRead, *sample_count * frame_bytes);
+            addStat(d->stats, DambStatCacheHits, 1);
+
+            return segment.mapped.samples + (delayed_start - segment.start) * frame_bytes;
+        }
+    }
+
+    // The buffer starts out silent.
+    buffer->assign(*sample_count * frame_bytes, 0);
+
+    if (delayed_end > 0) {
+        sf_count_t read_start = delayed_start < 0 ? 0 : delayed_start;
+        sf_count_t read_count = delayed_end - read_start;
+
+        sf_count_t leading_silence = *sample_count - read_count;
+
+        if (!fetchSamples(d, read_start, read_count, buffer->data() + leading_silence * frame_bytes))
+            return NULL;
+    }
+
+    return buffer->data();
+}
+
+
+// samples are interleaved, like in the file.
+static void setSamples(DambReadData *d, VSMap *props, const uint8_t *samples, sf_count_t sample_count, int n, const VSAPI *vsapi) {
+    int channels = d->sfinfo.channels;
+    int64_t copy_start = startTrace();
+
+    if (d->layout == DambLayoutPlanar) {
+        std::vector<uint8_t> planar(sample_count * channels * d->sample_size);
+
+        std::vector<void *> planes(channels);
+        for (int c = 0; c < channels; c++)
+            planes[c] = planar.data() + c * sample_count * d->sample_size;
+
+        deinterleaveSamples(samples, planes.data(), channels, sample_count, d->sample_size);
+        setFrameSamples(props, DambLayoutPlanar, planar.data(), channels, sample_count, d->sample_size, vsapi);
+    } else {
+        setFrameSamples(props, DambLayoutInterleaved, samples, channels, sample_count, d->sample_size, vsapi);
+    }
+
+    traceSpan("Read", "copy to props", n, copy_start);
+}
+
+
 static const VSFrameRef *VS_CC dambReadGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     DambReadData *d = (DambReadData *) * instanceData;
 
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        VSFrameRef *dst = vsapi->copyFrame(src, core);
-        vsapi->freeFrame(src);
+    // Source doesn't need to request anything, so its frames are made
+    // straight away.
+    bool source = !d->node;
 
-        // sf_count_t is int64_t
-        sf_count_t sample_start = (sf_count_t)(d->samples_per_frame * n + 0.5);
-        sf_count_t sample_end = (sf_count_t)(d->samples_per_frame * (n + 1) + 0.5);
-        sf_count_t sample_count = sample_end - sample_start;
+    if (activationReason == arInitial && !source) {
+        traceAsyncBegin("Read", "request", d, n);
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady || (activationReason == arInitial && source)) {
+        int64_t trace_start = startTrace();
 
-        sf_count_t delayed_start = sample_start - d->delay_samples;
-        sf_count_t delayed_end = sample_end - d->delay_samples;
+        VSFrameRef *dst;
+        if (source) {
+            // Only the properties are copied. The pixel is shared.
+            dst = vsapi->copyFrame(d->blank, core);
+        } else {
+            traceAsyncEnd("Read", "request", d, n);
 
-        int64_t sample_count_bytes = sample_count * d->sfinfo.channels * d->sample_size;
+            const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+            dst = vsapi->copyFrame(src, core);
+            vsapi->freeFrame(src);
+        }
 
-        if (delayed_start < 0) {
-            if (delayed_end > 0) {
-                sf_count_t leading_silence = sample_count - delayed_end;
-                int64_t leading_silence_bytes = leading_silence * d->sfinfo.channels * d->sample_size;
-                memset(d->buffer, 0, leading_silence_bytes);
+        std::vector<uint8_t> buffer;
+        sf_count_t sample_count;
 
-                read_samples(d->sndfile, &d->sfinfo, 0, delayed_end, d->sample_type, d->sample_size, d->buffer + leading_silence_bytes);
-            } else {
-                memset(d->buffer, 0, sample_count_bytes);
-            }
-        } else {
-            read_samples(d->sndfile, &d->sfinfo, delayed_start, sample_count, d->sample_type, d->sample_size, d->buffer);
+        const uint8_t *samples = readFrame(d, n, &buffer, &sample_count);
+        if (!samples) {
+            vsapi->setFilterError(std::string("Read: Couldn't reopen audio file. Error message from libsndfile: ").append(sf_strerror(NULL)).c_str(), frameCtx);
+            vsapi->freeFrame(dst);
+            return NULL;
         }
 
         VSMap *props = vsapi->getFramePropsRW(dst);
-        vsapi->propSetData(props, damb_samples, (char *)d->buffer, sample_count_bytes, paReplace);
+
+        setSamples(d, props, samples, sample_count, n, vsapi);
+
         vsapi->propSetInt(props, damb_channels, d->sfinfo.channels, paReplace);
         vsapi->propSetInt(props, damb_samplerate, d->sfinfo.samplerate, paReplace);
         vsapi->propSetInt(props, damb_format, d->sfinfo.format, paReplace);
 
+        if (d->stats) {
+            addStat(d->stats, DambStatFrames, 1);
+            addStat(d->stats, DambStatSamplesServed, sample_count);
+            setStatsProps(d->stats, props, vsapi);
+        }
+
+        traceSpan("Read", "frame", n, trace_start);
+
         return dst;
     }
 
@@ -106,13 +870,51 @@ static const VSFrameRef *VS_CC dambReadGetFrame(int n, int activationReason, voi
 }
 
 
-static void VS_CC dambReadFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    DambReadData *d = (DambReadData *)instanceData;
+static void freeReadData(DambReadData *d, const VSAPI *vsapi) {
+    if (d->readahead) {
+        {
+            std::lock_guard<std::mutex> guard(d->readahead->lock);
+            d->readahead->stop = true;
+            d->readahead->wake.notify_one();
+        }
+        d->readahead->thread.join();
+
+        closeHandle(&d->readahead->handle);
+    }
+
+    if (d->preload) {
+        {
+            std::lock_guard<std::mutex> guard(d->preload->lock);
+            d->preload->stop = true;
+        }
+        d->preload->thread.join();
+
+        free(d->preload->samples);
+    }
+
+    for (size_t i = 0; i < d->segments.size(); i++)
+        unmapAudioFile(&d->segments[i].mapped);
+
+    for (size_t i = 0; i < d->pool->idle.size(); i++)
+        closeHandle(&d->pool->idle[i]);
+
+    if (d->stats) {
+        unregisterStats(d->stats);
+        delete d->stats;
+    }
+
+    if (d->blank)
+        vsapi->freeFrame(d->blank);
 
-    sf_close(d->sndfile);
-    free(d->buffer);
     vsapi->freeNode(d->node);
     delete d;
+
+    flushTrace();
+}
+
+
+static void VS_CC dambReadFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    freeReadData((DambReadData *)instanceData, vsapi);
 }
 
 
@@ -159,77 +961,772 @@ static inline int isAcceptableFormatSubtype(int format) {
 }
 
 
-static void VS_CC dambReadCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+// Parses the parameters shared by Read, ReadSplit, and Source, opens the
+// files, and starts the background threads. Without a clip, the length of
+// the clip is that of the audio, at the frame rate given by fpsnum and
+// fpsden. Returns NULL after setting an error in out.
+static DambReadData *createReadData(const VSMap *in, VSMap *out, const VSAPI *vsapi) {
     DambReadData d;
     DambReadData *data;
     int err;
 
     d.delay_seconds = vsapi->propGetFloat(in, "delay", 0, &err);
 
-    d.node = vsapi->propGetNode(in, "clip", 0, NULL);
-    d.vi = vsapi->getVideoInfo(d.node);
+    int handles = int64ToIntS(vsapi->propGetInt(in, "handles", 0, &err));
+    if (err)
+        handles = 4;
+
+    if (handles < 1) {
+        vsapi->setError(out, "Read: handles must be at least 1.");
+        return NULL;
+    }
+
+    int readahead = int64ToIntS(vsapi->propGetInt(in, "readahead", 0, &err));
+    if (err)
+        readahead = 50;
+
+    if (readahead < 0) {
+        vsapi->setError(out, "Read: readahead must not be negative.");
+        return NULL;
+    }
+
+    bool use_index = !!vsapi->propGetInt(in, "index", 0, &err);
+    if (err)
+        use_index = true;
 
-    d.filename = vsapi->propGetData(in, "file", 0, NULL);
+    // Without a directory, only indexes saved by Index are loaded, and new
+    // ones are only kept in memory.
+    const char *index_dir = vsapi->propGetData(in, "index_dir", 0, &err);
+
+    bool preload = !!vsapi->propGetInt(in, "preload", 0, &err);
+
+    double preload_max = vsapi->propGetFloat(in, "preload_max", 0, &err);
+    if (err)
+        preload_max = 2048;
+
+    bool use_mmap = !!vsapi->propGetInt(in, "mmap", 0, &err);
+    if (err)
+        use_mmap = true;
+
+    bool cache = !!vsapi->propGetInt(in, "cache", 0, &err);
+    if (err)
+        cache = true;
+
+    bool stats = !!vsapi->propGetInt(in, "stats", 0, &err);
+
+    const char *layout = vsapi->propGetData(in, "layout", 0, &err);
+    if (err) {
+        d.layout = DambLayoutInterleaved;
+    } else {
+        d.layout = getLayoutFromString(layout);
+
+        if (d.layout < 0) {
+            vsapi->setError(out, "Read: layout must be \"interleaved\" or \"planar\".");
+            return NULL;
+        }
+    }
+
+    d.blank = NULL;
+
+    d.node = vsapi->propGetNode(in, "clip", 0, &err);
+    if (err) {
+        d.node = NULL;
+
+        int64_t fpsnum = vsapi->propGetInt(in, "fpsnum", 0, &err);
+        if (err)
+            fpsnum = 24000;
+
+        int64_t fpsden = vsapi->propGetInt(in, "fpsden", 0, &err);
+        if (err)
+            fpsden = 1001;
+
+        if (fpsnum < 1 || fpsden < 1) {
+            vsapi->setError(out, "Read: fpsnum and fpsden must be at least 1.");
+            return NULL;
+        }
+
+        // VapourSynth wants the fraction reduced.
+        int64_t a = fpsnum, b = fpsden;
+        while (b) {
+            int64_t t = a % b;
+            a = b;
+            b = t;
+        }
+        fpsnum /= a;
+        fpsden /= a;
+
+        // The length is set once the files' lengths are known, and the
+        // format by Source.
+        memset(&d.source_vi, 0, sizeof(d.source_vi));
+        d.source_vi.fpsNum = fpsnum;
+        d.source_vi.fpsDen = fpsden;
+        d.source_vi.numFrames = 1;
+        d.vi = &d.source_vi;
+    } else {
+        d.vi = vsapi->getVideoInfo(d.node);
+    }
+
+    int files = vsapi->propNumElements(in, "file");
+
+    std::vector<std::string> filenames;
+    for (int i = 0; i < files; i++)
+        filenames.push_back(vsapi->propGetData(in, "file", i, NULL));
 
 
     if (!d.vi->numFrames) {
         vsapi->setError(out, "Read: Can't accept clips with unknown length.");
         vsapi->freeNode(d.node);
-        return;
+        return NULL;
     }
 
     if (!d.vi->fpsNum || !d.vi->fpsDen) {
         vsapi->setError(out, "Read: Can't accept clips with variable frame rate.");
         vsapi->freeNode(d.node);
-        return;
+        return NULL;
     }
 
 
+    if (files < 1) {
+        vsapi->setError(out, "Read: At least one file is required.");
+        vsapi->freeNode(d.node);
+        return NULL;
+    }
+
+
+    DambReadHandle handle;
+    handle.stream = NULL;
+    handle.segment = 0;
+    handle.position = 0;
+
     d.sfinfo.format = 0;
-    d.sndfile = sf_open(d.filename.c_str(), SFM_READ, &d.sfinfo);
-    if (d.sndfile == NULL) {
+    handle.sndfile = sf_open(filenames[0].c_str(), SFM_READ, &d.sfinfo);
+    if (handle.sndfile == NULL) {
         vsapi->setError(out, std::string("Read: Couldn't open audio file. Error message from libsndfile: ").append(sf_strerror(NULL)).c_str());
         vsapi->freeNode(d.node);
-        return;
+        return NULL;
     }
 
     if (!isAcceptableFormatType(d.sfinfo.format)) {
         vsapi->setError(out, "Read: Audio file's type is not supported.");
-        sf_close(d.sndfile);
+        sf_close(handle.sndfile);
         vsapi->freeNode(d.node);
-        return;
+        return NULL;
     }
 
     if (!isAcceptableFormatSubtype(d.sfinfo.format)) {
         vsapi->setError(out, "Read: Audio file's subtype is not supported.");
-        sf_close(d.sndfile);
+        sf_close(handle.sndfile);
         vsapi->freeNode(d.node);
-        return;
+        return NULL;
     }
 
+    // The other files are only opened to find their length. The offsets
+    // are added up here, so that each frame only needs a binary search.
+    sf_count_t total_length = 0;
+    std::vector<SF_INFO> infos;
+
+    for (int i = 0; i < files; i++) {
+        SF_INFO sfinfo = d.sfinfo;
+
+        if (i > 0) {
+            sfinfo.format = 0;
+            SNDFILE *sndfile = sf_open(filenames[i].c_str(), SFM_READ, &sfinfo);
+
+            std::string error;
+
+            if (sndfile == NULL)
+                error = std::string("Read: Couldn't open audio file ").append(filenames[i]).append(". Error message from libsndfile: ").append(sf_strerror(NULL));
+            else if (!isAcceptableFormatType(sfinfo.format) || !isAcceptableFormatSubtype(sfinfo.format))
+                error = std::string("Read: The type of audio file ").append(filenames[i]).append(" is not supported.");
+            else if (sfinfo.channels != d.sfinfo.channels ||
+                     sfinfo.samplerate != d.sfinfo.samplerate ||
+                     getSampleType(sfinfo.format) != getSampleType(d.sfinfo.format))
+                error = std::string("Read: Audio file ").append(filenames[i]).append(" doesn't have the same number of channels, sample rate, and sample type as the first file.");
+
+            if (sndfile)
+                sf_close(sndfile);
+
+            if (!error.empty()) {
+                vsapi->setError(out, error.c_str());
+                sf_close(handle.sndfile);
+                vsapi->freeNode(d.node);
+                return NULL;
+            }
+        }
+
+        DambReadSegment segment;
+        segment.filename = filenames[i];
+        segment.start = total_length;
+        segment.length = sfinfo.frames;
+        segment.mapped.view = NULL;
+        segment.cached = false;
+        segment.index_pending = false;
+        d.segments.push_back(segment);
+        infos.push_back(sfinfo);
+
+        total_length += sfinfo.frames;
+    }
+
+    d.sfinfo.frames = total_length;
+
     d.samples_per_frame = (d.sfinfo.samplerate * d.vi->fpsDen) / (double)d.vi->fpsNum;
 
     d.sample_type = getSampleType(d.sfinfo.format);
     d.sample_size = getSampleSize(d.sample_type);
 
-    // sample_count will be sometimes (int)samples_per_frame,
-    // sometimes (int)(samples_per_frame + 1), depending on the frame number
-    d.buffer = (uint8_t *)malloc((int)(d.samples_per_frame + 1) * d.sfinfo.channels * d.sample_size);
-
     d.delay_samples = (sf_count_t)(d.delay_seconds * d.sfinfo.samplerate);
 
+    if (!d.node) {
+        // Long enough for all the audio, including the delay.
+        double frames = std::ceil(std::max<sf_count_t>(total_length + d.delay_samples, 0) / d.samples_per_frame);
+
+        if (frames < 1 || frames > INT_MAX) {
+            vsapi->setError(out, frames < 1 ? "Read: The audio is empty." : "Read: The audio is too long for the clip.");
+            sf_close(handle.sndfile);
+            return NULL;
+        }
+
+        d.source_vi.numFrames = (int)frames;
+    }
+
+    // Either all the files are mapped, or none of them.
+    d.mapped = use_mmap;
+    for (size_t i = 0; i < d.segments.size() && d.mapped; i++)
+        d.mapped = mapAudioFile(d.segments[i].filename, infos[i], &d.segments[i].mapped);
+
+    if (d.mapped) {
+        // The files are already in memory.
+        preload = false;
+        readahead = 0;
+        use_index = false;
+    } else {
+        for (size_t i = 0; i < d.segments.size(); i++)
+            unmapAudioFile(&d.segments[i].mapped);
+    }
+
+    d.index_lock.reset(new std::mutex());
+    d.index_dir = index_dir ? index_dir : "";
+    d.save_index = index_dir != NULL;
+
+    if (use_index) {
+        // Saved indexes are loaded now. The others are only built if the
+        // file needs to seek, so files that are read from start to end
+        // don't have to be read twice.
+        for (size_t i = 0; i < d.segments.size(); i++) {
+            std::string error;
+            int ret = getSeekIndex(d.segments[i].filename, d.index_dir, false, false, &d.segments[i].index, &error);
+            if (ret < 0)
+                d.segments[i].index.points.clear();
+            else if (ret == 0)
+                d.segments[i].index_pending = (infos[i].format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC;
+        }
+    }
+
+    if (preload) {
+        int64_t preload_bytes = d.sfinfo.frames * d.sfinfo.channels * d.sample_size;
+        double preload_mib = preload_bytes / (1024.0 * 1024.0);
+
+        if (preload_mib > preload_max) {
+            vsapi->setError(out, std::string("Read: Preloading the audio file would take ").append(std::to_string((int64_t)(preload_mib + 0.5))).append(" MiB, more than preload_max.").c_str());
+            sf_close(handle.sndfile);
+            vsapi->freeNode(d.node);
+            return NULL;
+        }
+
+        DambReadPreload *pl = new DambReadPreload();
+        pl->samples = (uint8_t *)malloc(std::max<int64_t>(preload_bytes, 1));
+        pl->length = d.sfinfo.frames;
+        pl->decoded = 0;
+        pl->done = false;
+        pl->stop = false;
+        d.preload.reset(pl);
+
+        if (!pl->samples) {
+            vsapi->setError(out, std::string("Read: Couldn't allocate ").append(std::to_string((int64_t)(preload_mib + 0.5))).append(" MiB to preload the audio file.").c_str());
+            sf_close(handle.sndfile);
+            vsapi->freeNode(d.node);
+            return NULL;
+        }
+
+#if VAPOURSYNTH_API_MINOR >= 6
+        vsapi->logMessage(mtDebug, std::string("Read: Preloading ").append(files > 1 ? std::to_string(files).append(" files") : filenames[0]).append(" uses ").append(std::to_string((int64_t)(preload_mib + 0.5))).append(" MiB.").c_str());
+#endif
+
+        // Everything is served from memory, so there is nothing to read ahead.
+        readahead = 0;
+    }
+
+    // Mapped and preloaded files are already in memory.
+    if (cache && !d.mapped && !preload) {
+        for (size_t i = 0; i < d.segments.size(); i++)
+            d.segments[i].cached = getCacheFile(d.segments[i].filename, &d.segments[i].cache_file);
+    }
+
+    d.stats = NULL;
+    if (stats)
+        d.stats = createStats((1u << DambStatFrames) |
+                              (1u << DambStatSeeks) |
+                              (1u << DambStatSamplesDecoded) |
+                              (1u << DambStatSamplesServed) |
+                              (1u << DambStatBytesRead) |
+                              (1u << DambStatSeekTime) |
+                              (1u << DambStatReadTime) |
+                              (1u << DambStatCacheHits) |
+                              (1u << DambStatCacheMisses) |
+                              (1u << DambStatBlockHits) |
+                              (1u << DambStatBlockMisses));
+
+    d.pool.reset(new DambReadPool());
+    d.pool->idle.push_back(handle);
+    d.pool->open_handles = 1;
+    d.pool->max_handles = handles;
+
+    if (readahead) {
+        DambReadAhead *ra = new DambReadAhead();
+        ra->handle.sndfile = NULL;
+        ra->handle.stream = NULL;
+        ra->handle.segment = 0;
+        ra->handle.position = -1;
+        // Leave room for at least two frames, so that the decoder can
+        // always make progress while a request waits for it.
+        ra->capacity = (sf_count_t)(std::max(readahead, 2) * (d.samples_per_frame + 1));
+        ra->ring.resize(ra->capacity * d.sfinfo.channels * d.sample_size);
+        ra->start = 0;
+        ra->end = 0;
+        ra->last_end = 0;
+        ra->generation = 0;
+        ra->active = false;
+        ra->eof = false;
+        ra->failed = false;
+        ra->stop = false;
+        d.readahead.reset(ra);
+    }
 
     data = new DambReadData();
-    *data = d;
+    *data = std::move(d);
+
+    if (!data->node)
+        data->vi = &data->source_vi;
+
+    if (data->readahead)
+        data->readahead->thread = std::thread(readAheadThread, data);
+
+    if (data->preload)
+        data->preload->thread = std::thread(preloadThread, data);
+
+    return data;
+}
+
+
+// The errors from createReadData start with "Read:".
+static void renameReadError(VSMap *out, const char *name, const VSAPI *vsapi) {
+    std::string error = vsapi->getError(out);
+    if (error.compare(0, 5, "Read:") == 0)
+        error.replace(0, 4, name);
+    vsapi->setError(out, error.c_str());
+}
+
+
+static void VS_CC dambReadCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    DambReadData *data = createReadData(in, out, vsapi);
+    if (!data)
+        return;
+
+    vsapi->createFilter(in, out, "Read", dambReadInit, dambReadGetFrame, dambReadFree, fmParallel, 0, data, core);
+
+    if (data->stats)
+        registerStats(data->stats, out, vsapi);
+}
+
+
+// The samples of one frame, decoded once for all the clips returned by
+// ReadSplit.
+typedef struct {
+    std::vector<uint8_t> buffer;
+    // Points into buffer or a mapped file. NULL if the file couldn't be read.
+    const uint8_t *samples;
+    sf_count_t sample_count;
+    // Number of clips that took the frame.
+    int taken;
+    // Order in which the frames were decoded, to find the oldest one.
+    uint64_t age;
+    bool done;
+} DambReadSplitFrame;
+
+
+// Clips that never request some frames would leave them behind forever, so
+// only this many are kept, not counting the ones still being decoded or
+// requested by a clip that hasn't taken them yet.
+static const size_t split_max_frames = 64;
+
+
+// Shared by all the clips returned by ReadSplit. The last one to be freed
+// frees the decoder.
+typedef struct {
+    DambReadData *read;
+    int outputs;
+
+    std::mutex lock;
+    std::condition_variable decoded;
+    // Frames some clips have taken and others haven't yet.
+    std::map<int, std::shared_ptr<DambReadSplitFrame>> frames;
+    // Number of requests for each frame that haven't taken it yet.
+    std::map<int, int> requested;
+    uint64_t age;
+} DambReadSplitShared;
+
+
+typedef struct {
+    std::shared_ptr<DambReadSplitShared> shared;
+    // Channels of the file, in the order they go in this clip.
+    std::vector<int> channels;
+} DambReadSplitData;
+
+
+static void VS_CC dambReadSplitInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    DambReadSplitData *d = (DambReadSplitData *) * instanceData;
+    vsapi->setVideoInfo(d->shared->read->vi, 1, node);
+}
+
+
+// Counts the requests for frame n, so that it isn't thrown away before they
+// take it. The lock must be held.
+static void countSplitRequest(DambReadSplitShared *s, int n, int count) {
+    if (s->outputs < 2)
+        return;
+
+    int &requested = s->requested[n];
+    requested += count;
+    if (requested <= 0)
+        s->requested.erase(n);
+}
+
+
+static void addSplitRequest(DambReadSplitShared *s, int n, int count) {
+    std::lock_guard<std::mutex> guard(s->lock);
+    countSplitRequest(s, n, count);
+}
+
+
+// Throws away the oldest frame that is decoded and not waited for, if
+// there are too many.
+static void evictSplitFrame(DambReadSplitShared *s) {
+    if (s->frames.size() < split_max_frames)
+        return;
+
+    auto oldest = s->frames.end();
+    for (auto i = s->frames.begin(); i != s->frames.end(); ++i) {
+        if (!i->second->done || s->requested.count(i->first))
+            continue;
+        if (oldest == s->frames.end() || i->second->age < oldest->second->age)
+            oldest = i;
+    }
+
+    if (oldest != s->frames.end())
+        s->frames.erase(oldest);
+}
+
+
+// Forgets the frame once every clip has taken it.
+static void releaseSplitFrame(DambReadSplitShared *s, int n, const std::shared_ptr<DambReadSplitFrame> &frame) {
+    if (frame->taken < s->outputs)
+        return;
+
+    auto it = s->frames.find(n);
+    if (it != s->frames.end() && it->second == frame)
+        s->frames.erase(it);
+}
+
+
+// Returns the samples of frame n, decoding them if no other clip has.
+static std::shared_ptr<DambReadSplitFrame> takeSplitFrame(DambReadSplitShared *s, int n) {
+    std::unique_lock<std::mutex> guard(s->lock);
+
+    countSplitRequest(s, n, -1);
+
+    auto it = s->frames.find(n);
+    if (it != s->frames.end()) {
+        std::shared_ptr<DambReadSplitFrame> frame = it->second;
+
+        if (!frame->done) {
+            int64_t start = startTrace();
+            while (!frame->done)
+                s->decoded.wait(guard);
+            traceSpan("ReadSplit", "wait for decoder", n, start);
+        }
+
+        frame->taken++;
+        releaseSplitFrame(s, n, frame);
+
+        return frame;
+    }
+
+    std::shared_ptr<DambReadSplitFrame> frame = std::make_shared<DambReadSplitFrame>();
+    frame->samples = NULL;
+    frame->sample_count = 0;
+    frame->taken = 1;
+    frame->age = s->age++;
+    frame->done = false;
+
+    if (s->outputs > 1) {
+        evictSplitFrame(s);
+        s->frames[n] = frame;
+    }
+
+    guard.unlock();
+
+    // The other clips wait for done, so the frame can be filled without
+    // holding the lock.
+    frame->samples = readFrame(s->read, n, &frame->buffer, &frame->sample_count);
+
+    guard.lock();
+
+    frame->done = true;
+    s->decoded.notify_all();
+
+    releaseSplitFrame(s, n, frame);
+
+    return frame;
+}
+
+
+static const VSFrameRef *VS_CC dambReadSplitGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    DambReadSplitData *d = (DambReadSplitData *) * instanceData;
+    DambReadData *read = d->shared->read;
+
+    if (activationReason == arInitial) {
+        traceAsyncBegin("ReadSplit", "request", d, n);
+        addSplitRequest(d->shared.get(), n, 1);
+        vsapi->requestFrameFilter(n, read->node, frameCtx);
+    } else if (activationReason == arError) {
+        traceAsyncEnd("ReadSplit", "request", d, n);
+        addSplitRequest(d->shared.get(), n, -1);
+    } else if (activationReason == arAllFramesReady) {
+        traceAsyncEnd("ReadSplit", "request", d, n);
+        int64_t trace_start = startTrace();
+
+        const VSFrameRef *src = vsapi->getFrameFilter(n, read->node, frameCtx);
+        VSFrameRef *dst = vsapi->copyFrame(src, core);
+        vsapi->freeFrame(src);
+
+        std::shared_ptr<DambReadSplitFrame> frame = takeSplitFrame(d->shared.get(), n);
+        if (!frame->samples) {
+            vsapi->setFilterError(std::string("ReadSplit: Couldn't reopen audio file. Error message from libsndfile: ").append(sf_strerror(NULL)).c_str(), frameCtx);
+            vsapi->freeFrame(dst);
+            return NULL;
+        }
+
+        int channels = (int)d->channels.size();
+
+        int64_t copy_start = startTrace();
+
+        std::vector<uint8_t> buffer(frame->sample_count * channels * read->sample_size);
+        selectChannels(frame->samples, read->sfinfo.channels, d->channels.data(), channels, read->layout, frame->sample_count, read->sample_size, buffer.data());
+
+        VSMap *props = vsapi->getFramePropsRW(dst);
+        setFrameSamples(props, read->layout, buffer.data(), channels, frame->sample_count, read->sample_size, vsapi);
 
-    vsapi->createFilter(in, out, "Read", dambReadInit, dambReadGetFrame, dambReadFree, fmSerial, 0, data, core);
+        traceSpan("ReadSplit", "copy to props", n, copy_start);
+
+        vsapi->propSetInt(props, damb_channels, channels, paReplace);
+        vsapi->propSetInt(props, damb_samplerate, read->sfinfo.samplerate, paReplace);
+        vsapi->propSetInt(props, damb_format, read->sfinfo.format, paReplace);
+
+        if (read->stats) {
+            addStat(read->stats, DambStatFrames, 1);
+            addStat(read->stats, DambStatSamplesServed, frame->sample_count);
+            setStatsProps(read->stats, props, vsapi);
+        }
+
+        traceSpan("ReadSplit", "frame", n, trace_start);
+
+        return dst;
+    }
+
+    return NULL;
+}
+
+
+static void VS_CC dambReadSplitFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    // The decoder goes away with the last reference to shared.
+    delete (DambReadSplitData *)instanceData;
+}
+
+
+// Parses a list of channels like "0,1".
+static bool parseChannelList(const char *list, std::vector<int> *channels) {
+    const char *p = list;
+
+    while (true) {
+        while (*p == ' ')
+            p++;
+
+        if (*p < '0' || *p > '9')
+            return false;
+
+        char *end;
+        long channel = strtol(p, &end, 10);
+        if (channel > INT_MAX)
+            return false;
+        channels->push_back((int)channel);
+        p = end;
+
+        while (*p == ' ')
+            p++;
+
+        if (!*p)
+            return true;
+
+        if (*p != ',')
+            return false;
+        p++;
+    }
+}
+
+
+static void VS_CC dambReadSplitCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    DambReadData *read = createReadData(in, out, vsapi);
+    if (!read) {
+        renameReadError(out, "ReadSplit", vsapi);
+        return;
+    }
+
+    int file_channels = read->sfinfo.channels;
+
+    std::vector<std::vector<int>> outputs;
+
+    int lists = vsapi->propNumElements(in, "channels");
+    if (lists < 1) {
+        // One clip per channel.
+        for (int c = 0; c < file_channels; c++)
+            outputs.push_back(std::vector<int>(1, c));
+    }
+
+    for (int i = 0; i < lists; i++) {
+        const char *list = vsapi->propGetData(in, "channels", i, NULL);
+
+        std::vector<int> channels;
+        std::string error;
+
+        if (!parseChannelList(list, &channels)) {
+            error = std::string("ReadSplit: channels must be lists of channel numbers, like \"0,1\", not \"").append(list).append("\".");
+        } else {
+            for (size_t c = 0; c < channels.size(); c++) {
+                if (channels[c] >= file_channels) {
+                    error = std::string("ReadSplit: Channel ").append(std::to_string(channels[c])).append(" doesn't exist. The audio has ").append(std::to_string(file_channels)).append(" channels.");
+                    break;
+                }
+            }
+        }
+
+        if (!error.empty()) {
+            vsapi->setError(out, error.c_str());
+            freeReadData(read, vsapi);
+            return;
+        }
+
+        outputs.push_back(channels);
+    }
+
+    DambReadSplitShared *s = new DambReadSplitShared();
+    s->read = read;
+    s->outputs = (int)outputs.size();
+    s->age = 0;
+
+    std::shared_ptr<DambReadSplitShared> shared(s, [vsapi] (DambReadSplitShared *p) {
+        freeReadData(p->read, vsapi);
+        delete p;
+    });
+
+    // Each call to createFilter adds a clip to out.
+    for (size_t i = 0; i < outputs.size(); i++) {
+        DambReadSplitData *data = new DambReadSplitData();
+        data->shared = shared;
+        data->channels = outputs[i];
+
+        vsapi->createFilter(in, out, "ReadSplit", dambReadSplitInit, dambReadSplitGetFrame, dambReadSplitFree, fmParallel, 0, data, core);
+
+        if (read->stats)
+            registerStats(read->stats, out, vsapi);
+    }
+}
+
+
+static void VS_CC dambSourceCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    DambReadData *data = createReadData(in, out, vsapi);
+    if (!data) {
+        renameReadError(out, "Source", vsapi);
+        return;
+    }
+
+    // The smallest frame there is. Every frame is a copy of this one, so
+    // they all share its pixel, and only their properties take memory.
+    data->source_vi.format = vsapi->getFormatPreset(pfGray8, core);
+    data->source_vi.width = 1;
+    data->source_vi.height = 1;
+
+    data->blank = vsapi->newVideoFrame(data->source_vi.format, 1, 1, NULL, core);
+    memset(vsapi->getWritePtr(data->blank, 0), 0, vsapi->getStride(data->blank, 0));
+
+    VSMap *props = vsapi->getFramePropsRW(data->blank);
+    vsapi->propSetInt(props, "_DurationNum", data->source_vi.fpsDen, paReplace);
+    vsapi->propSetInt(props, "_DurationDen", data->source_vi.fpsNum, paReplace);
+
+    vsapi->createFilter(in, out, "Source", dambReadInit, dambReadGetFrame, dambReadFree, fmParallel, 0, data, core);
+
+    if (data->stats)
+        registerStats(data->stats, out, vsapi);
 }
 
 
 void readRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
     registerFunc("Read",
             "clip:clip;"
-            "file:data;"
+            "file:data[];"
             "delay:float:opt;"
+            "handles:int:opt;"
+            "readahead:int:opt;"
+            "index:int:opt;"
+            "index_dir:data:opt;"
+            "preload:int:opt;"
+            "preload_max:float:opt;"
+            "mmap:int:opt;"
+            "cache:int:opt;"
+            "stats:int:opt;"
+            "layout:data:opt;"
             , dambReadCreate, 0, plugin);
+
+    registerFunc("ReadSplit",
+            "clip:clip;"
+            "file:data[];"
+            "delay:float:opt;"
+            "handles:int:opt;"
+            "readahead:int:opt;"
+            "index:int:opt;"
+            "index_dir:data:opt;"
+            "preload:int:opt;"
+            "preload_max:float:opt;"
+            "mmap:int:opt;"
+            "cache:int:opt;"
+            "stats:int:opt;"
+            "layout:data:opt;"
+            "channels:data[]:opt;"
+            , dambReadSplitCreate, 0, plugin);
+
+    registerFunc("Source",
+            "file:data[];"
+            "fpsnum:int:opt;"
+            "fpsden:int:opt;"
+            "delay:float:opt;"
+            "handles:int:opt;"
+            "readahead:int:opt;"
+            "index:int:opt;"
+            "index_dir:data:opt;"
+            "preload:int:opt;"
+            "preload_max:float:opt;"
+            "mmap:int:opt;"
+            "cache:int:opt;"
+            "stats:int:opt;"
+            "layout:data:opt;"
+            , dambSourceCreate, 0, plugin);
 }
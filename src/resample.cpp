@@ -0,0 +1,657 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+#include <VapourSynth.h>
+#include <VSHelper.h>
+
+#include <cstdio>
+#include <sndfile.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DAMB_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define DAMB_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "shared.h"
+#include "layout.h"
+#include "mixkernels.h"
+
+
+// Fused multiply-add would make the results depend on the CPU.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+#include "trace.h"
+
+
+// Polyphase windowed sinc filter for converting from in_rate to out_rate.
+// Output sample m is at input position m * M / L. Its integer part picks
+// the input samples, and the fractional part picks one of the phases.
+typedef struct {
+    int64_t L;
+    int64_t M;
+    // Multiple of 8. The filter for output sample m starts at input sample
+    // floor(m * M / L) - taps / 2 + 1.
+    int taps;
+    // Equal to L, unless L is too large, in which case the fractional
+    // position is rounded down to one of the phases.
+    int64_t phases;
+    // phases * taps coefficients, each phase normalised to unity gain.
+    std::vector<float> coeffs_float;
+    std::vector<double> coeffs_double;
+} DambResampleTable;
+
+
+typedef struct {
+    VSNodeRef *node;
+    const VSVideoInfo *vi;
+
+    int in_rate;
+    int out_rate;
+    int channels;
+    int sample_type;
+    int sample_size;
+
+    double in_samples_per_frame;
+    double out_samples_per_frame;
+
+    std::shared_ptr<const DambResampleTable> table;
+} DambResampleData;
+
+
+static const int64_t max_phases = 4096;
+
+static const double pi = 3.14159265358979323846;
+
+
+typedef struct {
+    int taps;
+    double beta;
+    double rolloff;
+} DambResampleQuality;
+
+
+static const DambResampleQuality qualities[] = {
+    { 16, 6.0, 0.85 },
+    { 32, 7.0, 0.90 },
+    { 64, 8.6, 0.94 },
+    { 128, 10.0, 0.97 },
+};
+
+
+static double besselI0(double x) {
+    double sum = 1;
+    double term = 1;
+
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-16)
+            break;
+    }
+
+    return sum;
+}
+
+
+static std::shared_ptr<const DambResampleTable> buildTable(int in_rate, int out_rate, int quality) {
+    const DambResampleQuality &q = qualities[quality];
+
+    std::shared_ptr<DambResampleTable> table = std::make_shared<DambResampleTable>();
+
+    int64_t g = in_rate;
+    for (int64_t b = out_rate; b; ) {
+        int64_t t = g % b;
+        g = b;
+        b = t;
+    }
+    table->L = out_rate / g;
+    table->M = in_rate / g;
+    table->phases = std::min(table->L, max_phases);
+
+    // When downsampling, the cutoff moves down, and the filter gets longer
+    // so that the transition band stays the same width at the output rate.
+    double ratio = std::min(1.0, (double)out_rate / in_rate);
+    double cutoff = q.rolloff * ratio;
+
+    int taps = (int)std::ceil(q.taps / ratio);
+    taps = (taps + 7) & ~7;
+    table->taps = taps;
+
+    int half = taps / 2;
+    double i0_beta = besselI0(q.beta);
+
+    table->coeffs_float.resize(table->phases * taps);
+    table->coeffs_double.resize(table->phases * taps);
+
+    std::vector<double> row(taps);
+
+    for (int64_t p = 0; p < table->phases; p++) {
+        double fraction = (double)p / table->phases;
+        double sum = 0;
+
+        for (int k = 0; k < taps; k++) {
+            // Distance from the output sample to input sample k.
+            double t = k - half + 1 - fraction;
+            double x = cutoff * t;
+            double sinc = x == 0 ? 1.0 : std::sin(pi * x) / (pi * x);
+
+            double w = t / half;
+            double window = std::fabs(w) >= 1 ? 0.0 : besselI0(q.beta * std::sqrt(1 - w * w)) / i0_beta;
+
+            row[k] = sinc * window;
+            sum += row[k];
+        }
+
+        for (int k = 0; k < taps; k++) {
+            table->coeffs_double[p * taps + k] = row[k] / sum;
+            table->coeffs_float[p * taps + k] = (float)(row[k] / sum);
+        }
+    }
+
+    return table;
+}
+
+
+// The tables are shared by all the Resample instances that convert between
+// the same rates with the same quality.
+static std::shared_ptr<const DambResampleTable> getTable(int in_rate, int out_rate, int quality) {
+    static std::mutex lock;
+    static std::map<std::tuple<int, int, int>, std::shared_ptr<const DambResampleTable>> tables;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    std::shared_ptr<const DambResampleTable> &table = tables[std::make_tuple(in_rate, out_rate, quality)];
+    if (!table)
+        table = buildTable(in_rate, out_rate, quality);
+
+    return table;
+}
+
+
+// The number of taps is always a multiple of 8.
+//
+// Every version multiplies and adds separately, and adds the products in the
+// same order, so that the output is the same whatever the CPU. For float,
+// the products go to 8 sums, one for each k % 8, which are added like the
+// lanes of two SSE registers. For double, there are 4 sums, one for each
+// k % 4.
+
+static float dotFloatC(const float *x, const float *h, int taps) {
+    float sums[8] = { 0 };
+    for (int k = 0; k < taps; k += 8)
+        for (int j = 0; j < 8; j++)
+            sums[j] += x[k + j] * h[k + j];
+
+    float lanes[4];
+    for (int j = 0; j < 4; j++)
+        lanes[j] = sums[j] + sums[j + 4];
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+
+static double dotDoubleC(const double *x, const double *h, int taps) {
+    double sums[4] = { 0 };
+    for (int k = 0; k < taps; k += 4)
+        for (int j = 0; j < 4; j++)
+            sums[j] += x[k + j] * h[k + j];
+
+    return (sums[0] + sums[2]) + (sums[1] + sums[3]);
+}
+
+
+#ifdef DAMB_X86
+
+__attribute__((target("sse2")))
+static float dotFloatSSE2(const float *x, const float *h, int taps) {
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+
+    for (int k = 0; k < taps; k += 8) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_loadu_ps(h + k)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(x + k + 4), _mm_loadu_ps(h + k + 4)));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(sum0, sum1));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+
+__attribute__((target("sse2")))
+static double dotDoubleSSE2(const double *x, const double *h, int taps) {
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+
+    for (int k = 0; k < taps; k += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(x + k), _mm_loadu_pd(h + k)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(x + k + 2), _mm_loadu_pd(h + k + 2)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+    return lanes[0] + lanes[1];
+}
+
+
+__attribute__((target("avx2")))
+static float dotFloatAVX2(const float *x, const float *h, int taps) {
+    __m256 sum = _mm256_setzero_ps();
+
+    for (int k = 0; k < taps; k += 8)
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(x + k), _mm256_loadu_ps(h + k)));
+
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, half);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+
+__attribute__((target("avx2")))
+static double dotDoubleAVX2(const double *x, const double *h, int taps) {
+    __m256d sum = _mm256_setzero_pd();
+
+    for (int k = 0; k < taps; k += 4)
+        sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(x + k), _mm256_loadu_pd(h + k)));
+
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+    double lanes[2];
+    _mm_storeu_pd(lanes, half);
+    return lanes[0] + lanes[1];
+}
+
+#endif // DAMB_X86
+
+
+#ifdef DAMB_NEON
+
+static float dotFloatNEON(const float *x, const float *h, int taps) {
+    float32x4_t sum0 = vdupq_n_f32(0.0f);
+    float32x4_t sum1 = vdupq_n_f32(0.0f);
+
+    for (int k = 0; k < taps; k += 8) {
+        sum0 = vaddq_f32(sum0, vmulq_f32(vld1q_f32(x + k), vld1q_f32(h + k)));
+        sum1 = vaddq_f32(sum1, vmulq_f32(vld1q_f32(x + k + 4), vld1q_f32(h + k + 4)));
+    }
+
+    float lanes[4];
+    vst1q_f32(lanes, vaddq_f32(sum0, sum1));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+
+static double dotDoubleNEON(const double *x, const double *h, int taps) {
+    float64x2_t sum0 = vdupq_n_f64(0.0);
+    float64x2_t sum1 = vdupq_n_f64(0.0);
+
+    for (int k = 0; k < taps; k += 4) {
+        sum0 = vaddq_f64(sum0, vmulq_f64(vld1q_f64(x + k), vld1q_f64(h + k)));
+        sum1 = vaddq_f64(sum1, vmulq_f64(vld1q_f64(x + k + 2), vld1q_f64(h + k + 2)));
+    }
+
+    double lanes[2];
+    vst1q_f64(lanes, vaddq_f64(sum0, sum1));
+    return lanes[0] + lanes[1];
+}
+
+#endif // DAMB_NEON
+
+
+typedef float (*DambDotFloat)(const float *x, const float *h, int taps);
+typedef double (*DambDotDouble)(const double *x, const double *h, int taps);
+
+
+typedef struct {
+    DambDotFloat flt;
+    DambDotDouble dbl;
+} DambDotFunctions;
+
+
+static DambDotFunctions pickDotFunctions() {
+#ifdef DAMB_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return { dotFloatAVX2, dotDoubleAVX2 };
+
+    if (__builtin_cpu_supports("sse2"))
+        return { dotFloatSSE2, dotDoubleSSE2 };
+#elif defined(DAMB_NEON)
+    return { dotFloatNEON, dotDoubleNEON };
+#endif
+
+    return { dotFloatC, dotDoubleC };
+}
+
+
+static const DambDotFunctions &dotFunctions() {
+    static const DambDotFunctions functions = pickDotFunctions();
+    return functions;
+}
+
+
+static inline DambDotFloat getDot(float) {
+    return dotFunctions().flt;
+}
+
+
+static inline DambDotDouble getDot(double) {
+    return dotFunctions().dbl;
+}
+
+
+static inline const float *getCoefficients(const DambResampleTable *table, float) {
+    return table->coeffs_float.data();
+}
+
+
+static inline const double *getCoefficients(const DambResampleTable *table, double) {
+    return table->coeffs_double.data();
+}
+
+
+// Same rounding as Read.
+static inline int64_t frameStart(double samples_per_frame, int n) {
+    return (int64_t)(samples_per_frame * n + 0.5);
+}
+
+
+// Input sample range needed for output frame n, including the samples
+// before and after it that the filter needs.
+static void inputRange(const DambResampleData *d, int n, int64_t *first, int64_t *last) {
+    const DambResampleTable *table = d->table.get();
+
+    int64_t out_start = frameStart(d->out_samples_per_frame, n);
+    int64_t out_end = frameStart(d->out_samples_per_frame, n + 1);
+
+    *first = out_start * table->M / table->L - table->taps / 2 + 1;
+    *last = (std::max(out_end - 1, out_start)) * table->M / table->L + table->taps / 2;
+}
+
+
+// Input frame that contains input sample s.
+static int inputFrame(const DambResampleData *d, int64_t s) {
+    int f = (int)(s / d->in_samples_per_frame);
+
+    while (f > 0 && frameStart(d->in_samples_per_frame, f) > s)
+        f--;
+    while (frameStart(d->in_samples_per_frame, f + 1) <= s)
+        f++;
+
+    return f;
+}
+
+
+static void inputFrames(const DambResampleData *d, int n, int *first_frame, int *last_frame) {
+    int64_t first, last;
+    inputRange(d, n, &first, &last);
+
+    *first_frame = std::max(0, inputFrame(d, std::max<int64_t>(first, 0)));
+    *last_frame = std::min(d->vi->numFrames - 1, inputFrame(d, std::max<int64_t>(last, 0)));
+
+    // Frame n is always requested, because the output is a copy of it.
+    *first_frame = std::min(*first_frame, n);
+    *last_frame = std::max(*last_frame, n);
+}
+
+
+template<class T>
+static void resample(const DambResampleData *d, int n, const std::vector<DambFrameSamples> &frames, int first_frame, int layout, T *dst) {
+    typedef typename DambMixAccumulator<T>::type W;
+
+    const DambResampleTable *table = d->table.get();
+    const int channels = d->channels;
+    const int taps = table->taps;
+
+    int64_t first, last;
+    inputRange(d, n, &first, &last);
+    int64_t length = last - first + 1;
+
+    // The input samples around the frame, one channel after the other,
+    // with silence where there are no frames.
+    std::vector<W> window(length * channels, 0);
+
+    for (size_t f = 0; f < frames.size(); f++) {
+        int64_t frame_start = frameStart(d->in_samples_per_frame, first_frame + (int)f);
+        int64_t frame_end = frameStart(d->in_samples_per_frame, first_frame + (int)f + 1);
+
+        int64_t copy_start = std::max(frame_start, first);
+        int64_t copy_end = std::min(frame_end, last + 1);
+
+        if (frames[f].layout == DambLayoutPlanar) {
+            for (int c = 0; c < channels; c++)
+                for (int64_t s = copy_start; s < copy_end; s++)
+                    window[c * length + s - first] = static_cast<W>(((const T *)frames[f].data[c])[s - frame_start]);
+        } else {
+            for (int64_t s = copy_start; s < copy_end; s++)
+                for (int c = 0; c < channels; c++)
+                    window[c * length + s - first] = static_cast<W>(((const T *)frames[f].data[0])[(s - frame_start) * channels + c]);
+        }
+    }
+
+    auto dot = getDot(W());
+    const W *coeffs = getCoefficients(table, W());
+
+    int64_t out_start = frameStart(d->out_samples_per_frame, n);
+    int64_t out_end = frameStart(d->out_samples_per_frame, n + 1);
+
+    // Sample m of channel c goes to dst[(m - out_start) * step + c * plane].
+    int64_t step = layout == DambLayoutPlanar ? 1 : channels;
+    int64_t plane = layout == DambLayoutPlanar ? out_end - out_start : 1;
+
+    for (int64_t m = out_start; m < out_end; m++) {
+        int64_t position = m * table->M;
+        int64_t integer = position / table->L;
+        int64_t phase = position - integer * table->L;
+        if (table->phases != table->L)
+            phase = phase * table->phases / table->L;
+
+        const W *h = coeffs + phase * taps;
+        int64_t offset = integer - taps / 2 + 1 - first;
+
+        for (int c = 0; c < channels; c++)
+            dst[(m - out_start) * step + c * plane] = saturateSample<T, W>(dot(window.data() + c * length + offset, h, taps));
+    }
+}
+
+
+static void VS_CC dambResampleInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    DambResampleData *d = (DambResampleData *) * instanceData;
+    vsapi->setVideoInfo(d->vi, 1, node);
+}
+
+
+static const VSFrameRef *VS_CC dambResampleGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    const DambResampleData *d = (const DambResampleData *) * instanceData;
+
+    int first_frame, last_frame;
+    inputFrames(d, n, &first_frame, &last_frame);
+
+    if (activationReason == arInitial) {
+        traceAsyncBegin("Resample", "request", d, n);
+        for (int f = first_frame; f <= last_frame; f++)
+            vsapi->requestFrameFilter(f, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        traceAsyncEnd("Resample", "request", d, n);
+        std::vector<const VSFrameRef *> frames;
+        std::vector<DambFrameSamples> samples(last_frame - first_frame + 1);
+
+        for (int f = first_frame; f <= last_frame; f++) {
+            const VSFrameRef *src = vsapi->getFrameFilter(f, d->node, frameCtx);
+            frames.push_back(src);
+
+            const VSMap *props = vsapi->getFramePropsRO(src);
+            int err[3];
+
+            int channels = int64ToIntS(vsapi->propGetInt(props, damb_channels, 0, &err[0]));
+            int samplerate = int64ToIntS(vsapi->propGetInt(props, damb_samplerate, 0, &err[1]));
+            int format = int64ToIntS(vsapi->propGetInt(props, damb_format, 0, &err[2]));
+
+            DambFrameSamples &frame_samples = samples[f - first_frame];
+
+            std::string error;
+
+            if (err[0] || err[1] || err[2] || vsapi->propNumElements(props, damb_samples) < 1)
+                error = std::string("Resample: Audio data not found in frame ").append(std::to_string(f)).append(".");
+            else if (channels != d->channels || samplerate != d->in_rate || getSampleType(format) != d->sample_type)
+                error = std::string("Resample: Clip contains more than one type of audio data. Mismatch found at frame ").append(std::to_string(f)).append(".");
+            else if (!getFrameSamples(props, channels, d->sample_size, -1, NULL, &frame_samples, vsapi) ||
+                     frame_samples.length != frameStart(d->in_samples_per_frame, f + 1) - frameStart(d->in_samples_per_frame, f))
+                error = std::string("Resample: Frame ").append(std::to_string(f)).append(" doesn't contain the number of samples Read would attach to it.");
+
+            if (!error.empty()) {
+                vsapi->setFilterError(error.c_str(), frameCtx);
+                for (size_t i = 0; i < frames.size(); i++)
+                    vsapi->freeFrame(frames[i]);
+                return NULL;
+            }
+        }
+
+        // The output has the layout of frame n.
+        int layout = samples[n - first_frame].layout;
+
+        int64_t sample_count = frameStart(d->out_samples_per_frame, n + 1) - frameStart(d->out_samples_per_frame, n);
+        std::vector<uint8_t> buffer(sample_count * d->channels * d->sample_size);
+
+        int64_t trace_start = startTrace();
+
+        if (d->sample_type == SF_FORMAT_PCM_16)
+            resample<int16_t>(d, n, samples, first_frame, layout, (int16_t *)buffer.data());
+        else if (d->sample_type == SF_FORMAT_PCM_32)
+            resample<int32_t>(d, n, samples, first_frame, layout, (int32_t *)buffer.data());
+        else if (d->sample_type == SF_FORMAT_FLOAT)
+            resample<float>(d, n, samples, first_frame, layout, (float *)buffer.data());
+        else
+            resample<double>(d, n, samples, first_frame, layout, (double *)buffer.data());
+
+        traceSpan("Resample", "resample", n, trace_start);
+
+        VSFrameRef *dst = vsapi->copyFrame(frames[n - first_frame], core);
+
+        for (size_t i = 0; i < frames.size(); i++)
+            vsapi->freeFrame(frames[i]);
+
+        VSMap *props = vsapi->getFramePropsRW(dst);
+        setFrameSamples(props, layout, buffer.data(), d->channels, sample_count, d->sample_size, vsapi);
+        vsapi->propSetInt(props, damb_samplerate, d->out_rate, paReplace);
+
+        return dst;
+    }
+
+    return NULL;
+}
+
+
+static void VS_CC dambResampleFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    DambResampleData *d = (DambResampleData *)instanceData;
+
+    vsapi->freeNode(d->node);
+    delete d;
+
+    flushTrace();
+}
+
+
+static void VS_CC dambResampleCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    DambResampleData d;
+    DambResampleData *data;
+    int err;
+
+    d.out_rate = int64ToIntS(vsapi->propGetInt(in, "rate", 0, NULL));
+
+    if (d.out_rate < 1) {
+        vsapi->setError(out, "Resample: rate must be at least 1.");
+        return;
+    }
+
+    int quality = int64ToIntS(vsapi->propGetInt(in, "quality", 0, &err));
+    if (err)
+        quality = 2;
+
+    if (quality < 0 || quality > 3) {
+        vsapi->setError(out, "Resample: quality must be between 0 and 3.");
+        return;
+    }
+
+    d.node = vsapi->propGetNode(in, "clip", 0, NULL);
+    d.vi = vsapi->getVideoInfo(d.node);
+
+    if (!d.vi->numFrames) {
+        vsapi->setError(out, "Resample: Can't accept clips with unknown length.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (!d.vi->fpsNum || !d.vi->fpsDen) {
+        vsapi->setError(out, "Resample: Can't accept clips with variable frame rate.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    // The input's sample rate is needed to know which frames to request,
+    // before any frame arrives.
+    char error[1024];
+    const VSFrameRef *first = vsapi->getFrame(0, d.node, error, sizeof(error));
+    if (!first) {
+        vsapi->setError(out, std::string("Resample: Failed to get the first frame: ").append(error).c_str());
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    const VSMap *props = vsapi->getFramePropsRO(first);
+    int err_channels, err_samplerate, err_format;
+    d.channels = int64ToIntS(vsapi->propGetInt(props, damb_channels, 0, &err_channels));
+    d.in_rate = int64ToIntS(vsapi->propGetInt(props, damb_samplerate, 0, &err_samplerate));
+    int format = int64ToIntS(vsapi->propGetInt(props, damb_format, 0, &err_format));
+    vsapi->freeFrame(first);
+
+    if (err_channels || err_samplerate || err_format || d.channels < 1 || d.in_rate < 1) {
+        vsapi->setError(out, "Resample: Audio data not found in the first frame.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.in_rate == d.out_rate) {
+        vsapi->propSetNode(out, "clip", d.node, paReplace);
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.sample_type = getSampleType(format);
+    d.sample_size = getSampleSize(d.sample_type);
+
+    d.in_samples_per_frame = (d.in_rate * d.vi->fpsDen) / (double)d.vi->fpsNum;
+    d.out_samples_per_frame = (d.out_rate * d.vi->fpsDen) / (double)d.vi->fpsNum;
+
+    d.table = getTable(d.in_rate, d.out_rate, quality);
+
+    data = new DambResampleData();
+    *data = std::move(d);
+
+    vsapi->createFilter(in, out, "Resample", dambResampleInit, dambResampleGetFrame, dambResampleFree, fmParallel, 0, data, core);
+}
+
+
+void resampleRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
+    registerFunc("Resample",
+            "clip:clip;"
+            "rate:int;"
+            "quality:int:opt;"
+            , dambResampleCreate, 0, plugin);
+}
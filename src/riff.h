@@ -0,0 +1,56 @@
+#ifndef DAMB_RIFF_H
+#define DAMB_RIFF_H
+
+#include <cstdint>
+
+
+// Chunk identifiers of W64 files.
+static const uint8_t w64_riff[16] = { 0x72, 0x69, 0x66, 0x66, 0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00 };
+static const uint8_t w64_wave[16] = { 0x77, 0x61, 0x76, 0x65, 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A };
+static const uint8_t w64_fmt[16] = { 0x66, 0x6D, 0x74, 0x20, 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A };
+static const uint8_t w64_data[16] = { 0x64, 0x61, 0x74, 0x61, 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A };
+
+// The part of KSDATAFORMAT_SUBTYPE_PCM and KSDATAFORMAT_SUBTYPE_IEEE_FLOAT
+// that follows the format tag.
+static const uint8_t wavex_subformat_tail[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 };
+
+
+static inline uint32_t readLE16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+
+static inline uint32_t readLE32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static inline uint64_t readLE64(const uint8_t *p) {
+    return readLE32(p) | ((uint64_t)readLE32(p + 4) << 32);
+}
+
+
+static inline void writeLE16(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+
+static inline void writeLE32(uint8_t *p, uint32_t value) {
+    writeLE16(p, value);
+    writeLE16(p + 2, value >> 16);
+}
+
+
+static inline void writeLE64(uint8_t *p, uint64_t value) {
+    writeLE32(p, (uint32_t)value);
+    writeLE32(p + 4, (uint32_t)(value >> 32));
+}
+
+
+static inline bool isLittleEndian() {
+    const uint16_t one = 1;
+    return *(const uint8_t *)&one == 1;
+}
+
+#endif
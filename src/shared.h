@@ -1,8 +1,12 @@
 
+#include <cmath>
+
+
 static const char *damb_samples = "DambSamples";
 static const char *damb_channels = "DambChannels";
 static const char *damb_samplerate = "DambSampleRate";
 static const char *damb_format = "DambFormat";
+static const char *damb_layout = "DambLayout";
 
 
 
@@ -38,3 +42,25 @@ static inline int getSampleSize(int sample_type) {
 }
 
 
+// FLAC only stores integers. Write converts float samples itself before they
+// go to libsndfile or to the FLAC writer, so that both get the same samples.
+// The conversion is libsndfile's: scaled by 2^(bits - 1) - 1 and rounded to
+// nearest, except that samples out of range are clipped, and NaN becomes 0.
+// The result is left aligned in 32 bits, like SF_FORMAT_PCM_32 samples.
+template <class T>
+static inline int32_t floatToFlacSample(T value, int bits) {
+    T scale = (T)((1 << (bits - 1)) - 1);
+    T scaled = value * scale;
+
+    int32_t sample;
+    if (scaled >= scale)
+        sample = (int32_t)scale;
+    else if (scaled <= -scale - 1)
+        sample = -(int32_t)scale - 1;
+    else if (scaled == scaled)
+        sample = (int32_t)std::lrint(scaled);
+    else
+        sample = 0;
+
+    return sample * (1 << (32 - bits));
+}
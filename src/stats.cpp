@@ -0,0 +1,121 @@
+#include <cstdint>
+
+#include <string>
+#include <map>
+#include <mutex>
+
+#include <VapourSynth.h>
+
+#include "stats.h"
+
+
+typedef struct {
+    const char *prop;
+    const char *key;
+} DambStatName;
+
+
+// In the same order as the enum.
+static const DambStatName stat_names[DambStatCount] = {
+    { "DambStatsFrames", "frames" },
+    { "DambStatsSeeks", "seeks" },
+    { "DambStatsSamplesDecoded", "samples_decoded" },
+    { "DambStatsSamplesServed", "samples_served" },
+    { "DambStatsBytesRead", "bytes_read" },
+    { "DambStatsBytesWritten", "bytes_written" },
+    { "DambStatsSeekTime", "seek_time" },
+    { "DambStatsReadTime", "read_time" },
+    { "DambStatsMixTime", "mix_time" },
+    { "DambStatsWriteTime", "write_time" },
+    { "DambStatsCacheHits", "cache_hits" },
+    { "DambStatsCacheMisses", "cache_misses" },
+    { "DambStatsBlockHits", "block_hits" },
+    { "DambStatsBlockMisses", "block_misses" },
+    { "DambStatsQueueDepth", "queue_depth" },
+    { "DambStatsQueueDepthMax", "queue_depth_max" },
+    { "DambStatsReorderDepthMax", "reorder_depth_max" },
+};
+
+
+// The filters' counters, by the address of their clip's video info. The
+// core keeps one copy of it per node, so it identifies the node, and any
+// reference to the node can find it with getVideoInfo.
+static std::mutex registry_lock;
+static std::map<const VSVideoInfo *, DambStats *> registry;
+
+
+DambStats *createStats(uint32_t used) {
+    DambStats *stats = new DambStats;
+
+    for (int i = 0; i < DambStatCount; i++)
+        stats->values[i].store(0);
+    stats->used = used;
+
+    return stats;
+}
+
+
+void registerStats(DambStats *stats, const VSMap *out, const VSAPI *vsapi) {
+    // Filters that return several clips call createFilter once per clip.
+    int err;
+    VSNodeRef *node = vsapi->propGetNode(out, "clip", vsapi->propNumElements(out, "clip") - 1, &err);
+    if (err)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        registry[vsapi->getVideoInfo(node)] = stats;
+    }
+
+    vsapi->freeNode(node);
+}
+
+
+void unregisterStats(DambStats *stats) {
+    std::lock_guard<std::mutex> guard(registry_lock);
+
+    for (auto it = registry.begin(); it != registry.end(); ) {
+        if (it->second == stats)
+            it = registry.erase(it);
+        else
+            ++it;
+    }
+}
+
+
+static void setStats(const DambStats *stats, VSMap *map, bool props, const VSAPI *vsapi) {
+    for (int i = 0; i < DambStatCount; i++)
+        if (stats->used & (1u << i))
+            vsapi->propSetInt(map, props ? stat_names[i].prop : stat_names[i].key, stats->values[i].load(std::memory_order_relaxed), paReplace);
+}
+
+
+void setStatsProps(const DambStats *stats, VSMap *props, const VSAPI *vsapi) {
+    setStats(stats, props, true, vsapi);
+}
+
+
+static void VS_CC dambStatsCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    VSNodeRef *node = vsapi->propGetNode(in, "clip", 0, NULL);
+    const VSVideoInfo *vi = vsapi->getVideoInfo(node);
+
+    {
+        // Held while reading, so that the filter can't free the counters.
+        std::lock_guard<std::mutex> guard(registry_lock);
+
+        auto it = registry.find(vi);
+        if (it != registry.end())
+            setStats(it->second, out, false, vsapi);
+        else
+            vsapi->setError(out, "Stats: The clip must come straight from Read, Mix, or Write, created with stats=1.");
+    }
+
+    vsapi->freeNode(node);
+}
+
+
+void statsRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
+    registerFunc("Stats",
+            "clip:clip;"
+            , dambStatsCreate, 0, plugin);
+}
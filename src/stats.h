@@ -0,0 +1,97 @@
+#ifndef DAMB_STATS_H
+#define DAMB_STATS_H
+
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+
+#include <VapourSynth.h>
+
+
+// Counters kept by Read, Mix, and Write when they're created with stats=1.
+// All of them are cumulative, except queue_depth, which is the current
+// depth. Times are in nanoseconds.
+enum {
+    DambStatFrames,
+    DambStatSeeks,
+    DambStatSamplesDecoded,
+    DambStatSamplesServed,
+    DambStatBytesRead,
+    DambStatBytesWritten,
+    DambStatSeekTime,
+    DambStatReadTime,
+    DambStatMixTime,
+    DambStatWriteTime,
+    DambStatCacheHits,
+    DambStatCacheMisses,
+    DambStatBlockHits,
+    DambStatBlockMisses,
+    DambStatQueueDepth,
+    DambStatQueueDepthMax,
+    DambStatReorderDepthMax,
+    DambStatCount
+};
+
+
+// used is a bit mask of the counters the filter reports, so that Read
+// doesn't report queue depths and Write doesn't report seeks.
+typedef struct {
+    std::atomic<int64_t> values[DambStatCount];
+    uint32_t used;
+} DambStats;
+
+
+// When stats are disabled, the filters pass NULL, and these do nothing.
+
+static inline void addStat(DambStats *stats, int stat, int64_t value) {
+    if (stats)
+        stats->values[stat].fetch_add(value, std::memory_order_relaxed);
+}
+
+
+static inline void setStat(DambStats *stats, int stat, int64_t value) {
+    if (stats)
+        stats->values[stat].store(value, std::memory_order_relaxed);
+}
+
+
+static inline void maxStat(DambStats *stats, int stat, int64_t value) {
+    if (!stats)
+        return;
+
+    int64_t old = stats->values[stat].load(std::memory_order_relaxed);
+    while (old < value && !stats->values[stat].compare_exchange_weak(old, value, std::memory_order_relaxed))
+        ;
+}
+
+
+// Returns 0 when stats are disabled, so that the clock isn't read.
+static inline int64_t startStatTimer(DambStats *stats) {
+    if (!stats)
+        return 0;
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static inline void stopStatTimer(DambStats *stats, int stat, int64_t start) {
+    if (stats)
+        addStat(stats, stat, startStatTimer(stats) - start);
+}
+
+
+DambStats *createStats(uint32_t used);
+
+// Makes the counters findable by Stats through the clip that was just put
+// in out by createFilter. The same counters can be registered for several
+// clips.
+void registerStats(DambStats *stats, const VSMap *out, const VSAPI *vsapi);
+
+// Must be called by the filter's free function, before it deletes stats.
+void unregisterStats(DambStats *stats);
+
+// Adds the counters to a frame's properties, as DambStats* props.
+void setStatsProps(const DambStats *stats, VSMap *props, const VSAPI *vsapi);
+
+#endif
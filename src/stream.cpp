@@ -0,0 +1,388 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <sndfile.h>
+
+#include "stream.h"
+
+
+#ifdef _WIN32
+#define lseek _lseeki64
+#define write _write
+#define close _close
+#define ftruncate _chsize_s
+#endif
+
+
+struct DambOutputStream {
+    int fd;
+    bool close_fd;
+    bool seekable;
+    bool preallocated;
+    DambStreamOptions options;
+    // Offset of the descriptor when it was opened, which is where the
+    // file starts.
+    int64_t base;
+
+    // Where libsndfile will write next, and the size of everything it
+    // wrote so far, relative to base.
+    int64_t position;
+    int64_t length;
+
+    // Bytes waiting to be written at buffer_start.
+    std::vector<uint8_t> buffer;
+    int64_t buffer_start;
+
+    bool failed;
+
+    int64_t bytes_written;
+    int64_t bytes_since_sync;
+    int64_t opened;
+    int64_t io_time;
+};
+
+
+static int64_t streamClock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+int getSyncFromString(const char *sync) {
+    std::string s(sync);
+
+    if (s == "none")
+        return DambSyncNone;
+    if (s == "periodic")
+        return DambSyncPeriodic;
+    if (s == "close")
+        return DambSyncClose;
+    return -1;
+}
+
+
+static bool parseDescriptor(const std::string &filename, int *fd) {
+    if (filename == "-") {
+        *fd = 1;
+        return true;
+    }
+
+    if (filename.compare(0, 3, "fd:") || filename.size() == 3)
+        return false;
+
+    char *end;
+    long n = strtol(filename.c_str() + 3, &end, 10);
+    if (*end || n < 0 || n > INT32_MAX)
+        return false;
+
+    *fd = (int)n;
+    return true;
+}
+
+
+static bool isFifo(const std::string &filename) {
+#ifdef _WIN32
+    return false;
+#else
+    struct stat st;
+    return !stat(filename.c_str(), &st) && S_ISFIFO(st.st_mode);
+#endif
+}
+
+
+bool isOutputStream(const std::string &filename) {
+    int fd;
+    return parseDescriptor(filename, &fd) || isFifo(filename);
+}
+
+
+// Reserves the blocks in one go, so that a file that grows by small appends
+// doesn't end up in fragments, without changing the file's size.
+static bool preallocateFile(int fd, int64_t offset, int64_t size) {
+#ifdef __linux__
+    return !fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)size);
+#else
+    return false;
+#endif
+}
+
+
+static bool syncFile(int fd) {
+#ifdef _WIN32
+    return !_commit(fd);
+#elif defined(__linux__)
+    return !fdatasync(fd);
+#else
+    return !fsync(fd);
+#endif
+}
+
+
+DambOutputStream *openOutputStream(const std::string &filename, const DambStreamOptions &options, std::string *error) {
+    DambOutputStream *s = new DambOutputStream();
+    s->opened = streamClock();
+
+    if (parseDescriptor(filename, &s->fd)) {
+        s->close_fd = s->fd != 1;
+    } else if (isFifo(filename)) {
+        // Waits until the other end of the FIFO is opened.
+        s->fd = open(filename.c_str(), O_WRONLY);
+        s->close_fd = true;
+    } else {
+#ifdef _WIN32
+        s->fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+#else
+        s->fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+        s->close_fd = true;
+    }
+
+    if (s->fd < 0) {
+        *error = std::string("couldn't open ").append(filename).append(": ").append(strerror(errno));
+        delete s;
+        return NULL;
+    }
+
+#ifdef _WIN32
+    if (s->fd == 1)
+        _setmode(1, _O_BINARY);
+#endif
+
+    struct stat st;
+    if (fstat(s->fd, &st)) {
+        *error = std::string("file descriptor ").append(std::to_string(s->fd)).append(" isn't open");
+        delete s;
+        return NULL;
+    }
+
+    // Writes to a descriptor opened for appending always go to the end,
+    // so the header couldn't be patched.
+    bool append = false;
+#ifndef _WIN32
+    append = (fcntl(s->fd, F_GETFL) & O_APPEND) != 0;
+#endif
+
+    s->base = S_ISREG(st.st_mode) && !append ? (int64_t)lseek(s->fd, 0, SEEK_CUR) : -1;
+    s->seekable = s->base >= 0;
+    if (!s->seekable)
+        s->base = 0;
+
+    s->options = options;
+    s->options.buffer_bytes = std::max<size_t>(options.buffer_bytes, 1);
+
+    // Pipes and character devices can't be synced.
+    if (!S_ISREG(st.st_mode))
+        s->options.sync = DambSyncNone;
+
+    s->preallocated = S_ISREG(st.st_mode) && options.preallocate > 0 &&
+                      preallocateFile(s->fd, s->seekable ? s->base : (int64_t)st.st_size, options.preallocate);
+
+    s->position = 0;
+    s->length = 0;
+    s->buffer.reserve(s->options.buffer_bytes);
+    s->buffer_start = 0;
+    s->failed = false;
+    s->bytes_written = 0;
+    s->bytes_since_sync = 0;
+    s->io_time = 0;
+
+    return s;
+}
+
+
+static bool writeAll(int fd, const uint8_t *bytes, size_t size) {
+    while (size > 0) {
+        int64_t written = write(fd, bytes, (unsigned)std::min<size_t>(size, 1 << 30));
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        bytes += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+
+static bool flushStream(DambOutputStream *s) {
+    if (s->buffer.empty() || s->failed)
+        return !s->failed;
+
+    int64_t start = streamClock();
+
+    if (s->seekable && lseek(s->fd, s->base + s->buffer_start, SEEK_SET) < 0)
+        s->failed = true;
+    else if (!writeAll(s->fd, s->buffer.data(), s->buffer.size()))
+        s->failed = true;
+
+    s->bytes_written += s->buffer.size();
+    s->bytes_since_sync += s->buffer.size();
+
+    s->buffer_start += s->buffer.size();
+    s->buffer.clear();
+
+    if (!s->failed && s->options.sync == DambSyncPeriodic && s->bytes_since_sync >= s->options.sync_interval) {
+        s->failed = !syncFile(s->fd);
+        s->bytes_since_sync = 0;
+    }
+
+    s->io_time += streamClock() - start;
+
+    return !s->failed;
+}
+
+
+static sf_count_t streamWrite(const void *ptr, sf_count_t count, void *user_data) {
+    DambOutputStream *s = (DambOutputStream *)user_data;
+    const uint8_t *bytes = (const uint8_t *)ptr;
+    sf_count_t size = count;
+
+    int64_t buffer_end = s->buffer_start + s->buffer.size();
+
+    if (s->position != buffer_end) {
+        if (s->seekable) {
+            if (!flushStream(s))
+                return 0;
+            s->buffer_start = s->position;
+        } else if (s->position < buffer_end) {
+            // Most likely a header being updated. What was already sent
+            // can't be changed, but what is still in the buffer can.
+            if (s->position < s->buffer_start) {
+                sf_count_t dropped = std::min<sf_count_t>(size, s->buffer_start - s->position);
+                bytes += dropped;
+                size -= dropped;
+                s->position += dropped;
+            }
+
+            sf_count_t patched = std::min<sf_count_t>(size, buffer_end - s->position);
+            if (patched > 0) {
+                memcpy(s->buffer.data() + (s->position - s->buffer_start), bytes, patched);
+                bytes += patched;
+                size -= patched;
+                s->position += patched;
+            }
+        } else {
+            // A pipe can't skip ahead, so the gap is filled with zeros.
+            s->buffer.resize(s->buffer.size() + (s->position - buffer_end), 0);
+        }
+    }
+
+    while (size > 0) {
+        if (s->buffer.size() >= s->options.buffer_bytes && !flushStream(s))
+            return 0;
+
+        size_t chunk = std::min<size_t>(size, s->options.buffer_bytes - s->buffer.size());
+        s->buffer.insert(s->buffer.end(), bytes, bytes + chunk);
+
+        bytes += chunk;
+        size -= chunk;
+        s->position += chunk;
+    }
+
+    s->length = std::max(s->length, s->position);
+
+    return count;
+}
+
+
+static sf_count_t streamGetLength(void *user_data) {
+    return ((DambOutputStream *)user_data)->length;
+}
+
+
+static sf_count_t streamSeek(sf_count_t offset, int whence, void *user_data) {
+    DambOutputStream *s = (DambOutputStream *)user_data;
+
+    if (whence == SEEK_CUR)
+        offset += s->position;
+    else if (whence == SEEK_END)
+        offset += s->length;
+
+    if (offset < 0)
+        return -1;
+
+    // The descriptor is only moved when the next write happens.
+    s->position = offset;
+    return offset;
+}
+
+
+static sf_count_t streamRead(void *ptr, sf_count_t count, void *user_data) {
+    return 0;
+}
+
+
+static sf_count_t streamTell(void *user_data) {
+    return ((DambOutputStream *)user_data)->position;
+}
+
+
+SNDFILE *openStreamSndfile(DambOutputStream *stream, SF_INFO *sfinfo) {
+    static SF_VIRTUAL_IO io = {
+        streamGetLength,
+        streamSeek,
+        streamRead,
+        streamWrite,
+        streamTell
+    };
+
+    return sf_open_virtual(&io, SFM_WRITE, sfinfo, stream);
+}
+
+
+bool isStreamSeekable(const DambOutputStream *stream) {
+    return stream->seekable;
+}
+
+
+bool closeOutputStream(DambOutputStream *s, DambStreamTotals *totals, std::string *error) {
+    bool ok = flushStream(s);
+    if (!ok)
+        *error = std::string("couldn't write to file descriptor ").append(std::to_string(s->fd));
+
+    // Gives back the preallocated space that wasn't used.
+    if (ok && s->preallocated && s->seekable && ftruncate(s->fd, s->base + s->length)) {
+        *error = "couldn't trim the file";
+        ok = false;
+    }
+
+    if (ok && s->options.sync != DambSyncNone) {
+        int64_t start = streamClock();
+        if (!syncFile(s->fd)) {
+            *error = "couldn't sync the file";
+            ok = false;
+        }
+        s->io_time += streamClock() - start;
+    }
+
+    if (totals) {
+        totals->bytes = s->bytes_written;
+        totals->seconds = (streamClock() - s->opened) / 1e9;
+        totals->io_seconds = s->io_time / 1e9;
+    }
+
+    if (s->close_fd && close(s->fd) && ok) {
+        *error = std::string("couldn't close file descriptor ").append(std::to_string(s->fd));
+        ok = false;
+    }
+
+    delete s;
+    return ok;
+}
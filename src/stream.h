@@ -0,0 +1,73 @@
+#ifndef DAMB_STREAM_H
+#define DAMB_STREAM_H
+
+#include <cstdint>
+
+#include <string>
+
+#include <cstdio>
+#include <sndfile.h>
+
+
+// The file libsndfile writes to, through its virtual I/O interface. It can
+// be a regular file, created by name, or a stream: "-" for stdout, "fd:N"
+// for an inherited file descriptor, or the name of an existing FIFO. The
+// writes are collected in a buffer before they go to the descriptor.
+//
+// If the descriptor can seek, the header is patched with the final sizes
+// when the file is closed, like with a regular file. Otherwise, whatever
+// libsndfile writes before the end of the stream is applied to the bytes
+// still in the buffer, and dropped for the bytes already sent. So a stream
+// that fits in the buffer gets the final sizes, and a longer one keeps the
+// sizes the header had when it was sent, which for WAV means "until the
+// end of the stream".
+typedef struct DambOutputStream DambOutputStream;
+
+
+enum {
+    DambSyncNone,
+    // Every sync_interval bytes.
+    DambSyncPeriodic,
+    DambSyncClose
+};
+
+
+typedef struct {
+    size_t buffer_bytes;
+    int sync;
+    int64_t sync_interval;
+    // Space reserved for the file when it's opened, or 0. Only regular
+    // files are preallocated, and the space that isn't used is given back
+    // when the file is closed.
+    int64_t preallocate;
+} DambStreamOptions;
+
+
+// What went to the descriptor, to report the bandwidth. io_seconds only
+// counts the time spent in write and sync, while seconds goes from opening
+// the file to closing it.
+typedef struct {
+    int64_t bytes;
+    double seconds;
+    double io_seconds;
+} DambStreamTotals;
+
+
+// Returns -1 if the string isn't "none", "periodic", or "close".
+int getSyncFromString(const char *sync);
+
+// True for names that aren't regular files.
+bool isOutputStream(const std::string &filename);
+
+DambOutputStream *openOutputStream(const std::string &filename, const DambStreamOptions &options, std::string *error);
+
+// Like sf_open with SFM_WRITE. The stream must outlive the SNDFILE.
+SNDFILE *openStreamSndfile(DambOutputStream *stream, SF_INFO *sfinfo);
+
+bool isStreamSeekable(const DambOutputStream *stream);
+
+// Writes what is left in the buffer and closes the descriptor, unless it
+// is stdout. Must be called after sf_close. totals can be NULL.
+bool closeOutputStream(DambOutputStream *stream, DambStreamTotals *totals, std::string *error);
+
+#endif
@@ -0,0 +1,255 @@
+#include <cstdint>
+#include <cstdlib>
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+
+#include "trace.h"
+
+
+typedef struct {
+    const char *category;
+    const char *name;
+    const void *id;
+    int64_t start;
+    int64_t end;
+    int n;
+    // 'X' for spans, 'b' and 'e' for the ends of async spans.
+    char phase;
+} DambTraceEvent;
+
+
+// Events are appended to a list of chunks. The owning thread fills the last
+// chunk and publishes each event by incrementing count. flushTrace reads
+// the published events and frees the chunks the owner has moved past.
+static const size_t trace_chunk_events = 4096;
+
+typedef struct DambTraceChunk {
+    DambTraceEvent events[trace_chunk_events];
+    std::atomic<size_t> count;
+    std::atomic<DambTraceChunk *> next;
+} DambTraceChunk;
+
+
+typedef struct {
+    int tid;
+    std::atomic<const char *> thread_name;
+
+    // Only used by the owning thread.
+    DambTraceChunk *tail;
+
+    // Only used by flushTrace, with trace_lock held.
+    DambTraceChunk *head;
+    size_t flushed;
+    bool named;
+} DambTraceBuffer;
+
+
+static const char *trace_filename = getenv("DAMB_TRACE");
+
+extern const bool damb_trace_enabled = trace_filename && trace_filename[0];
+
+static const int64_t trace_epoch = traceClock();
+
+static std::mutex trace_lock;
+static std::vector<DambTraceBuffer *> trace_buffers;
+static FILE *trace_file = NULL;
+static bool trace_failed = false;
+static bool trace_closed = false;
+static bool trace_first_event = true;
+
+
+int64_t traceClock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static DambTraceChunk *newTraceChunk() {
+    DambTraceChunk *chunk = new DambTraceChunk;
+    chunk->count.store(0);
+    chunk->next.store(NULL);
+    return chunk;
+}
+
+
+static DambTraceBuffer *getTraceBuffer() {
+    static thread_local DambTraceBuffer *buffer = NULL;
+
+    if (!buffer) {
+        DambTraceBuffer *b = new DambTraceBuffer;
+        b->thread_name.store(NULL);
+        b->tail = newTraceChunk();
+        b->head = b->tail;
+        b->flushed = 0;
+        b->named = false;
+
+        // Only once per thread.
+        std::lock_guard<std::mutex> guard(trace_lock);
+        b->tid = (int)trace_buffers.size() + 1;
+        trace_buffers.push_back(b);
+
+        buffer = b;
+    }
+
+    return buffer;
+}
+
+
+static void appendTraceEvent(const DambTraceEvent &event) {
+    DambTraceBuffer *b = getTraceBuffer();
+    DambTraceChunk *chunk = b->tail;
+
+    size_t count = chunk->count.load(std::memory_order_relaxed);
+    if (count == trace_chunk_events) {
+        DambTraceChunk *next = newTraceChunk();
+        chunk->next.store(next, std::memory_order_release);
+        b->tail = chunk = next;
+        count = 0;
+    }
+
+    chunk->events[count] = event;
+    chunk->count.store(count + 1, std::memory_order_release);
+}
+
+
+void recordTraceSpan(const char *category, const char *name, int n, int64_t start) {
+    DambTraceEvent event;
+    event.category = category;
+    event.name = name;
+    event.id = NULL;
+    event.start = start;
+    event.end = traceClock();
+    event.n = n;
+    event.phase = 'X';
+
+    appendTraceEvent(event);
+}
+
+
+void recordTraceAsync(const char *category, const char *name, const void *id, int n, bool begin) {
+    DambTraceEvent event;
+    event.category = category;
+    event.name = name;
+    event.id = id;
+    event.start = traceClock();
+    event.end = event.start;
+    event.n = n;
+    event.phase = begin ? 'b' : 'e';
+
+    appendTraceEvent(event);
+}
+
+
+void setTraceThreadName(const char *name) {
+    if (damb_trace_enabled)
+        getTraceBuffer()->thread_name.store(name);
+}
+
+
+static int getProcessId() {
+#ifdef _WIN32
+    return (int)GetCurrentProcessId();
+#else
+    return (int)getpid();
+#endif
+}
+
+
+// Must be called with trace_lock held.
+static void writeTraceEvent(const DambTraceEvent &e, int pid, int tid) {
+    fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,",
+            trace_first_event ? "" : ",\n", e.name, e.category, e.phase, (e.start - trace_epoch) / 1000.0);
+
+    if (e.phase == 'X')
+        fprintf(trace_file, "\"dur\":%.3f,", (e.end - e.start) / 1000.0);
+    else
+        fprintf(trace_file, "\"id\":\"%p:%d\",", e.id, e.n);
+
+    fprintf(trace_file, "\"pid\":%d,\"tid\":%d,\"args\":{\"n\":%d}}", pid, tid, e.n);
+
+    trace_first_event = false;
+}
+
+
+// Writes the closing bracket when the process exits. The trace event format
+// allows it to be missing, so a trace from a process that crashed can still
+// be opened.
+static void closeTrace() {
+    std::lock_guard<std::mutex> guard(trace_lock);
+
+    if (trace_file) {
+        fprintf(trace_file, "\n]\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+
+    trace_closed = true;
+}
+
+
+void flushTrace() {
+    if (!damb_trace_enabled)
+        return;
+
+    std::lock_guard<std::mutex> guard(trace_lock);
+
+    if (trace_failed || trace_closed)
+        return;
+
+    if (!trace_file) {
+        trace_file = fopen(trace_filename, "w");
+        if (!trace_file) {
+            trace_failed = true;
+            return;
+        }
+
+        fprintf(trace_file, "[\n");
+        atexit(closeTrace);
+    }
+
+    int pid = getProcessId();
+
+    for (size_t i = 0; i < trace_buffers.size(); i++) {
+        DambTraceBuffer *b = trace_buffers[i];
+
+        const char *thread_name = b->thread_name.load();
+        if (thread_name && !b->named) {
+            fprintf(trace_file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    trace_first_event ? "" : ",\n", pid, b->tid, thread_name);
+            trace_first_event = false;
+            b->named = true;
+        }
+
+        while (true) {
+            size_t count = b->head->count.load(std::memory_order_acquire);
+
+            for (size_t j = b->flushed; j < count; j++)
+                writeTraceEvent(b->head->events[j], pid, b->tid);
+            b->flushed = count;
+
+            if (count < trace_chunk_events)
+                break;
+
+            // The owner has moved on to the next chunk, if there is one.
+            DambTraceChunk *next = b->head->next.load(std::memory_order_acquire);
+            if (!next)
+                break;
+
+            delete b->head;
+            b->head = next;
+            b->flushed = 0;
+        }
+    }
+
+    fflush(trace_file);
+}
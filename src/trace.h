@@ -0,0 +1,61 @@
+#ifndef DAMB_TRACE_H
+#define DAMB_TRACE_H
+
+#include <cstdint>
+
+
+// When the environment variable DAMB_TRACE is set to a file name, the
+// filters record what each thread spends its time on, and the events are
+// written to that file in the Chrome trace event format every time a filter
+// is freed. The file can be opened with chrome://tracing or Perfetto.
+//
+// Each thread records into its own buffer, without locking.
+extern const bool damb_trace_enabled;
+
+
+int64_t traceClock();
+
+
+// Returns 0 when tracing is disabled, so that the clock isn't read.
+static inline int64_t startTrace() {
+    return damb_trace_enabled ? traceClock() : 0;
+}
+
+
+// category and name must be string literals, or live until the trace
+// is written. n is the frame number, or -1 if there isn't one.
+void recordTraceSpan(const char *category, const char *name, int n, int64_t start);
+
+void recordTraceAsync(const char *category, const char *name, const void *id, int n, bool begin);
+
+
+// Records the time since start as a span called name, on this thread.
+static inline void traceSpan(const char *category, const char *name, int n, int64_t start) {
+    if (damb_trace_enabled)
+        recordTraceSpan(category, name, n, start);
+}
+
+
+// Spans that start and end on different threads, like a frame request,
+// which starts in arInitial and ends in arAllFramesReady. id and n
+// identify the span, so id should be the filter's instance data.
+static inline void traceAsyncBegin(const char *category, const char *name, const void *id, int n) {
+    if (damb_trace_enabled)
+        recordTraceAsync(category, name, id, n, true);
+}
+
+
+static inline void traceAsyncEnd(const char *category, const char *name, const void *id, int n) {
+    if (damb_trace_enabled)
+        recordTraceAsync(category, name, id, n, false);
+}
+
+
+// Names the calling thread in the trace. name must be a string literal.
+void setTraceThreadName(const char *name);
+
+
+// Appends the events recorded since the last call to the file.
+void flushTrace();
+
+#endif
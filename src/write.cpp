@@ -3,6 +3,14 @@
 #include <cstring>
 
 #include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 #include <VapourSynth.h>
 #include <VSHelper.h>
@@ -11,150 +19,672 @@
 #include <sndfile.h>
 
 #include "shared.h"
+#include "layout.h"
+#include "pcmfile.h"
+#include "stats.h"
+#include "stream.h"
+#include "trace.h"
+#ifdef HAVE_FLAC
+#include "flacwriter.h"
+#endif
+
+
+// A frame waiting to be encoded. The frame reference keeps the samples alive.
+typedef struct {
+    // NULL once the samples have been copied out of the frame.
+    const VSFrameRef *frame;
+    const char *samples;
+    // Planar frames are interleaved into this buffer, which samples then
+    // points to, and so are the samples of frames that must wait for the
+    // frames before them. NULL otherwise.
+    char *interleaved;
+    sf_count_t sample_count;
+    int n;
+} DambWriteBlock;
+
+
+// Single producer, single consumer ring of blocks. The producer is
+// dambWriteGetFrame and the consumer is the encoder thread. Pushing and
+// popping don't lock. The mutex is only taken to sleep when the queue is
+// full or empty, and to wake a sleeping thread.
+typedef struct {
+    std::vector<DambWriteBlock> slots;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::atomic<bool> producer_waiting;
+    std::atomic<bool> consumer_waiting;
+    std::atomic<bool> finished;
+
+    // Set by the encoder thread when writing fails. error is written before
+    // failed is set and never changed afterwards.
+    std::atomic<bool> failed;
+    std::string error;
+} DambWriteQueue;
 
 
 typedef struct {
     VSNodeRef *node;
     const VSVideoInfo *vi;
+    const VSAPI *vsapi;
 
     std::string filename;
 
     SNDFILE *sndfile;
+    // What libsndfile writes to. NULL with pwrite and the FLAC writer.
+    DambOutputStream *stream;
+    DambStreamOptions stream_options;
     SF_INFO sfinfo;
     int sample_size;
     int sample_type;
     int format;
     int subtype;
     double quality;
-    int last_frame;
     int initialised;
+    // Why the output couldn't be opened, if it couldn't.
+    std::string init_error;
 
     int original_channels;
     int original_samplerate;
+
+    std::unique_ptr<DambWriteQueue> queue;
+    std::thread encoder;
+
+    // Frames can arrive in any order. They wait here until all the frames
+    // before them have arrived, then go to the encoder in order.
+    // next_frame is the first frame not yet sent to the encoder.
+    std::unique_ptr<std::mutex> reorder_lock;
+    std::map<int, DambWriteBlock> reorder;
+    int next_frame;
+    int window;
+
+    // In pwrite mode, every frame is written directly at its position in
+    // an uncompressed file, with no reordering and no encoder thread.
+    bool pwrite;
+    DambPcmFile *pcmfile;
+    double samples_per_frame;
+
+    // FLAC is encoded by several libFLAC encoders at once when flac_threads
+    // is more than 1, instead of by libsndfile.
+    int flac_threads;
+    int compression_level;
+    // Bits per sample of FLAC files written from float samples, which are
+    // converted to integers into flac_samples before they're encoded, by
+    // either encoder. 0 otherwise.
+    int flac_bits;
+    std::vector<int32_t> flac_samples;
+#ifdef HAVE_FLAC
+    DambFlacWriter *flacwriter;
+#endif
+
+    // NULL unless stats were requested.
+    DambStats *stats;
 } DambWriteData;
 
 
+static inline size_t queueSize(DambWriteQueue *q) {
+    return q->tail.load() - q->head.load();
+}
+
+
+static void queueWake(DambWriteQueue *q, std::atomic<bool> &waiting) {
+    if (waiting.load()) {
+        std::lock_guard<std::mutex> guard(q->lock);
+        q->wake.notify_all();
+    }
+}
+
+
+// Blocks while the queue is full.
+static void queuePush(DambWriteQueue *q, const DambWriteBlock &block) {
+    if (queueSize(q) == q->slots.size()) {
+        int64_t start = startTrace();
+
+        std::unique_lock<std::mutex> guard(q->lock);
+        q->producer_waiting.store(true);
+        while (queueSize(q) == q->slots.size())
+            q->wake.wait(guard);
+        q->producer_waiting.store(false);
+
+        traceSpan("Write", "wait for encoder", block.n, start);
+    }
+
+    size_t tail = q->tail.load(std::memory_order_relaxed);
+    q->slots[tail % q->slots.size()] = block;
+    q->tail.store(tail + 1);
+
+    queueWake(q, q->consumer_waiting);
+}
+
+
+// Blocks while the queue is empty. Returns false once the queue is empty
+// and nothing more will be pushed.
+static bool queuePop(DambWriteQueue *q, DambWriteBlock *block) {
+    if (queueSize(q) == 0) {
+        std::unique_lock<std::mutex> guard(q->lock);
+        q->consumer_waiting.store(true);
+        while (queueSize(q) == 0 && !q->finished.load())
+            q->wake.wait(guard);
+        q->consumer_waiting.store(false);
+
+        if (queueSize(q) == 0)
+            return false;
+    }
+
+    size_t head = q->head.load(std::memory_order_relaxed);
+    *block = q->slots[head % q->slots.size()];
+    q->head.store(head + 1);
+
+    queueWake(q, q->producer_waiting);
+
+    return true;
+}
+
+
+static inline void countWrite(DambWriteData *d, sf_count_t sample_count, int64_t start) {
+    if (!d->stats)
+        return;
+
+    stopStatTimer(d->stats, DambStatWriteTime, start);
+    addStat(d->stats, DambStatFrames, 1);
+    addStat(d->stats, DambStatBytesWritten, sample_count * d->sfinfo.channels * d->sample_size);
+}
+
+
+static void freeBlock(const DambWriteBlock &block, const VSAPI *vsapi) {
+    if (block.frame)
+        vsapi->freeFrame(block.frame);
+    free(block.interleaved);
+}
+
+
+// Returns the block's samples, converted to SF_FORMAT_PCM_32 if they are
+// float samples going to FLAC.
+static const void *getEncoderSamples(DambWriteData *d, const DambWriteBlock &block, int *sample_type) {
+    *sample_type = d->sample_type;
+    if (!d->flac_bits)
+        return block.samples;
+
+    size_t count = block.sample_count * d->sfinfo.channels;
+    d->flac_samples.resize(count);
+
+    if (d->sample_type == SF_FORMAT_FLOAT) {
+        const float *samples = (const float *)block.samples;
+        for (size_t i = 0; i < count; i++)
+            d->flac_samples[i] = floatToFlacSample(samples[i], d->flac_bits);
+    } else {
+        const double *samples = (const double *)block.samples;
+        for (size_t i = 0; i < count; i++)
+            d->flac_samples[i] = floatToFlacSample(samples[i], d->flac_bits);
+    }
+
+    *sample_type = SF_FORMAT_PCM_32;
+    return d->flac_samples.data();
+}
+
+
+static void encoderThread(DambWriteData *d) {
+    setTraceThreadName("Write encoder");
+
+    DambWriteQueue *q = d->queue.get();
+    DambWriteBlock block;
+
+    while (queuePop(q, &block)) {
+        setStat(d->stats, DambStatQueueDepth, queueSize(q));
+
+        // After a failure, keep consuming so that the frames are freed
+        // and the producer doesn't block.
+        if (!q->failed.load()) {
+            int64_t start = startStatTimer(d->stats);
+            int64_t trace_start = startTrace();
+
+            int sample_type;
+            const void *samples = getEncoderSamples(d, block, &sample_type);
+
+#ifdef HAVE_FLAC
+            if (d->flacwriter) {
+                std::string error;
+                if (!writeFlacSamples(d->flacwriter, samples, sample_type, block.sample_count, &error)) {
+                    q->error = std::string("Write: Failed to write the samples at frame ").append(std::to_string(block.n)).append(": ").append(error).append(".");
+                    q->failed.store(true);
+                }
+
+                countWrite(d, block.sample_count, start);
+                traceSpan("Write", "encode", block.n, trace_start);
+
+                freeBlock(block, d->vsapi);
+                continue;
+            }
+#endif
+
+            sf_count_t writef_ret;
+            if (sample_type == SF_FORMAT_PCM_16)
+                writef_ret = sf_writef_short(d->sndfile, (const short *)samples, block.sample_count);
+            else if (sample_type == SF_FORMAT_PCM_32)
+                writef_ret = sf_writef_int(d->sndfile, (const int *)samples, block.sample_count);
+            else if (sample_type == SF_FORMAT_FLOAT)
+                writef_ret = sf_writef_float(d->sndfile, (const float *)samples, block.sample_count);
+            else
+                writef_ret = sf_writef_double(d->sndfile, (const double *)samples, block.sample_count);
+
+            if (writef_ret != block.sample_count) {
+                q->error = std::string("Write: sf_writef_blah didn't write the expected number of samples at frame ").append(std::to_string(block.n)).append(". Error message from libsndfile: ").append(sf_strerror(d->sndfile));
+                q->failed.store(true);
+            }
+
+            countWrite(d, block.sample_count, start);
+            traceSpan("Write", "encode", block.n, trace_start);
+        }
+
+        freeBlock(block, d->vsapi);
+    }
+}
+
+
 static void VS_CC dambWriteInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     DambWriteData *d = (DambWriteData *) * instanceData;
     vsapi->setVideoInfo(d->vi, 1, node);
 }
 
 
-static const VSFrameRef *VS_CC dambWriteGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    DambWriteData *d = (DambWriteData *) * instanceData;
+// Sample number of the first sample of frame n, the same way Read counts them.
+static inline int64_t frameStart(DambWriteData *d, int n) {
+    return (int64_t)(d->samples_per_frame * n + 0.5);
+}
 
-    if (activationReason == arInitial) {
-        // Do it like this because the frame requests sometimes arrive out of
-        // order and the audio samples get written in the wrong order.
-        int distance = n - d->last_frame;
-        for (int frame = d->last_frame + 1; frame <= n && distance < 50; frame++)
-            vsapi->requestFrameFilter(frame, d->node, frameCtx);
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        int distance = n - d->last_frame;
-        for (int frame = d->last_frame + 1; frame <= n && distance < 50; frame++) {
-            const VSFrameRef *src = vsapi->getFrameFilter(frame, d->node, frameCtx);
-            const VSMap *props = vsapi->getFramePropsRO(src);
-            int err;
-
-            int input_channels = vsapi->propGetInt(props, damb_channels, 0, &err);
-            int input_samplerate = vsapi->propGetInt(props, damb_samplerate, 0, &err);
-            int input_format = vsapi->propGetInt(props, damb_format, 0, &err);
-            // Either they are all there, or they are all missing. Probably.
-            if (err) {
-                vsapi->setFilterError(std::string("Write: Audio data not found in frame ").append(std::to_string(frame)).append(".").c_str(), frameCtx);
-                vsapi->freeFrame(src);
-                return NULL;
-            }
 
-            if (!d->initialised) {
-                d->initialised = 1;
+static bool initialisePwrite(DambWriteData *d, int input_format) {
+    int type = d->sfinfo.format & SF_FORMAT_TYPEMASK;
+    if (type != SF_FORMAT_WAV && type != SF_FORMAT_WAVEX && type != SF_FORMAT_W64) {
+        d->init_error = "Write: pwrite only supports the formats \"wav\", \"wavex\", and \"w64\".";
+        return false;
+    }
 
-                d->original_channels = input_channels;
-                d->original_samplerate = input_samplerate;
+    // The samples are written as they are, so they can't be converted.
+    if (d->subtype && d->subtype != d->sample_type) {
+        d->init_error = "Write: pwrite can't convert the samples, so sample_type must be the same as the input's.";
+        return false;
+    }
 
-                // If the input was WAVEX, make the output WAVEX too.
-                if ((input_format & SF_FORMAT_TYPEMASK) == SF_FORMAT_WAVEX &&
-                    d->format == SF_FORMAT_WAV)
-                    d->format = SF_FORMAT_WAVEX;
+    d->sfinfo.format = type | d->sample_type;
+    d->samples_per_frame = (d->sfinfo.samplerate * d->vi->fpsDen) / (double)d->vi->fpsNum;
 
-                int new_format = 0;
-                new_format |= d->format ? d->format : (input_format & SF_FORMAT_TYPEMASK);
-                new_format |= d->subtype ? d->subtype : (input_format & SF_FORMAT_SUBMASK);
-                new_format |= input_format & SF_FORMAT_ENDMASK;
+    std::string error;
+    d->pcmfile = createPcmFile(d->filename, type, d->sfinfo.channels, d->sfinfo.samplerate, d->sample_type, frameStart(d, d->vi->numFrames), &error);
+    if (d->pcmfile == NULL) {
+        d->init_error = std::string("Write: Couldn't open audio file for writing: ").append(error).append(".");
+        return false;
+    }
 
-                d->sfinfo.channels = input_channels;
-                d->sfinfo.samplerate = input_samplerate;
-                d->sfinfo.format = new_format;
+    return true;
+}
 
-                if (!sf_format_check(&d->sfinfo)) {
-                    vsapi->setFilterError("Write: libsndfile doesn't support this combination of channels, sample rate, sample type, and format for writing.", frameCtx);
-                    vsapi->freeFrame(src);
-                    return NULL;
-                }
 
-                d->sndfile = sf_open(d->filename.c_str(), SFM_WRITE, &d->sfinfo);
-                if (d->sndfile == NULL) {
-                    vsapi->setFilterError(std::string("Write: Couldn't open audio file for writing. Error message from libsndfile: ").append(sf_strerror(NULL)).c_str(), frameCtx);
-                    vsapi->freeFrame(src);
-                    return NULL;
-                }
+// Size of the samples in the output file, or 0 if they're compressed.
+static int getSubtypeSize(int format) {
+    int type = format & SF_FORMAT_TYPEMASK;
+    if (type != SF_FORMAT_WAV && type != SF_FORMAT_WAVEX && type != SF_FORMAT_W64)
+        return 0;
 
-                if ((d->sfinfo.format & SF_FORMAT_VORBIS) == SF_FORMAT_VORBIS) {
-                    int cmd_ret = sf_command(d->sndfile, SFC_SET_VBR_ENCODING_QUALITY, &d->quality, sizeof(d->quality));
-                    if (!cmd_ret) {
-                        vsapi->setFilterError("Write: Failed to set the encoding quality.", frameCtx);
-                        vsapi->freeFrame(src);
-                        return NULL;
-                    }
-                }
+    switch (format & SF_FORMAT_SUBMASK) {
+    case SF_FORMAT_PCM_S8:
+    case SF_FORMAT_PCM_U8:
+        return 1;
+    case SF_FORMAT_PCM_16:
+        return 2;
+    case SF_FORMAT_PCM_24:
+        return 3;
+    case SF_FORMAT_PCM_32:
+    case SF_FORMAT_FLOAT:
+        return 4;
+    case SF_FORMAT_DOUBLE:
+        return 8;
+    default:
+        return 0;
+    }
+}
 
-                // These are used to pick the sf_writef_* function to use and
-                // to calculate the number of audio frames stored in the props,
-                // so they need to be based on the input format.
-                d->sample_type = getSampleType(input_format);
-                d->sample_size = getSampleSize(d->sample_type);
-            }
 
-            if (d->original_channels != input_channels ||
-                d->original_samplerate != input_samplerate ||
-                d->sample_type != getSampleType(input_format)) {
-                vsapi->setFilterError(std::string("Write: Clip contains more than one type of audio data. Mismatch found at frame ").append(std::to_string(frame)).append(".").c_str(), frameCtx);
-                vsapi->freeFrame(src);
-                return NULL;
+// Opens the output file, based on the first frame that arrives. On failure,
+// init_error says why. Must be called with reorder_lock held.
+static bool initialise(DambWriteData *d, int input_channels, int input_samplerate, int input_format, const VSAPI *vsapi) {
+    d->original_channels = input_channels;
+    d->original_samplerate = input_samplerate;
+
+    // If the input was WAVEX, make the output WAVEX too.
+    if ((input_format & SF_FORMAT_TYPEMASK) == SF_FORMAT_WAVEX &&
+        d->format == SF_FORMAT_WAV)
+        d->format = SF_FORMAT_WAVEX;
+
+    int new_format = 0;
+    new_format |= d->format ? d->format : (input_format & SF_FORMAT_TYPEMASK);
+    new_format |= d->subtype ? d->subtype : (input_format & SF_FORMAT_SUBMASK);
+    new_format |= input_format & SF_FORMAT_ENDMASK;
+
+    d->sfinfo.channels = input_channels;
+    d->sfinfo.samplerate = input_samplerate;
+    d->sfinfo.format = new_format;
+
+    // These are used to pick the sf_writef_* function to use and
+    // to calculate the number of audio frames stored in the props,
+    // so they need to be based on the input format.
+    d->sample_type = getSampleType(input_format);
+    d->sample_size = getSampleSize(d->sample_type);
+
+    if (d->pwrite)
+        return initialisePwrite(d, input_format);
+
+    if (!sf_format_check(&d->sfinfo)) {
+        d->init_error = "Write: libsndfile doesn't support this combination of channels, sample rate, sample type, and format for writing.";
+        return false;
+    }
+
+    bool flac = (d->sfinfo.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC;
+    int flac_subtype = d->sfinfo.format & SF_FORMAT_SUBMASK;
+    int bits = flac_subtype == SF_FORMAT_PCM_S8 ? 8 : (flac_subtype == SF_FORMAT_PCM_16 ? 16 : 24);
+
+    if (flac && (d->sample_type == SF_FORMAT_FLOAT || d->sample_type == SF_FORMAT_DOUBLE))
+        d->flac_bits = bits;
+
+#ifdef HAVE_FLAC
+    // The FLAC writer needs to seek back to the start when it's done.
+    if (flac && d->flac_threads > 1 && !isOutputStream(d->filename)) {
+        std::string error;
+        d->flacwriter = createFlacWriter(d->filename, d->sfinfo.channels, d->sfinfo.samplerate, bits, d->compression_level, d->flac_threads, &error);
+        if (d->flacwriter == NULL) {
+            d->init_error = std::string("Write: Couldn't open audio file for writing: ").append(error).append(".");
+            return false;
+        }
+
+        d->encoder = std::thread(encoderThread, d);
+
+        return true;
+    }
+#endif
+
+    // The final size of uncompressed files is known from the length of the
+    // clip, give or take the header.
+    int subtype_size = getSubtypeSize(d->sfinfo.format);
+    if (d->stream_options.preallocate && subtype_size && d->vi->numFrames && d->vi->fpsNum && d->vi->fpsDen) {
+        d->samples_per_frame = (d->sfinfo.samplerate * d->vi->fpsDen) / (double)d->vi->fpsNum;
+        d->stream_options.preallocate = 4096 + frameStart(d, d->vi->numFrames) * d->sfinfo.channels * subtype_size;
+    } else {
+        d->stream_options.preallocate = 0;
+    }
+
+    std::string error;
+    d->stream = openOutputStream(d->filename, d->stream_options, &error);
+    if (d->stream == NULL) {
+        d->init_error = std::string("Write: Couldn't open audio file for writing: ").append(error).append(".");
+        return false;
+    }
+
+#if VAPOURSYNTH_API_MINOR >= 6
+    if (!isStreamSeekable(d->stream))
+        vsapi->logMessage(mtDebug, std::string("Write: ").append(d->filename).append(" can't seek, so the header won't have the final sizes unless all the audio fits in the buffer.").c_str());
+#endif
+
+    d->sndfile = openStreamSndfile(d->stream, &d->sfinfo);
+    if (d->sndfile == NULL) {
+        d->init_error = std::string("Write: Couldn't open audio file for writing. Error message from libsndfile: ").append(sf_strerror(NULL));
+        return false;
+    }
+
+    if (flac) {
+        // libsndfile takes the level as a number between 0 and 1.
+        double level = d->compression_level / 8.0;
+        sf_command(d->sndfile, SFC_SET_COMPRESSION_LEVEL, &level, sizeof(level));
+    }
+
+    if ((d->sfinfo.format & SF_FORMAT_VORBIS) == SF_FORMAT_VORBIS) {
+        int cmd_ret = sf_command(d->sndfile, SFC_SET_VBR_ENCODING_QUALITY, &d->quality, sizeof(d->quality));
+        if (!cmd_ret) {
+            d->init_error = "Write: Failed to set the encoding quality.";
+            return false;
+        }
+    }
+
+    d->encoder = std::thread(encoderThread, d);
+
+    return true;
+}
+
+
+// Checks the frame's audio and fills block. Frees src if there is a problem.
+// Must be called with reorder_lock held.
+static bool checkFrame(DambWriteData *d, int frame, const VSFrameRef *src, DambWriteBlock *block, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    const VSMap *props = vsapi->getFramePropsRO(src);
+    int err;
+
+    int input_channels = vsapi->propGetInt(props, damb_channels, 0, &err);
+    int input_samplerate = vsapi->propGetInt(props, damb_samplerate, 0, &err);
+    int input_format = vsapi->propGetInt(props, damb_format, 0, &err);
+    // Either they are all there, or they are all missing. Probably.
+    if (err) {
+        vsapi->setFilterError(std::string("Write: Audio data not found in frame ").append(std::to_string(frame)).append(".").c_str(), frameCtx);
+        vsapi->freeFrame(src);
+        return false;
+    }
+
+    // The output is only opened once. If that failed, every frame gets the
+    // error, because without an encoder thread or a file there's nowhere
+    // for the samples to go.
+    if (!d->initialised) {
+        d->initialised = 1;
+        initialise(d, input_channels, input_samplerate, input_format, vsapi);
+    }
+
+    if (!d->init_error.empty()) {
+        vsapi->setFilterError(d->init_error.c_str(), frameCtx);
+        vsapi->freeFrame(src);
+        return false;
+    }
+
+    if (d->original_channels != input_channels ||
+        d->original_samplerate != input_samplerate ||
+        d->sample_type != getSampleType(input_format)) {
+        vsapi->setFilterError(std::string("Write: Clip contains more than one type of audio data. Mismatch found at frame ").append(std::to_string(frame)).append(".").c_str(), frameCtx);
+        vsapi->freeFrame(src);
+        return false;
+    }
+
+    DambFrameSamples samples;
+    if (!getFrameSamples(props, input_channels, d->sample_size, -1, NULL, &samples, vsapi)) {
+        vsapi->setFilterError(std::string("Write: Audio data not found in frame ").append(std::to_string(frame)).append(".").c_str(), frameCtx);
+        vsapi->freeFrame(src);
+        return false;
+    }
+
+    block->frame = src;
+    block->interleaved = NULL;
+    block->sample_count = samples.length;
+    block->n = frame;
+
+    // The file is interleaved, so planar frames are converted here, by the
+    // thread that requested them, rather than by the encoder thread.
+    if (samples.layout == DambLayoutPlanar) {
+        block->interleaved = (char *)malloc(samples.length * input_channels * d->sample_size);
+        interleaveSamples(samples.data.data(), block->interleaved, input_channels, samples.length, d->sample_size);
+        block->samples = block->interleaved;
+    } else {
+        block->samples = (const char *)samples.data[0];
+    }
+
+    return true;
+}
+
+
+// Puts the frame in the reorder window. Takes ownership of src.
+// Must be called with reorder_lock held.
+static bool addFrame(DambWriteData *d, int frame, const VSFrameRef *src, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    // Frames are only written once, even if they are requested again.
+    if (frame < d->next_frame || d->reorder.count(frame)) {
+        vsapi->freeFrame(src);
+        return true;
+    }
+
+    DambWriteBlock block;
+    if (!checkFrame(d, frame, src, &block, frameCtx, vsapi))
+        return false;
+
+    // A frame that has to wait for the frames before it only keeps its
+    // audio, so that the frames in the window don't hold on to their video
+    // as well.
+    if (frame != d->next_frame) {
+        if (!block.interleaved) {
+            size_t size = block.sample_count * d->sfinfo.channels * d->sample_size;
+            block.interleaved = (char *)malloc(size);
+            memcpy(block.interleaved, block.samples, size);
+            block.samples = block.interleaved;
+        }
+
+        vsapi->freeFrame(block.frame);
+        block.frame = NULL;
+    }
+
+    d->reorder[frame] = block;
+
+    // Send the complete run at the start of the window to the encoder
+    // thread, which frees the frames once they're written.
+    maxStat(d->stats, DambStatReorderDepthMax, d->reorder.size());
+
+    auto it = d->reorder.begin();
+    while (it != d->reorder.end() && it->first == d->next_frame) {
+        queuePush(d->queue.get(), it->second);
+        it = d->reorder.erase(it);
+        d->next_frame++;
+
+        if (d->stats) {
+            size_t depth = queueSize(d->queue.get());
+            setStat(d->stats, DambStatQueueDepth, depth);
+            maxStat(d->stats, DambStatQueueDepthMax, depth);
+        }
+    }
+
+    return true;
+}
+
+
+// Adds the counters to the frame that goes downstream, if stats were
+// requested. Takes ownership of src.
+static const VSFrameRef *outputFrame(DambWriteData *d, const VSFrameRef *src, VSCore *core, const VSAPI *vsapi) {
+    if (!d->stats)
+        return src;
+
+    VSFrameRef *dst = vsapi->copyFrame(src, core);
+    vsapi->freeFrame(src);
+
+    setStatsProps(d->stats, vsapi->getFramePropsRW(dst), vsapi);
+
+    return dst;
+}
+
+
+// The last frame requested along with frame n, when first_needed was the
+// first frame not yet written.
+static inline int lastDependency(DambWriteData *d, int n, int first_needed) {
+    return std::min(n - d->window, first_needed + d->window - 1);
+}
+
+
+static const VSFrameRef *VS_CC dambWriteGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    DambWriteData *d = (DambWriteData *) * instanceData;
+
+    if (d->queue->failed.load()) {
+        vsapi->setFilterError(d->queue->error.c_str(), frameCtx);
+        return NULL;
+    }
+
+    if (d->pwrite) {
+        if (activationReason == arInitial) {
+            traceAsyncBegin("Write", "request", d, n);
+            vsapi->requestFrameFilter(n, d->node, frameCtx);
+        } else if (activationReason == arAllFramesReady) {
+            traceAsyncEnd("Write", "request", d, n);
+
+            const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+
+            DambWriteBlock block;
+            {
+                std::lock_guard<std::mutex> guard(*d->reorder_lock);
+                if (!checkFrame(d, n, src, &block, frameCtx, vsapi))
+                    return NULL;
             }
 
-            const char *buffer = vsapi->propGetData(props, damb_samples, 0, &err);
-            sf_count_t buffer_size = vsapi->propGetDataSize(props, damb_samples, 0, &err);
-            buffer_size = buffer_size / (d->sfinfo.channels * d->sample_size);
-            if (err) {
-                vsapi->setFilterError(std::string("Write: Audio data not found in frame ").append(std::to_string(frame)).append(".").c_str(), frameCtx);
-                vsapi->freeFrame(src);
+            int64_t sample_start = frameStart(d, n);
+            if (block.sample_count != frameStart(d, n + 1) - sample_start) {
+                vsapi->setFilterError(std::string("Write: Frame ").append(std::to_string(n)).append(" doesn't contain the number of samples pwrite expects.").c_str(), frameCtx);
+                freeBlock(block, vsapi);
                 return NULL;
             }
 
-            sf_count_t writef_ret;
-            if (d->sample_type == SF_FORMAT_PCM_16)
-                writef_ret = sf_writef_short(d->sndfile, (short *)buffer, buffer_size);
-            else if (d->sample_type == SF_FORMAT_PCM_32)
-                writef_ret = sf_writef_int(d->sndfile, (int *)buffer, buffer_size);
-            else if (d->sample_type == SF_FORMAT_FLOAT)
-                writef_ret = sf_writef_float(d->sndfile, (float *)buffer, buffer_size);
-            else
-                writef_ret = sf_writef_double(d->sndfile, (double *)buffer, buffer_size);
+            int64_t start = startStatTimer(d->stats);
+            int64_t trace_start = startTrace();
 
-            if (writef_ret != buffer_size) {
-                vsapi->setFilterError(std::string("Write: sf_writef_blah didn't write the expected number of samples at frame ").append(std::to_string(frame)).append(".").c_str(), frameCtx);
-                vsapi->freeFrame(src);
+            if (!writePcmSamples(d->pcmfile, sample_start, block.samples, block.sample_count)) {
+                vsapi->setFilterError(std::string("Write: Failed to write the samples of frame ").append(std::to_string(n)).append(".").c_str(), frameCtx);
+                freeBlock(block, vsapi);
                 return NULL;
             }
 
-            vsapi->freeFrame(src);
-            d->last_frame = n;
+            countWrite(d, block.sample_count, start);
+            traceSpan("Write", "pwrite", n, trace_start);
+
+            free(block.interleaved);
+
+            return outputFrame(d, src, core, vsapi);
+        }
+
+        return 0;
+    }
+
+    if (activationReason == arInitial) {
+        traceAsyncBegin("Write", "request", d, n);
+
+        // If frame n doesn't fit in the window, the next frames to be
+        // written become dependencies of frame n, at most window of them,
+        // so that a single request never holds more than that many frames.
+        // Requests far ahead, like in reverse order, each move the window
+        // forward by that much until they fit. This doesn't block any
+        // threads.
+        int first_needed;
+        {
+            std::lock_guard<std::mutex> guard(*d->reorder_lock);
+            first_needed = d->next_frame;
+        }
+
+        for (int frame = first_needed; frame <= lastDependency(d, n, first_needed); frame++)
+            vsapi->requestFrameFilter(frame, d->node, frameCtx);
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+
+        // Remembered so that only frames that were requested are fetched.
+        *frameData = (void *)(intptr_t)first_needed;
+    } else if (activationReason == arAllFramesReady) {
+        int first_requested = (int)(intptr_t)*frameData;
+
+        traceAsyncEnd("Write", "request", d, n);
+        int64_t trace_start = startTrace();
+
+        std::unique_lock<std::mutex> guard(*d->reorder_lock);
+        traceSpan("Write", "wait for reorder lock", n, trace_start);
+
+        for (int frame = std::max(first_requested, d->next_frame); frame <= lastDependency(d, n, first_requested); frame++) {
+            if (d->reorder.count(frame))
+                continue;
+
+            if (!addFrame(d, frame, vsapi->getFrameFilter(frame, d->node, frameCtx), frameCtx, vsapi))
+                return NULL;
         }
 
+        if (!addFrame(d, n, vsapi->getFrameFilter(n, d->node, frameCtx), frameCtx, vsapi))
+            return NULL;
+
+        guard.unlock();
+        traceSpan("Write", "frame", n, trace_start);
 
-        return vsapi->getFrameFilter(n, d->node, frameCtx);
+        return outputFrame(d, vsapi->getFrameFilter(n, d->node, frameCtx), core, vsapi);
     }
 
     return 0;
@@ -164,10 +694,82 @@ static const VSFrameRef *VS_CC dambWriteGetFrame(int n, int activationReason, vo
 static void VS_CC dambWriteFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     DambWriteData *d = (DambWriteData *)instanceData;
 
+#if VAPOURSYNTH_API_MINOR >= 6
+    // Writing them would leave a hole in the audio.
+    if (!d->reorder.empty())
+        vsapi->logMessage(mtWarning, std::string("Write: Frame ").append(std::to_string(d->next_frame)).append(" was never requested. The audio from the frames after it was not written.").c_str());
+#endif
+
+    for (auto it = d->reorder.begin(); it != d->reorder.end(); ++it)
+        freeBlock(it->second, vsapi);
+
+    if (d->encoder.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(d->queue->lock);
+            d->queue->finished.store(true);
+            d->queue->wake.notify_all();
+        }
+        d->encoder.join();
+    }
+
+#if VAPOURSYNTH_API_MINOR >= 6
+    // Nobody is left to receive the error, so at least log it.
+    if (d->queue->failed.load())
+        vsapi->logMessage(mtWarning, d->queue->error.c_str());
+#endif
+
     if (d->sndfile)
         sf_close(d->sndfile);
+
+    if (d->stream) {
+        std::string error;
+        DambStreamTotals totals;
+        bool ok = closeOutputStream(d->stream, &totals, &error);
+
+#if VAPOURSYNTH_API_MINOR >= 6
+        if (!ok) {
+            vsapi->logMessage(mtWarning, std::string("Write: Failed to finish ").append(d->filename).append(": ").append(error).append(".").c_str());
+        } else if (totals.bytes) {
+            double mib = totals.bytes / (1024.0 * 1024.0);
+            char message[200];
+            snprintf(message, sizeof(message), "%.1f MiB in %.2f s (%.1f MiB/s), of which %.2f s writing and syncing (%.1f MiB/s).",
+                     mib, totals.seconds, mib / std::max(totals.seconds, 1e-9), totals.io_seconds, mib / std::max(totals.io_seconds, 1e-9));
+            vsapi->logMessage(mtDebug, std::string("Write: Wrote ").append(d->filename).append(": ").append(message).c_str());
+        }
+#else
+        (void)ok;
+#endif
+    }
+
+#ifdef HAVE_FLAC
+    if (d->flacwriter) {
+        std::string error;
+        if (!closeFlacWriter(d->flacwriter, &error)) {
+#if VAPOURSYNTH_API_MINOR >= 6
+            vsapi->logMessage(mtWarning, std::string("Write: Failed to finish ").append(d->filename).append(": ").append(error).append(".").c_str());
+#endif
+        }
+    }
+#endif
+
+    if (d->pcmfile) {
+        std::string error;
+        if (!closePcmFile(d->pcmfile, &error)) {
+#if VAPOURSYNTH_API_MINOR >= 6
+            vsapi->logMessage(mtWarning, std::string("Write: Failed to finish ").append(d->filename).append(": ").append(error).append(".").c_str());
+#endif
+        }
+    }
+
+    if (d->stats) {
+        unregisterStats(d->stats);
+        delete d->stats;
+    }
+
     vsapi->freeNode(d->node);
     delete d;
+
+    flushTrace();
 }
 
 
@@ -247,20 +849,146 @@ static void VS_CC dambWriteCreate(const VSMap *in, VSMap *out, void *userData, V
     if (err)
         d.quality = 0.7;
 
+    int queue_depth = int64ToIntS(vsapi->propGetInt(in, "queue_depth", 0, &err));
+    if (err)
+        queue_depth = 16;
+
+    if (queue_depth < 1) {
+        vsapi->setError(out, "Write: queue_depth must be at least 1.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    int window = int64ToIntS(vsapi->propGetInt(in, "window", 0, &err));
+    if (err)
+        window = 64;
+
+    if (window < 1) {
+        vsapi->setError(out, "Write: window must be at least 1.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.pwrite = !!vsapi->propGetInt(in, "pwrite", 0, &err);
+
+    if (d.pwrite && isOutputStream(d.filename)) {
+        vsapi->setError(out, "Write: pwrite needs a regular file, not a pipe or file descriptor.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.pwrite && (!d.vi->numFrames || !d.vi->fpsNum || !d.vi->fpsDen)) {
+        vsapi->setError(out, "Write: pwrite needs a clip with known length and constant frame rate.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.stream_options.preallocate = !!vsapi->propGetInt(in, "preallocate", 0, &err);
+    if (err)
+        d.stream_options.preallocate = 1;
+
+    int buffer_size = int64ToIntS(vsapi->propGetInt(in, "buffer_size", 0, &err));
+    if (err)
+        buffer_size = 1024;
+
+    if (buffer_size < 1) {
+        vsapi->setError(out, "Write: buffer_size must be at least 1.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.stream_options.buffer_bytes = (size_t)buffer_size * 1024;
+
+    const char *sync = vsapi->propGetData(in, "sync", 0, &err);
+    d.stream_options.sync = err ? DambSyncNone : getSyncFromString(sync);
+
+    if (d.stream_options.sync < 0) {
+        vsapi->setError(out, "Write: sync must be \"none\", \"periodic\", or \"close\".");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    int sync_interval = int64ToIntS(vsapi->propGetInt(in, "sync_interval", 0, &err));
+    if (err)
+        sync_interval = 64;
+
+    if (sync_interval < 1) {
+        vsapi->setError(out, "Write: sync_interval must be at least 1.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.stream_options.sync_interval = (int64_t)sync_interval * 1024 * 1024;
+
+    // libsndfile encodes the FLAC unless more threads are asked for.
+    d.flac_threads = int64ToIntS(vsapi->propGetInt(in, "flac_threads", 0, &err));
+    if (err)
+        d.flac_threads = 1;
+
+    if (d.flac_threads < 0) {
+        vsapi->setError(out, "Write: flac_threads must not be negative.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.flac_threads == 0)
+        d.flac_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    d.compression_level = int64ToIntS(vsapi->propGetInt(in, "compression_level", 0, &err));
+    if (err)
+        d.compression_level = 5;
+
+    if (d.compression_level < 0 || d.compression_level > 8) {
+        vsapi->setError(out, "Write: compression_level must be between 0 and 8.");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+
+    d.stats = NULL;
+    if (vsapi->propGetInt(in, "stats", 0, &err))
+        d.stats = createStats((1u << DambStatFrames) |
+                              (1u << DambStatBytesWritten) |
+                              (1u << DambStatWriteTime) |
+                              (1u << DambStatQueueDepth) |
+                              (1u << DambStatQueueDepthMax) |
+                              (1u << DambStatReorderDepthMax));
 
     d.initialised = 0;
     d.sndfile = NULL;
+    d.stream = NULL;
+    d.pcmfile = NULL;
+    d.flac_bits = 0;
+#ifdef HAVE_FLAC
+    d.flacwriter = NULL;
+#endif
 
     // The rest of the initialisation happens the first time a frame
     // is requested.
 
-    d.last_frame = -1;
+    d.reorder_lock.reset(new std::mutex());
+    d.next_frame = 0;
+    d.window = window;
+
+    d.vsapi = vsapi;
+
+    d.queue.reset(new DambWriteQueue());
+    d.queue->slots.resize(queue_depth);
+    d.queue->head.store(0);
+    d.queue->tail.store(0);
+    d.queue->producer_waiting.store(false);
+    d.queue->consumer_waiting.store(false);
+    d.queue->finished.store(false);
+    d.queue->failed.store(false);
 
 
     data = new DambWriteData();
-    *data = d;
+    *data = std::move(d);
+
+    vsapi->createFilter(in, out, "Write", dambWriteInit, dambWriteGetFrame, dambWriteFree, fmParallel, 0, data, core);
 
-    vsapi->createFilter(in, out, "Write", dambWriteInit, dambWriteGetFrame, dambWriteFree, fmSerial, 0, data, core);
+    if (data->stats)
+        registerStats(data->stats, out, vsapi);
 }
 
 
@@ -271,5 +999,15 @@ void writeRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
             "format:data:opt;"
             "sample_type:data:opt;"
             "quality:float:opt;"
+            "queue_depth:int:opt;"
+            "window:int:opt;"
+            "pwrite:int:opt;"
+            "flac_threads:int:opt;"
+            "compression_level:int:opt;"
+            "preallocate:int:opt;"
+            "buffer_size:int:opt;"
+            "sync:data:opt;"
+            "sync_interval:int:opt;"
+            "stats:int:opt;"
             , dambWriteCreate, 0, plugin);
 }